@@ -0,0 +1,65 @@
+#!/bin/sh
+
+# Compare TLB refill cost with the fast refill path off and on.
+# Each run prints the menu's "Operation took" time for the program
+# and the number of refills/inserts it caused (vs).
+#
+# Then compare fork latency and frames consumed by bigfork with
+# copy-on-write fork off and on.
+#
+# Finally compare first-touch fault latency with the pre-zeroed frame
+# pool off and on; vs shows how many faults were given a zeroed frame.
+#
+# And compare TLB misses (refills plus inserts) across context switches
+# with ASID tagging off, where every switch flushes the TLB, and on.
+#
+# Then compare reading a large file with read() and through mmap(), on
+# emu0 and on SFS; vs shows how many mapped pages were read in. mmapself
+# checks that reading and writing the file through its own mapping works.
+#
+# And compare exec-heavy startup with program segments loaded up front
+# and read in on first touch; vs shows how many program pages were read
+# and how many frames are free.
+#
+# Then compare starting many copies of the same program with the shared
+# text page cache off and on; vs shows how many program page faults
+# found the page already cached.
+#
+# Then time exec with argument vectors as close to ARG_MAX as they go,
+# made of thousands of short words and of a few long ones.
+#
+# The TLB replacement policy is a build option (tlbrr/tlblru in
+# kern/conf/ASST3), so run this once per kernel build to compare them;
+# vtlb prints each process's TLB misses when it exits.
+
+bmake k > /dev/null && bmake u > /dev/null
+cd ../root
+
+for prog in /testbin/matmult /testbin/huge; do
+	sys161 kernel "vfr off; vs reset; p $prog; vs; vfr on; vs reset; p $prog; vs; q"
+done
+
+sys161 kernel "vcow off; vs reset; p /testbin/bigfork; vs; vcow on; vs reset; p /testbin/bigfork; vs; q"
+
+for prog in /testbin/zero /testbin/huge /testbin/sparsefile; do
+	sys161 kernel "vzp off; vs reset; p $prog; vs; vzp on; vs reset; p $prog; vs; q"
+done
+
+for prog in /testbin/schedpong /testbin/farm; do
+	sys161 kernel "vasid off; vs reset; p $prog; vs; vasid on; vs reset; p $prog; vs; q"
+done
+
+sys161 kernel "p /testbin/bigfile big 1000000; vs reset; p /testbin/mmapbench big; vs; p /testbin/mmapself big; q"
+sys161 kernel "p /sbin/mksfs lhd1raw: bench; mount sfs lhd1:; cd lhd1:; p /testbin/bigfile big 1000000; vs reset; p /testbin/mmapbench big; vs; p /testbin/mmapself big; q"
+
+for prog in "/testbin/multiexec -j 8" "/testbin/bigexec"; do
+	sys161 kernel "vlazy off; vs reset; p $prog; vs; vlazy on; vs reset; p $prog; vs; q"
+done
+
+for prog in /testbin/farm "/testbin/multiexec -j 8"; do
+	sys161 kernel "vtext off; vs reset; p $prog; vs; vtext on; vs reset; p $prog; vs; q"
+done
+
+sys161 kernel "p /testbin/execbench 20 8; p /testbin/execbench 20 4000; p /testbin/bigexec; q"
+
+sys161 kernel "vtlb on; p /testbin/matmult; p /testbin/sort; q"
@@ -0,0 +1,64 @@
+#!/bin/sh
+
+# Buffer cache hit rate and disk traffic for the file system tests.
+# The tests run on an SFS volume on lhd1, formatted first; bs prints
+# hits/misses and device reads/writes for each run, after a sync so
+# the write-back is counted too. ba shows how many new blocks had to be
+# zeroed; whole-block writes fill theirs without.
+
+bmake k > /dev/null && bmake u > /dev/null
+cd ../root
+
+for prog in "/testbin/bigfile bigfile 200000" "/testbin/dirconc lhd1:" "/testbin/psort -k 2000"; do
+	sys161 kernel "p /sbin/mksfs lhd1raw: bench; mount sfs lhd1:; cd lhd1:; bs reset; ba reset; p $prog; sync; bs; ba; q"
+done
+
+# Name cache hit rate for directory-heavy tests. The full-size bigdir
+# runs on emu0, since 10000 inodes don't fit on a 5M lhd1.
+for prog in "/testbin/dirtest" "/testbin/dirconc lhd1:" "/testbin/bigdir 1000"; do
+	sys161 kernel "p /sbin/mksfs lhd1raw: bench; mount sfs lhd1:; cd lhd1:; nc reset; bs reset; p $prog; nc; bs; q"
+done
+sys161 kernel "nc reset; p /testbin/bigdir; nc; q"
+
+# Multi-megabyte files, through the double and triple indirect blocks.
+# sfsck checks the volume afterwards.
+for prog in "/testbin/bigfile big 3000000" "/testbin/sparsefile sparse 4000000" "/testbin/bigseek"; do
+	sys161 kernel "p /sbin/mksfs lhd1raw: bench; mount sfs lhd1:; cd lhd1:; bs reset; p $prog; sync; bs; cd /; unmount lhd1:; p /sbin/sfsck lhd1raw:; q"
+done
+
+# Read-ahead: copying a file sequentially with the window off and on.
+# bs shows how many read-ahead blocks were used, and how many reads and
+# writes it took; the writes are batched by the syncer either way.
+for window in 0 8 16; do
+	sys161 kernel "p /sbin/mksfs lhd1raw: bench; mount sfs lhd1:; cd lhd1:; p /testbin/bigfile big 60000; sync; ra $window; bs reset; ba reset; p /bin/cp big copy; sync; bs; ba; q"
+done
+
+# Block allocation on a nearly full volume: a file filling most of lhd1
+# first, then one written after it. ba shows how many blocks landed
+# right after the file's previous one, and how long each freemap search
+# took; sfsck checks the volume afterwards.
+for size in 200000 600000; do
+	sys161 kernel "p /sbin/mksfs lhd1raw: bench; mount sfs lhd1:; cd lhd1:; p /testbin/bigfile fill 4000000; ba reset; p /testbin/bigfile big $size; sync; ba; cd /; unmount lhd1:; p /sbin/sfsck lhd1raw:; q"
+done
+
+# Metadata journal. dirconc is all creates, renames and removes; js
+# shows how many of them each commit carried and how long commits took,
+# and "Operation took" gives the throughput. Then a simulated crash:
+# "js crash" panics as soon as the next commit is in the journal, before
+# its blocks are written home. It is replayed by the next mount (which
+# prints the time taken) or by sfsck, which should find the volume clean.
+sys161 kernel "p /sbin/mksfs lhd1raw: bench; mount sfs lhd1:; cd lhd1:; js reset; bs reset; p /testbin/dirconc lhd1:; sync; js; bs; q"
+sys161 kernel "p /sbin/mksfs lhd1raw: bench; mount sfs lhd1:; cd lhd1:; p /testbin/dirconc lhd1:; js crash; sync"
+sys161 kernel "mount sfs lhd1:; unmount lhd1:; p /sbin/sfsck lhd1raw:; q"
+sys161 kernel "mount sfs lhd1:; cd lhd1:; p /testbin/dirconc lhd1:; js crash; sync"
+sys161 kernel "p /sbin/sfsck lhd1raw:; q"
+
+# Scaling of concurrent file workloads with the number of CPUs. With
+# per-vnode locks instead of vfs_biglock, processes working on
+# different files no longer wait for each other's disk I/O, so the
+# "Operation took" times should drop as CPUs are added.
+for ncpu in 1 2 4; do
+	sed "s/^31	mainboard  ramsize=\([0-9]*\)  cpus=1/31	mainboard  ramsize=\1  cpus=$ncpu/" sys161.conf > sys161-smp.conf
+	sys161 -c sys161-smp.conf kernel "p /sbin/mksfs lhd1raw: bench; mount sfs lhd1:; cd lhd1:; p /testbin/psort -p $ncpu -k 4000; p /testbin/dirconc lhd1:; q"
+done
+rm -f sys161-smp.conf
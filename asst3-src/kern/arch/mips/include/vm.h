@@ -126,11 +126,12 @@ paddr_t ram_getfirstfree(void);
  * We'll take up to 16 invalidations before just flushing the whole TLB.
  */
 
+struct semaphore;
+
 struct tlbshootdown {
-	/*
-	 * Change this to what you need for your VM design.
-	 */
-	int ts_placeholder;
+	vaddr_t ts_vaddr;		/* page to invalidate */
+	uint32_t ts_asid;		/* address space of the page */
+	struct semaphore *ts_done;	/* V'd once the page is invalidated */
 };
 
 #define TLBSHOOTDOWN_MAX 16
@@ -142,6 +142,16 @@ syscall(struct trapframe *tf)
 		err = sys_getpid(&retval);
 		break;
 
+	    case SYS_sbrk:
+		{
+			/* the old break is a user address */
+			vaddr_t oldbreak;
+
+			err = sys_sbrk((intptr_t)tf->tf_a0, &oldbreak);
+			retval = (int32_t)oldbreak;
+		}
+		break;
+
 
 	    /* file calls */
 
@@ -261,6 +271,31 @@ syscall(struct trapframe *tf)
 		}
 		break;
 
+	    case SYS_mmap:
+		{
+			/*
+			 * The offset is 64 bits and a2 is taken, so it
+			 * is on the stack, like lseek's whence. The
+			 * address returned is a user address.
+			 */
+			uint64_t offset;
+			vaddr_t addr;
+
+			err = copyin((userptr_t)tf->tf_sp + 16,
+				     &offset, sizeof(offset));
+			if (err) {
+				break;
+			}
+
+			err = sys_mmap(tf->tf_a0, tf->tf_a1, tf->tf_a2,
+				       offset, &addr);
+			retval = (int32_t)addr;
+		}
+		break;
+	    case SYS_munmap:
+		err = sys_munmap((vaddr_t)tf->tf_a0);
+		break;
+
 
 
 	    default:
@@ -356,6 +356,57 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 	return 0;
 }
 
+int
+as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *oldbreak)
+{
+	/* dumbvm has no heap region */
+	(void)as;
+	(void)amount;
+	(void)oldbreak;
+	return ENOSYS;
+}
+
+int
+as_mmap(struct addrspace *as, struct vnode *file, off_t offset, size_t length,
+	int writeable, vaddr_t *addr)
+{
+	/* dumbvm can't map files either */
+	(void)as;
+	(void)file;
+	(void)offset;
+	(void)length;
+	(void)writeable;
+	(void)addr;
+	return ENOSYS;
+}
+
+int
+as_munmap(struct addrspace *as, vaddr_t addr)
+{
+	(void)as;
+	(void)addr;
+	return ENOSYS;
+}
+
+int
+as_msync(struct addrspace *as, struct vnode *file)
+{
+	/* nothing is ever mapped */
+	(void)as;
+	(void)file;
+	return 0;
+}
+
+int
+as_prefault(struct addrspace *as, userptr_t buf, size_t len)
+{
+	/* no page is ever read from a file on demand */
+	(void)as;
+	(void)buf;
+	(void)len;
+	return 0;
+}
+
 int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
@@ -29,6 +29,23 @@
 
 /*
  * LAMEbus hard disk (lhd) driver.
+ *
+ * The hardware transfers one sector per operation. Transfers are
+ * queued as requests (struct blkreq) and run by the interrupt
+ * handler: when a sector completes, it starts the next sector of the
+ * same request straight away, and when a request completes it starts
+ * the next request and wakes up the thread waiting for the finished
+ * one. So a multi-sector transfer costs the waiting thread one sleep
+ * instead of one per sector. Each queued request has a wait channel
+ * (slot) of its own, so only its thread is woken.
+ *
+ * Waiting requests are kept sorted by sector and served in C-LOOK
+ * (one-way elevator) order: the next request is the first one at or
+ * past the sector the disk head was last left at, wrapping around to
+ * the lowest once none are left above it. Requests for adjacent
+ * sectors are therefore run back to back. A steady stream of ascending
+ * requests could keep the head from ever wrapping, so a sweep wraps
+ * anyway after LHD_SWEEPMAX requests if lower ones are waiting.
  */
 
 #include <types.h>
@@ -36,7 +53,9 @@
 #include <lib.h>
 #include <uio.h>
 #include <membar.h>
-#include <synch.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <blkio.h>
 #include <platform/bus.h>
 #include <vfs.h>
 #include <lamebus/lhd.h>
@@ -96,15 +115,112 @@ int lhd_code_to_errno(struct lhd_softc *lh, int code)
 }
 
 /*
- * Record that an I/O has completed: save the result and poke the
- * completion semaphore.
+ * Start the next sector of the current request. For writes, this
+ * means copying the data into the on-card buffer first.
+ */
+static
+void
+lhd_start(struct lhd_softc *lh)
+{
+	struct blkreq *req = lh->lh_cur;
+	uint32_t statval = LHD_WORKING;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+	KASSERT(req != NULL && req->br_xfered < req->br_nblocks);
+
+	if (req->br_rw == UIO_WRITE) {
+		memcpy(lh->lh_buf, req->br_data + req->br_xfered*LHD_SECTSIZE,
+		       LHD_SECTSIZE);
+		membar_store_store();
+		statval |= LHD_ISWRITE;
+	}
+
+	/* Tell it what sector we want... */
+	lhd_wreg(lh, LHD_REG_SECT, req->br_block + req->br_xfered);
+
+	/* and start the operation. */
+	lhd_wreg(lh, LHD_REG_STAT, statval);
+}
+
+/*
+ * If the disk is idle, take the next request off the queue, in
+ * C-LOOK order, and start it.
+ */
+static
+void
+lhd_dispatch(struct lhd_softc *lh)
+{
+	struct blkreq **pp, **first;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+
+	if (lh->lh_cur != NULL || lh->lh_queue == NULL) {
+		return;
+	}
+
+	/* First request at or after the head; else wrap to the lowest */
+	first = &lh->lh_queue;
+	for (pp = first; *pp != NULL; pp = &(*pp)->br_next) {
+		if ((*pp)->br_block >= lh->lh_headpos) {
+			break;
+		}
+	}
+	if (*pp == NULL || (lh->lh_sweepn >= LHD_SWEEPMAX && pp != first)) {
+		/* Nothing left above, or lower requests have waited long enough */
+		pp = first;
+		lh->lh_sweepn = 0;
+	}
+	lh->lh_sweepn++;
+
+	lh->lh_cur = *pp;
+	*pp = lh->lh_cur->br_next;
+	lh->lh_cur->br_next = NULL;
+	lhd_start(lh);
+}
+
+/*
+ * Record that a sector has completed. Move the data out of the
+ * on-card buffer if it was a read, then start the next sector; if
+ * the request is finished (or failed) instead, wake up whoever is
+ * waiting for it and start the next request.
  */
 static
 void
 lhd_iodone(struct lhd_softc *lh, int err)
 {
-	lh->lh_result = err;
-	V(lh->lh_done);
+	struct blkreq *req;
+
+	spinlock_acquire(&lh->lh_lock);
+
+	req = lh->lh_cur;
+	if (req == NULL) {
+		/* Nothing was running; ignore it */
+		spinlock_release(&lh->lh_lock);
+		return;
+	}
+
+	if (err == 0) {
+		if (req->br_rw == UIO_READ) {
+			membar_load_load();
+			memcpy(req->br_data + req->br_xfered*LHD_SECTSIZE,
+			       lh->lh_buf, LHD_SECTSIZE);
+		}
+		req->br_xfered++;
+		lh->lh_headpos = req->br_block + req->br_xfered;
+	}
+
+	if (err == 0 && req->br_xfered < req->br_nblocks) {
+		lhd_start(lh);
+	}
+	else {
+		req->br_result = err;
+		req->br_done = true;
+		lh->lh_cur = NULL;
+		wchan_wakeone(lh->lh_slotwchans[req->br_slot], &lh->lh_lock);
+		lhd_dispatch(lh);
+	}
+
+	spinlock_release(&lh->lh_lock);
 }
 
 /*
@@ -180,94 +296,128 @@ lhd_reset(struct lhd_softc *lh)
 #endif
 
 /*
- * I/O function (for both reads and writes)
+ * Block I/O function: take a wait slot, queue the request, sorted by
+ * sector, start it if the disk is idle, and wait on the slot until
+ * the interrupt handler has finished it. The caller (blkio()) has
+ * already checked it against the size of the disk.
  */
 static
 int
-lhd_io(struct device *d, struct uio *uio)
+lhd_blkio(struct device *d, struct blkreq *req)
 {
 	struct lhd_softc *lh = d->d_data;
+	struct blkreq **pp;
+	unsigned slot;
 
-	uint32_t sector = uio->uio_offset / LHD_SECTSIZE;
-	uint32_t sectoff = uio->uio_offset % LHD_SECTSIZE;
-	uint32_t len = uio->uio_resid / LHD_SECTSIZE;
-	uint32_t lenoff = uio->uio_resid % LHD_SECTSIZE;
-	uint32_t i;
-	uint32_t statval = LHD_WORKING;
-	int result;
+	req->br_xfered = 0;
+	req->br_result = 0;
+	req->br_done = false;
+
+	spinlock_acquire(&lh->lh_lock);
+
+	while (lh->lh_slotsfree == 0) {
+		wchan_sleep(lh->lh_wchan, &lh->lh_lock);
+	}
+	for (slot = 0; (lh->lh_slotsfree & (1U << slot)) == 0; slot++);
+	lh->lh_slotsfree &= ~(1U << slot);
+	req->br_slot = slot;
+
+	for (pp = &lh->lh_queue; *pp != NULL; pp = &(*pp)->br_next) {
+		if ((*pp)->br_block > req->br_block) {
+			break;
+		}
+	}
+	req->br_next = *pp;
+	*pp = req;
+
+	lhd_dispatch(lh);
+	while (!req->br_done) {
+		wchan_sleep(lh->lh_slotwchans[slot], &lh->lh_lock);
+	}
+
+	lh->lh_slotsfree |= 1U << slot;
+	wchan_wakeone(lh->lh_wchan, &lh->lh_lock);
+
+	spinlock_release(&lh->lh_lock);
+	return req->br_result;
+}
+
+/*
+ * I/O function (for both reads and writes) on a uio, which may point
+ * to user memory. The interrupt handler can only copy to and from
+ * kernel memory, so the data goes through a kernel bounce buffer, up
+ * to LHD_BOUNCESIZE bytes per request.
+ */
+#define LHD_BOUNCESIZE  (8 * LHD_SECTSIZE)
+
+static
+int
+lhd_io(struct device *d, struct uio *uio)
+{
+	struct blkreq req;
+	char *bounce;
+	size_t len;
+	int result = 0;
 
 	/* Don't allow I/O that isn't sector-aligned. */
-	if (sectoff != 0 || lenoff != 0) {
+	if (uio->uio_offset % LHD_SECTSIZE != 0 ||
+	    uio->uio_resid % LHD_SECTSIZE != 0) {
 		return EINVAL;
 	}
 
 	/* Don't allow I/O past the end of the disk. */
-	/* XXX this check can overflow */
-	if (sector+len > lh->lh_dev.d_blocks) {
+	if (uio->uio_offset / LHD_SECTSIZE > d->d_blocks ||
+	    uio->uio_resid / LHD_SECTSIZE >
+	    d->d_blocks - uio->uio_offset / LHD_SECTSIZE) {
 		return EINVAL;
 	}
 
-	/* Set up the value to write into the status register. */
-	if (uio->uio_rw==UIO_WRITE) {
-		statval |= LHD_ISWRITE;
+	bounce = kmalloc(LHD_BOUNCESIZE);
+	if (bounce == NULL) {
+		return ENOMEM;
 	}
 
-	/* Loop over all the sectors we were asked to do. */
-	for (i=0; i<len; i++) {
+	while (uio->uio_resid > 0) {
+		len = uio->uio_resid;
+		if (len > LHD_BOUNCESIZE) {
+			len = LHD_BOUNCESIZE;
+		}
 
-		/* Wait until nobody else is using the device. */
-		P(lh->lh_clear);
+		bzero(&req, sizeof(req));
+		req.br_block = uio->uio_offset / LHD_SECTSIZE;
+		req.br_nblocks = len / LHD_SECTSIZE;
+		req.br_data = bounce;
+		req.br_rw = uio->uio_rw;
 
-		/*
-		 * Are we writing? If so, transfer the data to the
-		 * on-card buffer.
-		 */
 		if (uio->uio_rw == UIO_WRITE) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
-			membar_store_store();
+			result = uiomove(bounce, len, uio);
 			if (result) {
-				V(lh->lh_clear);
-				return result;
+				break;
 			}
 		}
 
-		/* Tell it what sector we want... */
-		lhd_wreg(lh, LHD_REG_SECT, sector+i);
-
-		/* and start the operation. */
-		lhd_wreg(lh, LHD_REG_STAT, statval);
-
-		/* Now wait until the interrupt handler tells us we're done. */
-		P(lh->lh_done);
-
-		/* Get the result value saved by the interrupt handler. */
-		result = lh->lh_result;
-
-		/*
-		 * Are we reading? If so, and if we succeeded,
-		 * transfer the data out of the on-card buffer.
-		 */
-		if (result==0 && uio->uio_rw==UIO_READ) {
-			membar_load_load();
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
+		result = lhd_blkio(d, &req);
+		if (result) {
+			break;
 		}
 
-		/* Tell another thread it's cleared to go ahead. */
-		V(lh->lh_clear);
-
-		/* If we failed, return the error. */
-		if (result) {
-			return result;
+		if (uio->uio_rw == UIO_READ) {
+			result = uiomove(bounce, len, uio);
+			if (result) {
+				break;
+			}
 		}
 	}
 
-	return 0;
+	kfree(bounce);
+	return result;
 }
 
 static const struct device_ops lhd_devops = {
 	.devop_eachopen = lhd_eachopen,
 	.devop_io = lhd_io,
 	.devop_ioctl = lhd_ioctl,
+	.devop_blkio = lhd_blkio,
 };
 
 /*
@@ -277,6 +427,7 @@ int
 config_lhd(struct lhd_softc *lh, int lhdno)
 {
 	char name[32];
+	unsigned i;
 
 	/* Figure out what our name is. */
 	snprintf(name, sizeof(name), "lhd%d", lhdno);
@@ -284,17 +435,23 @@ config_lhd(struct lhd_softc *lh, int lhdno)
 	/* Get a pointer to the on-chip buffer. */
 	lh->lh_buf = bus_map_area(lh->lh_busdata, lh->lh_buspos, LHD_BUFFER);
 
-	/* Create the semaphores. */
-	lh->lh_clear = sem_create("lhd-clear", 1);
-	if (lh->lh_clear == NULL) {
+	/* Set up the (empty) request queue. */
+	lh->lh_wchan = wchan_create("lhd");
+	if (lh->lh_wchan == NULL) {
 		return ENOMEM;
 	}
-	lh->lh_done = sem_create("lhd-done", 0);
-	if (lh->lh_done == NULL) {
-		sem_destroy(lh->lh_clear);
-		lh->lh_clear = NULL;
-		return ENOMEM;
+	for (i=0; i<LHD_NSLOTS; i++) {
+		lh->lh_slotwchans[i] = wchan_create("lhdreq");
+		if (lh->lh_slotwchans[i] == NULL) {
+			return ENOMEM;
+		}
 	}
+	lh->lh_slotsfree = 0xffffffff;
+	spinlock_init(&lh->lh_lock);
+	lh->lh_queue = NULL;
+	lh->lh_cur = NULL;
+	lh->lh_headpos = 0;
+	lh->lh_sweepn = 0;
 
 	/* Set up the VFS device structure. */
 	lh->lh_dev.d_ops = &lhd_devops;
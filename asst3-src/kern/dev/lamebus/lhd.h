@@ -31,12 +31,24 @@
 #define _LAMEBUS_LHD_H_
 
 #include <device.h>
+#include <spinlock.h>
+
+struct blkreq;
+struct wchan;
 
 /*
  * Our sector size
  */
 #define LHD_SECTSIZE  512
 
+/*
+ * Requests that can be waited for at once (one bit each in the 32-bit
+ * lh_slotsfree), and most requests served in one C-LOOK sweep while
+ * lower ones are waiting
+ */
+#define LHD_NSLOTS    32
+#define LHD_SWEEPMAX  32
+
 /*
  * Hardware device data associated with lhd (LAMEbus hard disk)
  */
@@ -51,9 +63,19 @@ struct lhd_softc {
 	 */
 
 	void *lh_buf;			/* Pointer to on-card I/O buffer */
-	int lh_result;			/* Result from I/O operation */
-	struct semaphore *lh_clear;	/* Synchronization */
-	struct semaphore *lh_done;
+
+	/*
+	 * Request queue. lh_lock protects everything here and is
+	 * also taken by the interrupt handler.
+	 */
+	struct spinlock lh_lock;
+	struct wchan *lh_wchan;		/* Threads waiting for a free slot */
+	struct wchan *lh_slotwchans[LHD_NSLOTS]; /* Thread waiting for each request */
+	uint32_t lh_slotsfree;		/* Bitmap of unused slots */
+	struct blkreq *lh_queue;	/* Waiting requests, by sector */
+	struct blkreq *lh_cur;		/* Request in progress, if any */
+	uint32_t lh_headpos;		/* Sector after the last one done */
+	unsigned lh_sweepn;		/* Requests served in this sweep */
 
 	struct device lh_dev;		/* VFS device structure */
 };
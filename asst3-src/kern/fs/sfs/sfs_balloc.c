@@ -35,45 +35,117 @@
 #include <types.h>
 #include <lib.h>
 #include <bitmap.h>
+#include <spinlock.h>
+#include <clock.h>
+#include <synch.h>
+#include <buf.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
 /*
- * Zero out a disk block.
+ * Zero out a disk block. This only zeroes a buffer and marks it
+ * dirty; the block is written whenever the buffer is, by which time
+ * whoever allocated it has usually filled it in.
  */
-static
 int
 sfs_clearblock(struct sfs_fs *sfs, daddr_t block)
 {
-	/* static -> automatically initialized to zero */
-	static char zeros[SFS_BLOCKSIZE];
+	struct buf *buf;
+	int result;
 
-	return sfs_writeblock(sfs, block, zeros, SFS_BLOCKSIZE);
+	result = buffer_get(sfs->sfs_device, block, &buf);
+	if (result) {
+		return result;
+	}
+	bzero(buffer_map(buf), SFS_BLOCKSIZE);
+	buffer_mark_dirty(buf);
+	buffer_release(buf);
+	return 0;
 }
 
 /*
- * Allocate a block.
+ * Allocation statistics, over all volumes. A miss is an allocation
+ * that couldn't have its goal block; for sequential writes each one is
+ * a break in the file's layout on disk. Allocations with no goal are
+ * left out of the goal counts.
+ */
+static struct spinlock balloc_statlock = SPINLOCK_INITIALIZER;
+static struct {
+	unsigned allocs;        /* blocks allocated */
+	unsigned goaled;        /* ...that had a goal */
+	unsigned ongoal;        /* ...that got exactly the goal block */
+	unsigned cleared;       /* ...that had to be zeroed */
+	uint64_t skipped;       /* blocks passed over past goals */
+	uint64_t searchns;      /* time spent searching the freemap */
+} balloc_stats;
+
+/*
+ * Allocate a block, preferably GOAL or the first free one after it.
+ * A goal of 0 (which is never free; it's the superblock) means the
+ * caller has no preference, and we carry on from where the last
+ * allocation on the volume left off.
+ *
+ * The block is zeroed if CLEAR is set. Callers that are about to
+ * overwrite all of it pass false, and must not let the old contents
+ * (someone else's freed data) reach the disk or a reader.
  */
 int
-sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock)
+sfs_balloc(struct sfs_fs *sfs, daddr_t goal, bool clear, daddr_t *diskblock)
 {
+	struct timespec before, after, duration;
+	uint32_t nblocks = sfs->sfs_sb.sb_nblocks;
+	daddr_t start;
 	int result;
 
-	result = bitmap_alloc(sfs->sfs_freemap, diskblock);
+	if (goal >= nblocks) {
+		goal = 0;
+	}
+
+	lock_acquire(sfs->sfs_freemaplock);
+	start = goal != 0 ? goal : sfs->sfs_allochint;
+	gettime(&before);
+	result = bitmap_alloc_near(sfs->sfs_freemap, start, diskblock);
+	gettime(&after);
 	if (result) {
+		lock_release(sfs->sfs_freemaplock);
 		return result;
 	}
 	sfs->sfs_freemapdirty = true;
+	sfs->sfs_allochint = (*diskblock + 1) % nblocks;
+	lock_release(sfs->sfs_freemaplock);
 
-	if (*diskblock >= sfs->sfs_sb.sb_nblocks) {
+	if (*diskblock >= nblocks) {
 		panic("sfs: %s: balloc: invalid block %u\n",
 		      sfs->sfs_sb.sb_volname, *diskblock);
 	}
 
-	/* Clear block before returning it */
+	timespec_sub(&after, &before, &duration);
+	spinlock_acquire(&balloc_statlock);
+	balloc_stats.allocs++;
+	if (goal != 0) {
+		balloc_stats.goaled++;
+		if (*diskblock == goal) {
+			balloc_stats.ongoal++;
+		}
+		balloc_stats.skipped += (*diskblock + nblocks - goal) % nblocks;
+	}
+	if (clear) {
+		balloc_stats.cleared++;
+	}
+	balloc_stats.searchns += duration.tv_sec * 1000000000ULL +
+		duration.tv_nsec;
+	spinlock_release(&balloc_statlock);
+
+	if (!clear) {
+		return 0;
+	}
+
+	/* Clear block before returning it; it's ours, so no lock needed */
 	result = sfs_clearblock(sfs, *diskblock);
 	if (result) {
+		lock_acquire(sfs->sfs_freemaplock);
 		bitmap_unmark(sfs->sfs_freemap, *diskblock);
+		lock_release(sfs->sfs_freemaplock);
 	}
 	return result;
 }
@@ -84,8 +156,31 @@ sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock)
 void
 sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock)
 {
+	if (sfs->sfs_journaled) {
+		/*
+		 * Leave it allocated until the transaction commits;
+		 * the commit frees it and drops its buffer.
+		 */
+		lock_acquire(sfs->sfs_freemaplock);
+		KASSERT(bitmap_isset(sfs->sfs_freemap, diskblock));
+		KASSERT(!bitmap_isset(sfs->sfs_jfreed, diskblock));
+		bitmap_mark(sfs->sfs_jfreed, diskblock);
+		sfs->sfs_jnfreed++;
+		lock_release(sfs->sfs_freemaplock);
+		return;
+	}
+
+	/*
+	 * Its contents are garbage now; don't write them back. This
+	 * must come first: once the bit is clear the block can be
+	 * reallocated, and we'd throw away the new owner's buffer.
+	 */
+	buffer_forget(sfs->sfs_device, diskblock);
+
+	lock_acquire(sfs->sfs_freemaplock);
 	bitmap_unmark(sfs->sfs_freemap, diskblock);
 	sfs->sfs_freemapdirty = true;
+	lock_release(sfs->sfs_freemaplock);
 }
 
 /*
@@ -94,10 +189,59 @@ sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock)
 int
 sfs_bused(struct sfs_fs *sfs, daddr_t diskblock)
 {
+	int result;
+
 	if (diskblock >= sfs->sfs_sb.sb_nblocks) {
 		panic("sfs: %s: sfs_bused called on out of range block %u\n",
 		      sfs->sfs_sb.sb_volname, diskblock);
 	}
-	return bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_acquire(sfs->sfs_freemaplock);
+	result = bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_release(sfs->sfs_freemaplock);
+	return result;
+}
+
+
+/*
+ * Print the allocation statistics.
+ */
+void
+sfs_balloc_printstats(void)
+{
+	unsigned allocs, goaled, ongoal, cleared;
+	uint64_t skipped, searchns;
+
+	spinlock_acquire(&balloc_statlock);
+	allocs = balloc_stats.allocs;
+	goaled = balloc_stats.goaled;
+	ongoal = balloc_stats.ongoal;
+	cleared = balloc_stats.cleared;
+	skipped = balloc_stats.skipped;
+	searchns = balloc_stats.searchns;
+	spinlock_release(&balloc_statlock);
+
+	kprintf("sfs balloc: %u blocks allocated, %u with a goal, "
+		"%u on goal (%u%%)\n", allocs, goaled, ongoal,
+		goaled ? ongoal * 100 / goaled : 0);
+	kprintf("sfs balloc: %u zeroed, %u left for the caller to fill\n",
+		cleared, allocs - cleared);
+	if (goaled > 0) {
+		kprintf("sfs balloc: %llu blocks skipped past the goal "
+			"on average\n", (unsigned long long)(skipped / goaled));
+	}
+	if (allocs > 0) {
+		kprintf("sfs balloc: %llu ns per search\n",
+			(unsigned long long)(searchns / allocs));
+	}
 }
 
+/*
+ * Reset the allocation statistics.
+ */
+void
+sfs_balloc_resetstats(void)
+{
+	spinlock_acquire(&balloc_statlock);
+	bzero(&balloc_stats, sizeof(balloc_stats));
+	spinlock_release(&balloc_statlock);
+}
@@ -35,39 +35,156 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <synch.h>
 #include <vfs.h>
+#include <buf.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
+/*
+ * Files map their blocks through SFS_NDIRECT direct blocks, then one
+ * single, one double and one triple indirect block, in that order.
+ * An indirect block at level L maps sfs_ibspan[L] file blocks, and
+ * each of its entries maps sfs_ibspan[L-1] of them.
+ */
+static const uint32_t sfs_ibspan[4] = {
+	1,
+	SFS_DBPERIDB,
+	SFS_DBPERIDB * SFS_DBPERIDB,
+	SFS_DBPERIDB * SFS_DBPERIDB * SFS_DBPERIDB,
+};
+
+#define SFS_NLEVELS 3
+
+/*
+ * Return the inode's pointer to its indirect block at the given level,
+ * and the first file block that indirect block maps.
+ */
+static
+uint32_t *
+sfs_ibslot(struct sfs_vnode *sv, int level, uint32_t *baseblock)
+{
+	uint32_t base = SFS_NDIRECT;
+	int l;
+
+	COMPILE_ASSERT(SFS_NINDIRECT == 1 && SFS_NDINDIRECT == 1 &&
+		       SFS_NTINDIRECT == 1);
+
+	for (l=1; l<level; l++) {
+		base += sfs_ibspan[l];
+	}
+	*baseblock = base;
+
+	switch (level) {
+	    case 1: return &sv->sv_i.sfi_indirect;
+	    case 2: return &sv->sv_i.sfi_dindirect;
+	    case 3: return &sv->sv_i.sfi_tindirect;
+	}
+	panic("sfs: invalid indirection level %d\n", level);
+	return NULL;
+}
+
+/*
+ * The bmap cache: a few recent file block to disk block translations
+ * for blocks past the direct ones, so that repeated access to a big
+ * file doesn't read the same indirect blocks over and over. Entries
+ * are direct-mapped by file block and only hold allocated blocks; a
+ * diskblock of 0 is an empty entry. Protected by sv_lock.
+ */
+static
+bool
+sfs_bmapcache_get(struct sfs_vnode *sv, uint32_t fileblock, daddr_t *diskblock)
+{
+	struct sfs_bmapent *be = &sv->sv_bmapcache[fileblock % SFS_BMAPCACHE];
+
+	if (be->be_diskblock != 0 && be->be_fileblock == fileblock) {
+		*diskblock = be->be_diskblock;
+		return true;
+	}
+	return false;
+}
+
+static
+void
+sfs_bmapcache_put(struct sfs_vnode *sv, uint32_t fileblock, daddr_t diskblock)
+{
+	struct sfs_bmapent *be = &sv->sv_bmapcache[fileblock % SFS_BMAPCACHE];
+
+	be->be_fileblock = fileblock;
+	be->be_diskblock = diskblock;
+}
+
+/*
+ * Forget cached translations for file blocks at or past BLOCKLEN.
+ */
+static
+void
+sfs_bmapcache_trunc(struct sfs_vnode *sv, uint32_t blocklen)
+{
+	unsigned i;
+
+	for (i=0; i<SFS_BMAPCACHE; i++) {
+		if (sv->sv_bmapcache[i].be_fileblock >= blocklen) {
+			sv->sv_bmapcache[i].be_diskblock = 0;
+		}
+	}
+}
+
+/*
+ * Allocate a block for a file, trying to place it right after PREV,
+ * the block that precedes it in the file if the caller knows it, or
+ * failing that after the last block we gave the file, or failing that
+ * after the inode. Files written in order then end up contiguous.
+ */
+static
+int
+sfs_bmap_alloc(struct sfs_vnode *sv, daddr_t prev, bool clear,
+	       daddr_t *diskblock)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	daddr_t goal;
+	int result;
+
+	if (prev == 0) {
+		prev = sv->sv_lastalloc != 0 ? sv->sv_lastalloc : sv->sv_ino;
+	}
+	goal = prev + 1;
+
+	result = sfs_balloc(sfs, goal, clear, diskblock);
+	if (result) {
+		return result;
+	}
+	sv->sv_lastalloc = *diskblock;
+	return 0;
+}
+
 /*
  * Look up the disk block number (from 0 up to the number of blocks on
  * the disk) given a file and the logical block number within that
- * file. If DOALLOC is set, and no such block exists, one will be
- * allocated.
+ * file. Unless ALLOCMODE is SFS_BMAP_LOOKUP, and no such block exists,
+ * one will be allocated, along with any indirect blocks needed to reach
+ * it. The new block is zeroed unless ALLOCMODE is SFS_BMAP_FILL, which
+ * the caller uses when it is about to overwrite all of it anyway.
+ * (Indirect blocks are always zeroed.) Requires the file's sv_lock.
  */
 int
-sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
+sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int allocmode,
 	 daddr_t *diskblock)
 {
-	/*
-	 * I/O buffer for handling indirect blocks.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
-
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
-	daddr_t block;
-	daddr_t idblock;
-	uint32_t idnum, idoff;
+	struct buf *idbuf;
+	uint32_t *idptr, *slot;
+	daddr_t block, next, prev;
+	uint32_t baseblock, offset, idoff;
+	int level, l;
+	bool doalloc = (allocmode != SFS_BMAP_LOOKUP);
+	bool clear = (allocmode != SFS_BMAP_FILL);
 	int result;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
+	KASSERT(SFS_DBPERIDB * sizeof(uint32_t) == SFS_BLOCKSIZE);
 
-	/* Since we're using a static buffer, we'd better be locked. */
-	KASSERT(vfs_biglock_do_i_hold());
+	/* The indirect blocks belong to this file; nobody else may touch them */
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
 	/*
 	 * If the block we want is one of the direct blocks...
@@ -82,7 +199,9 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 		 * Do we need to allocate?
 		 */
 		if (block==0 && doalloc) {
-			result = sfs_balloc(sfs, &block);
+			result = sfs_bmap_alloc(sv, fileblock > 0 ?
+				sv->sv_i.sfi_direct[fileblock-1] : 0,
+				clear, &block);
 			if (result) {
 				return result;
 			}
@@ -104,128 +223,189 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 		return 0;
 	}
 
-	/*
-	 * It's not a direct block; it must be in the indirect block.
-	 * Subtract off the number of direct blocks, so FILEBLOCK is
-	 * now the offset into the indirect block space.
-	 */
-
-	fileblock -= SFS_NDIRECT;
-
-	/* Get the indirect block number and offset w/i that indirect block */
-	idnum = fileblock / SFS_DBPERIDB;
-	idoff = fileblock % SFS_DBPERIDB;
+	if (sfs_bmapcache_get(sv, fileblock, diskblock)) {
+		return 0;
+	}
 
 	/*
-	 * We only have one indirect block. If the offset we were asked for
-	 * is too large, we can't handle it, so fail.
+	 * It's not a direct block; find which indirect block it's
+	 * under, and its offset within the range that one maps.
 	 */
-	if (idnum >= SFS_NINDIRECT) {
-		return EFBIG;
+	for (level=1; level<=SFS_NLEVELS; level++) {
+		slot = sfs_ibslot(sv, level, &baseblock);
+		if (fileblock - baseblock < sfs_ibspan[level]) {
+			break;
+		}
 	}
-
-	/* Get the disk block number of the indirect block. */
-	idblock = sv->sv_i.sfi_indirect;
-
-	if (idblock==0 && !doalloc) {
-		/*
-		 * There's no indirect block allocated. We weren't
-		 * asked to allocate anything, so pretend the indirect
-		 * block was filled with all zeros.
-		 */
-		*diskblock = 0;
-		return 0;
+	if (level > SFS_NLEVELS) {
+		/* Too big for even the triple indirect block */
+		return EFBIG;
 	}
-	else if (idblock==0) {
-		/*
-		 * There's no indirect block allocated, but we need to
-		 * allocate a block whose number needs to be stored in
-		 * the indirect block. Thus, we need to allocate an
-		 * indirect block.
-		 */
-		result = sfs_balloc(sfs, &idblock);
-		if (result) {
-			return result;
+	offset = fileblock - baseblock;
+
+	/* Get (or allocate) the top indirect block */
+	block = *slot;
+	if (block == 0) {
+		if (!doalloc) {
+			/* Nothing allocated; it's all zeros */
+			*diskblock = 0;
+			return 0;
 		}
-
-		/* Remember the block we just allocated */
-		sv->sv_i.sfi_indirect = idblock;
-
-		/* Mark the inode dirty */
-		sv->sv_dirty = true;
-
-		/* Clear the indirect block buffer */
-		bzero(idbuf, sizeof(idbuf));
-	}
-	else {
-		/*
-		 * We already have an indirect block allocated; load it.
-		 */
-		result = sfs_readblock(sfs, idblock, idbuf, sizeof(idbuf));
+		/* sfs_balloc zeroes it for us */
+		result = sfs_bmap_alloc(sv, 0, true, &block);
 		if (result) {
 			return result;
 		}
+		*slot = block;
+		sv->sv_dirty = true;
 	}
 
-	/* Get the block out of the indirect block buffer */
-	block = idbuf[idoff];
+	/*
+	 * Walk down through the levels. Don't hold a buffer across
+	 * sfs_balloc, which needs buffers of its own.
+	 */
+	for (l=level; l>0; l--) {
+		idoff = offset / sfs_ibspan[l-1];
+		offset %= sfs_ibspan[l-1];
 
-	/* If there's no block there, allocate one */
-	if (block==0 && doalloc) {
-		result = sfs_balloc(sfs, &block);
+		result = buffer_read(sfs->sfs_device, block, &idbuf);
 		if (result) {
 			return result;
 		}
+		idptr = buffer_map(idbuf);
+		next = idptr[idoff];
+		prev = idoff > 0 ? idptr[idoff-1] : block;
+		buffer_release(idbuf);
+
+		/*
+		 * If there's no block there, allocate one, after its
+		 * neighbour. Only the data block at the bottom (l == 1)
+		 * may be left for the caller to fill.
+		 */
+		if (next==0 && doalloc) {
+			result = sfs_bmap_alloc(sv, prev, clear || l > 1, &next);
+			if (result) {
+				return result;
+			}
 
-		/* Remember the block we allocated */
-		idbuf[idoff] = block;
+			/* Remember the block we allocated in the indirect block */
+			result = buffer_read(sfs->sfs_device, block, &idbuf);
+			if (result) {
+				sfs_bfree(sfs, next);
+				return result;
+			}
+			idptr = buffer_map(idbuf);
+			KASSERT(idptr[idoff] == 0);
+			idptr[idoff] = next;
+			sfs_jdirty(sfs, idbuf, block);
+			buffer_release(idbuf);
+		}
 
-		/* The indirect block is now dirty; write it back */
-		result = sfs_writeblock(sfs, idblock, idbuf, sizeof(idbuf));
-		if (result) {
-			return result;
+		if (next == 0) {
+			/* A hole */
+			*diskblock = 0;
+			return 0;
 		}
+		block = next;
 	}
 
 	/* Hand back the result and return. */
-	if (block != 0 && !sfs_bused(sfs, block)) {
+	if (!sfs_bused(sfs, block)) {
 		panic("sfs: %s: Data block %u (block %u of file %u) "
 		      "marked free\n", sfs->sfs_sb.sb_volname,
 		      block, fileblock, sv->sv_ino);
 	}
+	sfs_bmapcache_put(sv, fileblock, block);
 	*diskblock = block;
 	return 0;
 }
 
 /*
- * Called for ftruncate() and from sfs_reclaim.
+ * Free everything an indirect block at the given level maps from file
+ * block BLOCKLEN on; BASEBLOCK is the first file block it maps. Sets
+ * *emptyp if nothing is left in it, in which case the caller frees the
+ * indirect block itself. (Only after this releases its buffer, or
+ * sfs_bfree would wait for it forever.) An indirect block that is
+ * about to be freed isn't marked dirty: nothing need be written to it.
  */
+static
 int
-sfs_itrunc(struct sfs_vnode *sv, off_t len)
+sfs_itrunc_ib(struct sfs_fs *sfs, daddr_t idblock, int level,
+	      uint32_t baseblock, uint32_t blocklen, bool *emptyp)
 {
-	/*
-	 * I/O buffer for handling the indirect block.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
+	struct buf *idbuf;
+	uint32_t *idptr;
+	uint32_t span = sfs_ibspan[level-1];
+	uint32_t j, childbase;
+	bool childempty, hasnonzero, iddirty;
+	int result = 0;
+
+	result = buffer_read(sfs->sfs_device, idblock, &idbuf);
+	if (result) {
+		return result;
+	}
+	idptr = buffer_map(idbuf);
+
+	hasnonzero = false;
+	iddirty = false;
+	for (j=0; j<SFS_DBPERIDB; j++) {
+		childbase = baseblock + j * span;
+		if (idptr[j] != 0 && childbase + span > blocklen) {
+			/* At least part of this entry is past the new EOF */
+			if (level == 1) {
+				childempty = true;
+			}
+			else {
+				result = sfs_itrunc_ib(sfs, idptr[j], level-1,
+						       childbase, blocklen,
+						       &childempty);
+				if (result) {
+					break;
+				}
+			}
+			if (childempty) {
+				sfs_bfree(sfs, idptr[j]);
+				idptr[j] = 0;
+				iddirty = true;
+			}
+		}
+		/* Remember if we see any nonzero blocks in here */
+		if (idptr[j] != 0) {
+			hasnonzero = true;
+		}
+	}
+
+	*emptyp = !hasnonzero && result == 0;
+
+	/* The indirect block is dirty; it gets written back later */
+	if (iddirty && !*emptyp) {
+		sfs_jdirty(sfs, idbuf, idblock);
+	}
+	buffer_release(idbuf);
+
+	return result;
+}
 
+/*
+ * Called for ftruncate() and from sfs_reclaim. Requires sv_lock.
+ */
+int
+sfs_itrunc(struct sfs_vnode *sv, off_t len)
+{
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
 
 	/* Length in blocks (divide rounding up) */
 	uint32_t blocklen = DIVROUNDUP(len, SFS_BLOCKSIZE);
 
-	uint32_t i, j;
-	daddr_t block, idblock;
-	uint32_t baseblock, highblock;
-	int result;
-	int hasnonzero, iddirty;
+	uint32_t i;
+	uint32_t *slot, baseblock;
+	daddr_t block;
+	int level, result;
+	bool empty;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
-	vfs_biglock_acquire();
+	sfs_bmapcache_trunc(sv, blocklen);
 
 	/*
 	 * Go through the direct blocks. Discard any that are
@@ -240,55 +420,26 @@ sfs_itrunc(struct sfs_vnode *sv, off_t len)
 		}
 	}
 
-	/* Indirect block number */
-	idblock = sv->sv_i.sfi_indirect;
-
-	/* The lowest block in the indirect block */
-	baseblock = SFS_NDIRECT;
-
-	/* The highest block in the indirect block */
-	highblock = baseblock + SFS_DBPERIDB - 1;
-
-	if (blocklen < highblock && idblock != 0) {
-		/* We're past the proposed EOF; may need to free stuff */
-
-		/* Read the indirect block */
-		result = sfs_readblock(sfs, idblock, idbuf, sizeof(idbuf));
+	/*
+	 * Then the indirect blocks, for any whose range reaches past
+	 * the proposed EOF.
+	 */
+	for (level=1; level<=SFS_NLEVELS; level++) {
+		slot = sfs_ibslot(sv, level, &baseblock);
+		if (*slot == 0 || baseblock + sfs_ibspan[level] <= blocklen) {
+			continue;
+		}
+		result = sfs_itrunc_ib(sfs, *slot, level, baseblock,
+				       blocklen, &empty);
 		if (result) {
-			vfs_biglock_release();
 			return result;
 		}
-
-		hasnonzero = 0;
-		iddirty = 0;
-		for (j=0; j<SFS_DBPERIDB; j++) {
-			/* Discard any blocks that are past the new EOF */
-			if (blocklen < baseblock+j && idbuf[j] != 0) {
-				sfs_bfree(sfs, idbuf[j]);
-				idbuf[j] = 0;
-				iddirty = 1;
-			}
-			/* Remember if we see any nonzero blocks in here */
-			if (idbuf[j]!=0) {
-				hasnonzero=1;
-			}
-		}
-
-		if (!hasnonzero) {
+		if (empty) {
 			/* The whole indirect block is empty now; free it */
-			sfs_bfree(sfs, idblock);
-			sv->sv_i.sfi_indirect = 0;
+			sfs_bfree(sfs, *slot);
+			*slot = 0;
 			sv->sv_dirty = true;
 		}
-		else if (iddirty) {
-			/* The indirect block is dirty; write it back */
-			result = sfs_writeblock(sfs, idblock, idbuf,
-						sizeof(idbuf));
-			if (result) {
-				vfs_biglock_release();
-				return result;
-			}
-		}
 	}
 
 	/* Set the file size */
@@ -297,7 +448,5 @@ sfs_itrunc(struct sfs_vnode *sv, off_t len)
 	/* Mark the inode dirty */
 	sv->sv_dirty = true;
 
-	vfs_biglock_release();
 	return 0;
 }
-
@@ -36,6 +36,8 @@
 #include <kern/errno.h>
 #include <lib.h>
 #include <vfs.h>
+#include <buf.h>
+#include <namecache.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
@@ -95,39 +97,97 @@ sfs_dir_nentries(struct sfs_vnode *sv)
 	return size / sizeof(struct sfs_direntry);
 }
 
+/* Directory entries per disk block */
+#define SFS_DIRPERBLOCK (SFS_BLOCKSIZE / sizeof(struct sfs_direntry))
+
 /*
  * Search a directory for a particular filename in a directory, and
  * return its inode number, its slot, and/or the slot number of an
  * empty directory slot if one is found.
+ *
+ * Unless an empty slot is wanted, which means looking at every
+ * entry, the name cache is tried first, and the scan stops at the
+ * first match. Whatever the scan finds (or doesn't) is cached. The
+ * scan looks at each directory block in place in the buffer cache
+ * rather than copying entries out one at a time.
  */
 int
 sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 		uint32_t *ino, int *slot, int *emptyslot)
 {
-	struct sfs_direntry tsd;
-	int found, nentries, i, result;
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_direntry *sds, *tsd;
+	struct buf *buf;
+	daddr_t diskblock;
+	uint32_t cino;
+	int cslot;
+	int found, nentries, base, n, i, result;
+	bool fits;
+
+	if (emptyslot == NULL &&
+	    namecache_lookup(&sv->sv_absvn, name, &cino, &cslot)) {
+		if (cino == SFS_NOINO) {
+			return ENOENT;
+		}
+		if (slot != NULL) {
+			*slot = cslot;
+		}
+		if (ino != NULL) {
+			*ino = cino;
+		}
+		return 0;
+	}
 
 	nentries = sfs_dir_nentries(sv);
+	fits = strlen(name) < sizeof(tsd->sfd_name);
 
-	/* For each slot... */
+	/* For each block of slots... */
 	found = 0;
-	for (i=0; i<nentries; i++) {
+	for (base=0; base<nentries && !(found && emptyslot == NULL); base+=n) {
+
+		n = nentries - base;
+		if (n > (int)SFS_DIRPERBLOCK) {
+			n = SFS_DIRPERBLOCK;
+		}
 
-		/* Read the entry from that slot */
-		result = sfs_readdir(sv, i, &tsd);
+		/* Get the block holding those slots */
+		result = sfs_bmap(sv, base / SFS_DIRPERBLOCK, SFS_BMAP_LOOKUP,
+				  &diskblock);
 		if (result) {
 			return result;
 		}
-		if (tsd.sfd_ino == SFS_NOINO) {
-			/* Free slot - report it back if one was requested */
+		if (diskblock == 0) {
+			/* A hole: all free */
 			if (emptyslot != NULL) {
-				*emptyslot = i;
+				*emptyslot = base + n - 1;
 			}
+			continue;
 		}
-		else {
-			/* Ensure null termination, just in case */
-			tsd.sfd_name[sizeof(tsd.sfd_name)-1] = 0;
-			if (!strcmp(tsd.sfd_name, name)) {
+		result = buffer_read(sfs->sfs_device, diskblock, &buf);
+		if (result) {
+			return result;
+		}
+		sds = buffer_map(buf);
+
+		/* For each slot... */
+		for (i=base; i<base+n && !(found && emptyslot == NULL); i++) {
+			tsd = &sds[i - base];
+			if (tsd->sfd_ino == SFS_NOINO) {
+				/*
+				 * Free slot - report it back if one
+				 * was requested
+				 */
+				if (emptyslot != NULL) {
+					*emptyslot = i;
+				}
+				continue;
+			}
+
+			/*
+			 * The name must fit, so strcmp stops within the
+			 * entry even if it isn't null-terminated.
+			 */
+			if (fits && !strcmp(tsd->sfd_name, name)) {
 
 				/* Each name may legally appear only once... */
 				KASSERT(found==0);
@@ -137,15 +197,50 @@ sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 					*slot = i;
 				}
 				if (ino != NULL) {
-					*ino = tsd.sfd_ino;
+					*ino = tsd->sfd_ino;
 				}
+				namecache_enter(&sv->sv_absvn, name,
+						tsd->sfd_ino, i);
 			}
 		}
+		buffer_release(buf);
 	}
 
+	if (!found) {
+		namecache_enter(&sv->sv_absvn, name, SFS_NOINO, 0);
+	}
 	return found ? 0 : ENOENT;
 }
 
+/*
+ * Find an empty slot for a name the name cache already says isn't in
+ * the directory, so there's no need to check the whole directory for
+ * it. Slots below sv_dirfree are known to be in use, so start there;
+ * hand back the end of the directory if none is free. The caller
+ * moves the hint past the slot once it's filled.
+ */
+static
+int
+sfs_dir_freeslot(struct sfs_vnode *sv, int *emptyslot)
+{
+	struct sfs_direntry sd;
+	int nentries, i, result;
+
+	nentries = sfs_dir_nentries(sv);
+	for (i=sv->sv_dirfree; i<nentries; i++) {
+		result = sfs_readdir(sv, i, &sd);
+		if (result) {
+			return result;
+		}
+		if (sd.sfd_ino == SFS_NOINO) {
+			break;
+		}
+	}
+	*emptyslot = i;
+	sv->sv_dirfree = i;
+	return 0;
+}
+
 /*
  * Create a link in a directory to the specified inode by number, with
  * the specified name, and optionally hand back the slot.
@@ -154,22 +249,33 @@ int
 sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 {
 	int emptyslot = -1;
+	uint32_t cino;
 	int result;
 	struct sfs_direntry sd;
 
-	/* Look up the name. We want to make sure it *doesn't* exist. */
-	result = sfs_dir_findname(sv, name, NULL, NULL, &emptyslot);
-	if (result!=0 && result!=ENOENT) {
-		return result;
-	}
-	if (result==0) {
-		return EEXIST;
-	}
-
 	if (strlen(name)+1 > sizeof(sd.sfd_name)) {
 		return ENAMETOOLONG;
 	}
 
+	if (namecache_lookup(&sv->sv_absvn, name, &cino, NULL) &&
+	    cino == SFS_NOINO) {
+		/* Known not to exist (the usual case, after a lookup) */
+		result = sfs_dir_freeslot(sv, &emptyslot);
+		if (result) {
+			return result;
+		}
+	}
+	else {
+		/* Look up the name. We want to make sure it *doesn't* exist. */
+		result = sfs_dir_findname(sv, name, NULL, NULL, &emptyslot);
+		if (result!=0 && result!=ENOENT) {
+			return result;
+		}
+		if (result==0) {
+			return EEXIST;
+		}
+	}
+
 	/* If we didn't get an empty slot, add the entry at the end. */
 	if (emptyslot < 0) {
 		emptyslot = sfs_dir_nentries(sv);
@@ -186,7 +292,18 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 	}
 
 	/* Write the entry. */
-	return sfs_writedir(sv, emptyslot, &sd);
+	result = sfs_writedir(sv, emptyslot, &sd);
+	if (result) {
+		return result;
+	}
+
+	if (emptyslot == sv->sv_dirfree) {
+		sv->sv_dirfree++;
+	}
+
+	/* The name exists now; replace the cache's negative entry */
+	namecache_enter(&sv->sv_absvn, name, ino, emptyslot);
+	return 0;
 }
 
 /*
@@ -195,14 +312,34 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 int
 sfs_dir_unlink(struct sfs_vnode *sv, int slot)
 {
-	struct sfs_direntry sd;
+	struct sfs_direntry sd, old;
+	int result;
+
+	/* Get the name being removed, for the name cache */
+	result = sfs_readdir(sv, slot, &old);
+	if (result) {
+		return result;
+	}
+	old.sfd_name[sizeof(old.sfd_name)-1] = 0;
 
 	/* Initialize a suitable directory entry... */
 	bzero(&sd, sizeof(sd));
 	sd.sfd_ino = SFS_NOINO;
 
 	/* ... and write it */
-	return sfs_writedir(sv, slot, &sd);
+	result = sfs_writedir(sv, slot, &sd);
+	if (result) {
+		return result;
+	}
+
+	/* The slot is free again */
+	if (slot < sv->sv_dirfree) {
+		sv->sv_dirfree = slot;
+	}
+
+	/* The name is gone; remember that rather than just forgetting it */
+	namecache_enter(&sv->sv_absvn, old.sfd_name, SFS_NOINO, 0);
+	return 0;
 }
 
 /*
@@ -38,9 +38,11 @@
 #include <lib.h>
 #include <array.h>
 #include <bitmap.h>
+#include <synch.h>
 #include <uio.h>
 #include <vfs.h>
 #include <device.h>
+#include <buf.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
@@ -107,40 +109,83 @@ sfs_freemapio(struct sfs_fs *sfs, enum uio_rw rw)
 
 /*
  * Sync routine for the vnode table.
+ *
+ * Syncing an inode needs its sv_lock, which comes before sfs_vnlock,
+ * so take a reference to each loaded vnode (inactive ones included)
+ * under sfs_vnlock and do the syncing after letting go of it. This only moves the inodes into
+ * the buffer cache; sfs_sync writes the cache out once at the end
+ * rather than per vnode as VOP_FSYNC would.
  */
 static
 int
 sfs_sync_vnodes(struct sfs_fs *sfs)
 {
-	unsigned i, num;
+	struct vnodearray *vnodes;
+	struct sfs_vnode *sv;
+	unsigned i, j, num;
+	int result = 0;
+
+	vnodes = vnodearray_create();
+	if (vnodes == NULL) {
+		return ENOMEM;
+	}
 
-	/* Go over the array of loaded vnodes, syncing as we go. */
-	num = vnodearray_num(sfs->sfs_vnodes);
+	lock_acquire(sfs->sfs_vnlock);
+	num = sfs->sfs_nvnodes;
+	result = vnodearray_setsize(vnodes, num);
+	if (result) {
+		lock_release(sfs->sfs_vnlock);
+		vnodearray_destroy(vnodes);
+		return result;
+	}
+	i = 0;
+	for (j=0; j<SFS_VNHASH_SIZE; j++) {
+		for (sv = sfs->sfs_vnhash[j]; sv != NULL; sv = sv->sv_hashnext) {
+			VOP_INCREF(&sv->sv_absvn);
+			vnodearray_set(vnodes, i++, &sv->sv_absvn);
+		}
+	}
+	KASSERT(i == num);
+	lock_release(sfs->sfs_vnlock);
+
+	/* Go over the loaded vnodes, syncing as we go. */
 	for (i=0; i<num; i++) {
-		struct vnode *v = vnodearray_get(sfs->sfs_vnodes, i);
-		VOP_FSYNC(v);
+		struct vnode *v = vnodearray_get(vnodes, i);
+
+		sv = v->vn_data;
+		lock_acquire(sv->sv_lock);
+		sfs_jbegin(sfs);
+		sfs_sync_inode(sv);
+		sfs_jend(sfs);
+		lock_release(sv->sv_lock);
+		VOP_DECREF(v);
 	}
+
+	vnodearray_setsize(vnodes, 0);
+	vnodearray_destroy(vnodes);
 	return 0;
 }
 
 /*
- * Sync routine for the freemap.
+ * Sync routine for the freemap. On a journaled volume only a commit
+ * calls this: the freemap changes in every transaction that allocates
+ * or frees, so it is logged once, at the end.
  */
-static
 int
 sfs_sync_freemap(struct sfs_fs *sfs)
 {
-	int result;
+	int result = 0;
 
+	lock_acquire(sfs->sfs_freemaplock);
 	if (sfs->sfs_freemapdirty) {
 		result = sfs_freemapio(sfs, UIO_WRITE);
-		if (result) {
-			return result;
+		if (result == 0) {
+			sfs->sfs_freemapdirty = false;
 		}
-		sfs->sfs_freemapdirty = false;
 	}
+	lock_release(sfs->sfs_freemaplock);
 
-	return 0;
+	return result;
 }
 
 /*
@@ -150,17 +195,21 @@ static
 int
 sfs_sync_superblock(struct sfs_fs *sfs)
 {
-	int result;
+	int result = 0;
 
+	sfs_jbegin(sfs);
+	lock_acquire(sfs->sfs_superlock);
 	if (sfs->sfs_superdirty) {
 		result = sfs_writeblock(sfs, SFS_SUPER_BLOCK, &sfs->sfs_sb,
 					sizeof(sfs->sfs_sb));
-		if (result) {
-			return result;
+		if (result == 0) {
+			sfs->sfs_superdirty = false;
 		}
-		sfs->sfs_superdirty = false;
 	}
-	return 0;
+	lock_release(sfs->sfs_superlock);
+	sfs_jend(sfs);
+
+	return result;
 }
 
 /*
@@ -174,8 +223,6 @@ sfs_sync(struct fs *fs)
 	struct sfs_fs *sfs;
 	int result;
 
-	vfs_biglock_acquire();
-
 	/*
 	 * Get the sfs_fs from the generic abstract fs.
 	 *
@@ -211,25 +258,35 @@ sfs_sync(struct fs *fs)
 	/* If any vnodes need to be written, write them. */
 	result = sfs_sync_vnodes(sfs);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
-	/* If the free block map needs to be written, write it. */
-	result = sfs_sync_freemap(sfs);
-	if (result) {
-		vfs_biglock_release();
-		return result;
+	/*
+	 * If the free block map needs to be written, write it. (With
+	 * a journal, committing takes care of it.)
+	 */
+	if (!sfs->sfs_journaled) {
+		result = sfs_sync_freemap(sfs);
+		if (result) {
+			return result;
+		}
 	}
 
 	/* If the superblock needs to be written, write it. */
 	result = sfs_sync_superblock(sfs);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
-	vfs_biglock_release();
+	/*
+	 * Now push all of the above, and any file data, to disk,
+	 * committing the running transaction if there is one.
+	 */
+	result = sfs_jcommit(sfs);
+	if (result) {
+		return result;
+	}
+
 	return 0;
 }
 
@@ -243,13 +300,9 @@ const char *
 sfs_getvolname(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
-	const char *ret;
 
-	vfs_biglock_acquire();
-	ret = sfs->sfs_sb.sb_volname;
-	vfs_biglock_release();
-
-	return ret;
+	/* Set at mount and never changed, so no lock needed */
+	return sfs->sfs_sb.sb_volname;
 }
 
 /*
@@ -259,10 +312,16 @@ static
 void
 sfs_fs_destroy(struct sfs_fs *sfs)
 {
+	sfs_jdestroy(sfs);
 	if (sfs->sfs_freemap != NULL) {
 		bitmap_destroy(sfs->sfs_freemap);
 	}
-	vnodearray_destroy(sfs->sfs_vnodes);
+	cv_destroy(sfs->sfs_jcv);
+	lock_destroy(sfs->sfs_jlock);
+	lock_destroy(sfs->sfs_freemaplock);
+	lock_destroy(sfs->sfs_vnlock);
+	lock_destroy(sfs->sfs_superlock);
+	KASSERT(sfs->sfs_nvnodes == 0);
 	KASSERT(sfs->sfs_device == NULL);
 	kfree(sfs);
 }
@@ -277,12 +336,25 @@ int
 sfs_unmount(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
+	unsigned remaining;
+	int result;
 
-	vfs_biglock_acquire();
+	/*
+	 * The VFS layer holds vfs_biglock across FS_SYNC and this, so
+	 * nobody can find their way into the volume afresh; only
+	 * vnodes that are already loaded could keep it busy.
+	 */
+	KASSERT(vfs_biglock_do_i_hold());
 
-	/* Do we have any files open? If so, can't unmount. */
-	if (vnodearray_num(sfs->sfs_vnodes) > 0) {
-		vfs_biglock_release();
+	/*
+	 * Throw out the inactive vnodes. Do we have any files open
+	 * after that? If so, can't unmount.
+	 */
+	result = sfs_purge_vnodes(sfs, &remaining);
+	if (result) {
+		return result;
+	}
+	if (remaining > 0) {
 		return EBUSY;
 	}
 
@@ -290,6 +362,21 @@ sfs_unmount(struct fs *fs)
 	KASSERT(sfs->sfs_superdirty == false);
 	KASSERT(sfs->sfs_freemapdirty == false);
 
+	/* ...but the purge may have written back inodes since. */
+	result = sfs_jcommit(sfs);
+	if (result) {
+		return result;
+	}
+
+	/*
+	 * Drop our blocks from the buffer cache. If some can't be
+	 * written back, stay mounted rather than lose them.
+	 */
+	result = buffer_invalidate(sfs->sfs_device, false);
+	if (result) {
+		return result;
+	}
+
 	/* The vfs layer takes care of the device for us */
 	sfs->sfs_device = NULL;
 
@@ -297,13 +384,9 @@ sfs_unmount(struct fs *fs)
 	sfs_fs_destroy(sfs);
 
 	/* nothing else to do */
-	vfs_biglock_release();
 	return 0;
 }
 
-/*
- * File system operations table.
- */
 static const struct fs_ops sfs_fsops = {
 	.fsop_sync = sfs_sync,
 	.fsop_getvolname = sfs_getvolname,
@@ -321,6 +404,7 @@ struct sfs_fs *
 sfs_fs_create(void)
 {
 	struct sfs_fs *sfs;
+	unsigned i;
 
 	/*
 	 * Make sure our on-disk structures aren't messed up
@@ -346,22 +430,66 @@ sfs_fs_create(void)
 	/* superblock */
 	/* (ignore sfs_super, we'll read in over it shortly) */
 	sfs->sfs_superdirty = false;
+	sfs->sfs_superlock = lock_create("sfs_superlock");
+	if (sfs->sfs_superlock == NULL) {
+		goto cleanup_object;
+	}
 
 	/* device we mount on */
 	sfs->sfs_device = NULL;
 
 	/* vnode table */
-	sfs->sfs_vnodes = vnodearray_create();
-	if (sfs->sfs_vnodes == NULL) {
-		goto cleanup_object;
+	for (i=0; i<SFS_VNHASH_SIZE; i++) {
+		sfs->sfs_vnhash[i] = NULL;
+	}
+	sfs->sfs_nvnodes = 0;
+	sfs->sfs_lruhead = sfs->sfs_lrutail = NULL;
+	sfs->sfs_ninactive = 0;
+	sfs->sfs_vnlock = lock_create("sfs_vnlock");
+	if (sfs->sfs_vnlock == NULL) {
+		goto cleanup_superlock;
 	}
 
 	/* freemap */
 	sfs->sfs_freemap = NULL;
 	sfs->sfs_freemapdirty = false;
+	sfs->sfs_allochint = 0;
+	sfs->sfs_freemaplock = lock_create("sfs_freemaplock");
+	if (sfs->sfs_freemaplock == NULL) {
+		goto cleanup_vnlock;
+	}
+
+	/* journal; sfs_jmount sets up the rest if there is one */
+	sfs->sfs_journaled = false;
+	sfs->sfs_jusers = 0;
+	sfs->sfs_jcommitting = false;
+	sfs->sfs_jcap = 0;
+	sfs->sfs_jseq = 0;
+	sfs->sfs_jnblocks = 0;
+	sfs->sfs_jblocks = NULL;
+	sfs->sfs_jfreed = NULL;
+	sfs->sfs_jnfreed = 0;
+	sfs->sfs_jdesc = NULL;
+	sfs->sfs_jstage = NULL;
+	sfs->sfs_jlock = lock_create("sfs_jlock");
+	if (sfs->sfs_jlock == NULL) {
+		goto cleanup_freemaplock;
+	}
+	sfs->sfs_jcv = cv_create("sfs_jcv");
+	if (sfs->sfs_jcv == NULL) {
+		goto cleanup_jlock;
+	}
 
 	return sfs;
 
+cleanup_jlock:
+	lock_destroy(sfs->sfs_jlock);
+cleanup_freemaplock:
+	lock_destroy(sfs->sfs_freemaplock);
+cleanup_vnlock:
+	lock_destroy(sfs->sfs_vnlock);
+cleanup_superlock:
+	lock_destroy(sfs->sfs_superlock);
 cleanup_object:
 	kfree(sfs);
 fail:
@@ -421,6 +549,7 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	result = sfs_readblock(sfs, SFS_SUPER_BLOCK, &sfs->sfs_sb,
 			       sizeof(sfs->sfs_sb));
 	if (result) {
+		buffer_invalidate(dev, true);
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
 		vfs_biglock_release();
@@ -434,6 +563,7 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 			"(0x%x, should be 0x%x)\n",
 			sfs->sfs_sb.sb_magic,
 			SFS_MAGIC);
+		buffer_invalidate(dev, true);
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
 		vfs_biglock_release();
@@ -448,9 +578,24 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	/* Ensure null termination of the volume name */
 	sfs->sfs_sb.sb_volname[sizeof(sfs->sfs_sb.sb_volname)-1] = 0;
 
+	/*
+	 * Set up the journal, replaying it if we crashed with a
+	 * transaction in it. This must come before reading anything
+	 * else, which may be in the transaction.
+	 */
+	result = sfs_jmount(sfs);
+	if (result) {
+		buffer_invalidate(dev, true);
+		sfs->sfs_device = NULL;
+		sfs_fs_destroy(sfs);
+		vfs_biglock_release();
+		return result;
+	}
+
 	/* Load free block bitmap */
 	sfs->sfs_freemap = bitmap_create(SFS_FS_FREEMAPBITS(sfs));
 	if (sfs->sfs_freemap == NULL) {
+		buffer_invalidate(dev, true);
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
 		vfs_biglock_release();
@@ -458,6 +603,7 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	}
 	result = sfs_freemapio(sfs, UIO_READ);
 	if (result) {
+		buffer_invalidate(dev, true);
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
 		vfs_biglock_release();
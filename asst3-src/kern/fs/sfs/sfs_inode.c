@@ -35,13 +35,16 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <synch.h>
 #include <vfs.h>
+#include <namecache.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
 
 /*
  * Write an on-disk inode structure back out to disk.
+ * Requires sv_lock.
  */
 int
 sfs_sync_inode(struct sfs_vnode *sv)
@@ -49,6 +52,8 @@ sfs_sync_inode(struct sfs_vnode *sv)
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
 	int result;
 
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
 	if (sv->sv_dirty) {
 		result = sfs_writeblock(sfs, sv->sv_ino, &sv->sv_i,
 					sizeof(sv->sv_i));
@@ -60,9 +65,187 @@ sfs_sync_inode(struct sfs_vnode *sv)
 	return 0;
 }
 
+////////////////////////////////////////////////////////////
+// Vnode table
+
+/*
+ * Hash chain for an inode number.
+ */
+static
+struct sfs_vnode **
+sfs_vnbucket(struct sfs_fs *sfs, uint32_t ino)
+{
+	return &sfs->sfs_vnhash[ino % SFS_VNHASH_SIZE];
+}
+
+/*
+ * Add a vnode to the table. Requires sfs_vnlock.
+ */
+static
+void
+sfs_vnhash_add(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	struct sfs_vnode **bucket = sfs_vnbucket(sfs, sv->sv_ino);
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+	sv->sv_hashnext = *bucket;
+	*bucket = sv;
+	sfs->sfs_nvnodes++;
+}
+
+/*
+ * Remove a vnode from the table. Requires sfs_vnlock.
+ */
+static
+void
+sfs_vnhash_remove(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	struct sfs_vnode **p = sfs_vnbucket(sfs, sv->sv_ino);
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+	while (*p != sv) {
+		if (*p == NULL) {
+			panic("sfs: %s: vnode %u not in vnode table\n",
+			      sfs->sfs_sb.sb_volname, sv->sv_ino);
+		}
+		p = &(*p)->sv_hashnext;
+	}
+	*p = sv->sv_hashnext;
+	sv->sv_hashnext = NULL;
+	sfs->sfs_nvnodes--;
+}
+
+/*
+ * Put a vnode at the most recently used end of the inactive list.
+ */
+static
+void
+sfs_lru_add(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	KASSERT(!sv->sv_inactive);
+	sv->sv_inactive = true;
+	sv->sv_lruprev = sfs->sfs_lrutail;
+	sv->sv_lrunext = NULL;
+	if (sfs->sfs_lrutail != NULL) {
+		sfs->sfs_lrutail->sv_lrunext = sv;
+	}
+	else {
+		sfs->sfs_lruhead = sv;
+	}
+	sfs->sfs_lrutail = sv;
+	sfs->sfs_ninactive++;
+}
+
+/*
+ * Take a vnode off the inactive list.
+ */
+static
+void
+sfs_lru_remove(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	KASSERT(sv->sv_inactive);
+	if (sv->sv_lruprev != NULL) {
+		sv->sv_lruprev->sv_lrunext = sv->sv_lrunext;
+	}
+	else {
+		sfs->sfs_lruhead = sv->sv_lrunext;
+	}
+	if (sv->sv_lrunext != NULL) {
+		sv->sv_lrunext->sv_lruprev = sv->sv_lruprev;
+	}
+	else {
+		sfs->sfs_lrutail = sv->sv_lruprev;
+	}
+	sv->sv_lruprev = sv->sv_lrunext = NULL;
+	sv->sv_inactive = false;
+	sfs->sfs_ninactive--;
+}
+
+/*
+ * Tear down a vnode that has been removed from the table.
+ */
+static
+void
+sfs_vnode_destroy(struct sfs_vnode *sv)
+{
+	/* The name cache is keyed on directory vnodes */
+	if (sv->sv_i.sfi_type == SFS_TYPE_DIR) {
+		namecache_purge(&sv->sv_absvn);
+	}
+	vnode_cleanup(&sv->sv_absvn);
+	lock_destroy(sv->sv_lock);
+	kfree(sv);
+}
+
+/*
+ * Destroy inactive vnodes, least recently used first, until there
+ * are no more than MAX of them. Vnodes that sfs_sync_vnodes has
+ * borrowed are skipped. Requires sfs_vnlock.
+ *
+ * An inactive vnode's only reference is the table's, and taking a
+ * new one needs sfs_vnlock, so nobody else can be holding its
+ * sv_lock; taking it here, out of order, can't deadlock.
+ */
+static
+int
+sfs_evict_inactive(struct sfs_fs *sfs, unsigned max)
+{
+	struct sfs_vnode *sv, *next;
+	int result;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	for (sv = sfs->sfs_lruhead;
+	     sv != NULL && sfs->sfs_ninactive > max;
+	     sv = next) {
+		next = sv->sv_lrunext;
+
+		spinlock_acquire(&sv->sv_absvn.vn_countlock);
+		if (sv->sv_absvn.vn_refcount != 1) {
+			spinlock_release(&sv->sv_absvn.vn_countlock);
+			continue;
+		}
+		spinlock_release(&sv->sv_absvn.vn_countlock);
+
+		lock_acquire(sv->sv_lock);
+		result = sfs_sync_inode(sv);
+		lock_release(sv->sv_lock);
+		if (result) {
+			return result;
+		}
+
+		sfs_lru_remove(sfs, sv);
+		sfs_vnhash_remove(sfs, sv);
+		sfs_vnode_destroy(sv);
+	}
+	return 0;
+}
+
+/*
+ * Destroy all inactive vnodes, e.g. before unmounting. Hands back
+ * the number of (active) vnodes left.
+ */
+int
+sfs_purge_vnodes(struct sfs_fs *sfs, unsigned *remaining)
+{
+	int result;
+
+	sfs_jbegin(sfs);
+	lock_acquire(sfs->sfs_vnlock);
+	result = sfs_evict_inactive(sfs, 0);
+	*remaining = sfs->sfs_nvnodes;
+	lock_release(sfs->sfs_vnlock);
+	sfs_jend(sfs);
+	return result;
+}
+
 /*
  * Called when the vnode refcount (in-memory usage count) hits zero.
  *
+ * Unless the file has been deleted, the vnode isn't destroyed here:
+ * it keeps the last reference on behalf of the vnode table and goes
+ * on the inactive list.
+ *
  * This function should try to avoid returning errors other than EBUSY.
  */
 int
@@ -70,15 +253,17 @@ sfs_reclaim(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_fs *sfs = v->vn_fs->fs_data;
-	unsigned ix, i, num;
 	int result;
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
+	sfs_jbegin(sfs);
+	lock_acquire(sfs->sfs_vnlock);
 
 	/*
 	 * Make sure someone else hasn't picked up the vnode since the
-	 * decision was made to reclaim it. (You must also synchronize
-	 * this with sfs_loadvnode.)
+	 * decision was made to reclaim it. sfs_loadvnode only hands
+	 * out references while holding sfs_vnlock, so once we have it
+	 * the count can't go up behind our back.
 	 */
 	spinlock_acquire(&v->vn_countlock);
 	if (v->vn_refcount != 1) {
@@ -88,55 +273,63 @@ sfs_reclaim(struct vnode *v)
 		v->vn_refcount--;
 
 		spinlock_release(&v->vn_countlock);
-		vfs_biglock_release();
+		lock_release(sfs->sfs_vnlock);
+		sfs_jend(sfs);
+		lock_release(sv->sv_lock);
 		return EBUSY;
 	}
 	spinlock_release(&v->vn_countlock);
+	KASSERT(!sv->sv_inactive);
+
+	if (sv->sv_i.sfi_linkcount > 0) {
+		/*
+		 * Still on disk: keep it around in case it's wanted
+		 * again soon. Its reference now belongs to the table.
+		 */
+		lock_release(sv->sv_lock);
+		sfs_lru_add(sfs, sv);
+		result = sfs_evict_inactive(sfs, SFS_MAXINACTIVE);
+		lock_release(sfs->sfs_vnlock);
+		sfs_jend(sfs);
+		return result;
+	}
 
-	/* If there are no on-disk references to the file either, erase it. */
-	if (sv->sv_i.sfi_linkcount == 0) {
-		result = sfs_itrunc(sv, 0);
-		if (result) {
-			vfs_biglock_release();
-			return result;
-		}
+	/*
+	 * Deleted. Keep sfs_vnlock for the rest: until the inode is
+	 * freed and the vnode is out of the table, a concurrent
+	 * sfs_loadvnode must neither find it nor read a stale copy.
+	 */
+
+	/* There are no on-disk references to the file either; erase it. */
+	result = sfs_itrunc(sv, 0);
+	if (result) {
+		lock_release(sfs->sfs_vnlock);
+		sfs_jend(sfs);
+		lock_release(sv->sv_lock);
+		return result;
 	}
 
 	/* Sync the inode to disk */
 	result = sfs_sync_inode(sv);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sfs->sfs_vnlock);
+		sfs_jend(sfs);
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
-	/* If there are no on-disk references, discard the inode */
-	if (sv->sv_i.sfi_linkcount==0) {
-		sfs_bfree(sfs, sv->sv_ino);
-	}
+	/* Discard the inode */
+	sfs_bfree(sfs, sv->sv_ino);
 
 	/* Remove the vnode structure from the table in the struct sfs_fs. */
-	num = vnodearray_num(sfs->sfs_vnodes);
-	ix = num;
-	for (i=0; i<num; i++) {
-		struct vnode *v2 = vnodearray_get(sfs->sfs_vnodes, i);
-		struct sfs_vnode *sv2 = v2->vn_data;
-		if (sv2 == sv) {
-			ix = i;
-			break;
-		}
-	}
-	if (ix == num) {
-		panic("sfs: %s: reclaim vnode %u not in vnode pool\n",
-		      sfs->sfs_sb.sb_volname, sv->sv_ino);
-	}
-	vnodearray_remove(sfs->sfs_vnodes, ix);
-
-	vnode_cleanup(&sv->sv_absvn);
+	sfs_vnhash_remove(sfs, sv);
 
-	vfs_biglock_release();
+	lock_release(sfs->sfs_vnlock);
+	sfs_jend(sfs);
+	lock_release(sv->sv_lock);
 
-	/* Release the storage for the vnode structure itself. */
-	kfree(sv);
+	/* Nobody can find it any more; release the storage. */
+	sfs_vnode_destroy(sv);
 
 	/* Done */
 	return 0;
@@ -150,19 +343,21 @@ int
 sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		 struct sfs_vnode **ret)
 {
-	struct vnode *v;
 	struct sfs_vnode *sv;
 	const struct vnode_ops *ops;
-	unsigned i, num;
 	int result;
 
+	lock_acquire(sfs->sfs_vnlock);
+
 	/* Look in the vnodes table */
-	num = vnodearray_num(sfs->sfs_vnodes);
+	for (sv = *sfs_vnbucket(sfs, ino); sv != NULL; sv = sv->sv_hashnext) {
+		if (sv->sv_ino==ino) {
+			break;
+		}
+	}
 
-	/* Linear search. Is this too slow? You decide. */
-	for (i=0; i<num; i++) {
-		v = vnodearray_get(sfs->sfs_vnodes, i);
-		sv = v->vn_data;
+	if (sv != NULL) {
+		/* Found */
 
 		/* Every inode in memory must be in an allocated block */
 		if (!sfs_bused(sfs, sv->sv_ino)) {
@@ -170,22 +365,32 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 			      sfs->sfs_sb.sb_volname, sv->sv_ino);
 		}
 
-		if (sv->sv_ino==ino) {
-			/* Found */
-
-			/* forcetype is only allowed when creating objects */
-			KASSERT(forcetype==SFS_TYPE_INVAL);
+		/* forcetype is only allowed when creating objects */
+		KASSERT(forcetype==SFS_TYPE_INVAL);
 
+		if (sv->sv_inactive) {
+			/* Reactivate it; the table's reference is now ours */
+			sfs_lru_remove(sfs, sv);
+		}
+		else {
 			VOP_INCREF(&sv->sv_absvn);
-			*ret = sv;
-			return 0;
 		}
+		lock_release(sfs->sfs_vnlock);
+		*ret = sv;
+		return 0;
 	}
 
 	/* Didn't have it loaded; load it */
 
 	sv = kmalloc(sizeof(struct sfs_vnode));
 	if (sv==NULL) {
+		lock_release(sfs->sfs_vnlock);
+		return ENOMEM;
+	}
+	sv->sv_lock = lock_create("sfs_vnode");
+	if (sv->sv_lock == NULL) {
+		lock_release(sfs->sfs_vnlock);
+		kfree(sv);
 		return ENOMEM;
 	}
 
@@ -198,12 +403,19 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Read the block the inode is in */
 	result = sfs_readblock(sfs, ino, &sv->sv_i, sizeof(sv->sv_i));
 	if (result) {
+		lock_release(sfs->sfs_vnlock);
+		lock_destroy(sv->sv_lock);
 		kfree(sv);
 		return result;
 	}
 
 	/* Not dirty yet */
 	sv->sv_dirty = false;
+	sv->sv_dirfree = 0;
+	sv->sv_nextread = 0;
+	sv->sv_raend = 0;
+	sv->sv_lastalloc = 0;
+	bzero(sv->sv_bmapcache, sizeof(sv->sv_bmapcache));
 
 	/*
 	 * FORCETYPE is set if we're creating a new file, because the
@@ -235,20 +447,21 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Call the common vnode initializer */
 	result = vnode_init(&sv->sv_absvn, ops, &sfs->sfs_absfs, sv);
 	if (result) {
+		lock_release(sfs->sfs_vnlock);
+		lock_destroy(sv->sv_lock);
 		kfree(sv);
 		return result;
 	}
 
 	/* Set the other fields in our vnode structure */
 	sv->sv_ino = ino;
+	sv->sv_inactive = false;
+	sv->sv_lruprev = sv->sv_lrunext = NULL;
 
 	/* Add it to our table */
-	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_absvn, NULL);
-	if (result) {
-		vnode_cleanup(&sv->sv_absvn);
-		kfree(sv);
-		return result;
-	}
+	sfs_vnhash_add(sfs, sv);
+
+	lock_release(sfs->sfs_vnlock);
 
 	/* Hand it back */
 	*ret = sv;
@@ -266,10 +479,11 @@ sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret)
 
 	/*
 	 * First, get an inode. (Each inode is a block, and the inode
-	 * number is the block number, so just get a block.)
+	 * number is the block number, so just get a block.) No goal:
+	 * new inodes follow on from the volume's last allocation.
 	 */
 
-	result = sfs_balloc(sfs, &ino);
+	result = sfs_balloc(sfs, 0, true, &ino);
 	if (result) {
 		return result;
 	}
@@ -296,25 +510,19 @@ sfs_getroot(struct fs *fs, struct vnode **ret)
 	struct sfs_vnode *sv;
 	int result;
 
-	vfs_biglock_acquire();
-
 	result = sfs_loadvnode(sfs, SFS_ROOTDIR_INO, SFS_TYPE_INVAL, &sv);
 	if (result) {
 		kprintf("sfs: %s: getroot: Cannot load root vnode\n",
 			sfs->sfs_sb.sb_volname);
-		vfs_biglock_release();
 		return result;
 	}
 
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
 		kprintf("sfs: %s: getroot: not directory (type %u)\n",
 			sfs->sfs_sb.sb_volname, sv->sv_i.sfi_type);
-		vfs_biglock_release();
 		return EINVAL;
 	}
 
-	vfs_biglock_release();
-
 	*ret = &sv->sv_absvn;
 	return 0;
 }
@@ -36,8 +36,10 @@
 #include <kern/errno.h>
 #include <lib.h>
 #include <uio.h>
+#include <synch.h>
 #include <vfs.h>
 #include <device.h>
+#include <buf.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
@@ -50,70 +52,34 @@
  * early in mount, before sfs is fully (or even mostly)
  * initialized, and so may not use anything from sfs
  * except sfs_device.
+ *
+ * All block I/O goes through the buffer cache. These two copy a
+ * whole block in or out of a cached buffer; the file-level code
+ * below works on the buffers in place instead. Writes only dirty
+ * the buffer - the block reaches the disk on eviction, sync, or when
+ * the buffer cache's syncer thread gets to it. Metadata is dirtied
+ * with sfs_jdirty, which on a journaled volume makes the block part of
+ * the running transaction; sfs_writeblock is only used for metadata.
  */
 
-/*
- * Read or write a block, retrying I/O errors.
- */
-static
-int
-sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
-{
-	int result;
-	int tries=0;
-
-	KASSERT(vfs_biglock_do_i_hold());
-
-	DEBUG(DB_SFS, "sfs: %s %llu\n",
-	      uio->uio_rw == UIO_READ ? "read" : "write",
-	      uio->uio_offset / SFS_BLOCKSIZE);
-
- retry:
-	result = DEVOP_IO(sfs->sfs_device, uio);
-	if (result == EINVAL) {
-		/*
-		 * This means the sector we requested was out of range,
-		 * or the seek address we gave wasn't sector-aligned,
-		 * or a couple of other things that are our fault.
-		 */
-		panic("sfs: %s: DEVOP_IO returned EINVAL\n",
-		      sfs->sfs_sb.sb_volname);
-	}
-	if (result == EIO) {
-		if (tries == 0) {
-			tries++;
-			kprintf("sfs: %s: block %llu I/O error, retrying\n",
-				sfs->sfs_sb.sb_volname,
-				uio->uio_offset / SFS_BLOCKSIZE);
-			goto retry;
-		}
-		else if (tries < 10) {
-			tries++;
-			goto retry;
-		}
-		else {
-			kprintf("sfs: %s: block %llu I/O error, giving up "
-				"after %d retries\n",
-				sfs->sfs_sb.sb_volname,
-				uio->uio_offset / SFS_BLOCKSIZE, tries);
-		}
-	}
-	return result;
-}
-
 /*
  * Read a block.
  */
 int
 sfs_readblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
 {
-	struct iovec iov;
-	struct uio ku;
+	struct buf *buf;
+	int result;
 
 	KASSERT(len == SFS_BLOCKSIZE);
 
-	SFSUIO(&iov, &ku, data, block, UIO_READ);
-	return sfs_rwblock(sfs, &ku);
+	result = buffer_read(sfs->sfs_device, block, &buf);
+	if (result) {
+		return result;
+	}
+	memcpy(data, buffer_map(buf), len);
+	buffer_release(buf);
+	return 0;
 }
 
 /*
@@ -122,13 +88,19 @@ sfs_readblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
 int
 sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
 {
-	struct iovec iov;
-	struct uio ku;
+	struct buf *buf;
+	int result;
 
 	KASSERT(len == SFS_BLOCKSIZE);
 
-	SFSUIO(&iov, &ku, data, block, UIO_WRITE);
-	return sfs_rwblock(sfs, &ku);
+	result = buffer_get(sfs->sfs_device, block, &buf);
+	if (result) {
+		return result;
+	}
+	memcpy(buffer_map(buf), data, len);
+	sfs_jdirty(sfs, buf, block);
+	buffer_release(buf);
+	return 0;
 }
 
 ////////////////////////////////////////////////////////////
@@ -150,33 +122,26 @@ int
 sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	      uint32_t skipstart, uint32_t len)
 {
-	/*
-	 * I/O buffer for handling partial sectors.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static char iobuf[SFS_BLOCKSIZE];
-
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct buf *buf;
 	daddr_t diskblock;
 	uint32_t fileblock;
 	int result;
 
-	/* Allocate missing blocks if and only if we're writing */
-	bool doalloc = (uio->uio_rw==UIO_WRITE);
+	/*
+	 * Allocate missing blocks if and only if we're writing. They
+	 * must be zeroed, since we only write part of them.
+	 */
+	int allocmode = (uio->uio_rw==UIO_WRITE) ?
+		SFS_BMAP_ALLOC : SFS_BMAP_LOOKUP;
 
 	KASSERT(skipstart + len <= SFS_BLOCKSIZE);
 
-	/* We're using a global static buffer; it had better be locked */
-	KASSERT(vfs_biglock_do_i_hold());
-
 	/* Compute the block offset of this block in the file */
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
 
 	/* Get the disk block number */
-	result = sfs_bmap(sv, fileblock, doalloc, &diskblock);
+	result = sfs_bmap(sv, fileblock, allocmode, &diskblock);
 	if (result) {
 		return result;
 	}
@@ -184,40 +149,32 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	if (diskblock == 0) {
 		/*
 		 * There was no block mapped at this point in the file.
-		 * Zero the buffer.
+		 * Read zeros.
 		 */
 		KASSERT(uio->uio_rw == UIO_READ);
-		bzero(iobuf, sizeof(iobuf));
-	}
-	else {
-		/*
-		 * Read the block.
-		 */
-		result = sfs_readblock(sfs, diskblock, iobuf, sizeof(iobuf));
-		if (result) {
-			return result;
-		}
+		return uiomovezeros(len, uio);
 	}
 
 	/*
-	 * Now perform the requested operation into/out of the buffer.
+	 * Get the block from the buffer cache, reading it in if
+	 * needed, and do the I/O directly into/out of the buffer.
 	 */
-	result = uiomove(iobuf+skipstart, len, uio);
+	result = buffer_read(sfs->sfs_device, diskblock, &buf);
 	if (result) {
 		return result;
 	}
 
+	result = uiomove((char *)buffer_map(buf) + skipstart, len, uio);
+
 	/*
-	 * If it was a write, write back the modified block.
+	 * If it was a write, the buffer now needs writing back.
 	 */
-	if (uio->uio_rw == UIO_WRITE) {
-		result = sfs_writeblock(sfs, diskblock, iobuf, sizeof(iobuf));
-		if (result) {
-			return result;
-		}
+	if (result == 0 && uio->uio_rw == UIO_WRITE) {
+		buffer_mark_dirty(buf);
 	}
 
-	return 0;
+	buffer_release(buf);
+	return result;
 }
 
 /*
@@ -228,23 +185,37 @@ int
 sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 {
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct buf *buf;
 	daddr_t diskblock;
 	uint32_t fileblock;
-	int result;
-	bool doalloc = (uio->uio_rw==UIO_WRITE);
-	off_t saveoff;
-	off_t diskoff;
-	off_t saveres;
-	off_t diskres;
+	int result, result2;
+	size_t saveres, done;
+	daddr_t lastalloc;
+	bool fresh;
+
+	/*
+	 * Allocate missing blocks if and only if we're writing. A
+	 * write covers the whole block, so a new one needn't be zeroed
+	 * first; if the copy fails partway, the rest is zeroed below.
+	 */
+	int allocmode = (uio->uio_rw==UIO_WRITE) ?
+		SFS_BMAP_FILL : SFS_BMAP_LOOKUP;
 
 	/* Get the block number within the file */
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
 
-	/* Look up the disk block number */
-	result = sfs_bmap(sv, fileblock, doalloc, &diskblock);
+	/*
+	 * Look up the disk block number. The data block is the last
+	 * one sfs_bmap allocates, so if it allocated any, the file's
+	 * last allocation is now our block, with its old contents.
+	 */
+	lastalloc = sv->sv_lastalloc;
+	result = sfs_bmap(sv, fileblock, allocmode, &diskblock);
 	if (result) {
 		return result;
 	}
+	fresh = (sv->sv_lastalloc != lastalloc &&
+		 sv->sv_lastalloc == diskblock);
 
 	if (diskblock == 0) {
 		/*
@@ -258,31 +229,110 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 	}
 
 	/*
-	 * Do the I/O directly to the uio region. Save the uio_offset,
-	 * and substitute one that makes sense to the device.
+	 * Go through the buffer cache. A write covers the whole block,
+	 * so there is no need to read the old contents first.
 	 */
-	saveoff = uio->uio_offset;
-	diskoff = diskblock * SFS_BLOCKSIZE;
-	uio->uio_offset = diskoff;
+	if (uio->uio_rw == UIO_READ) {
+		result = buffer_read(sfs->sfs_device, diskblock, &buf);
+	}
+	else {
+		result = buffer_get(sfs->sfs_device, diskblock, &buf);
+	}
+	if (result) {
+		if (fresh) {
+			/*
+			 * The new block is in the file now, still holding
+			 * whatever was freed there last. Try again to get
+			 * it zeroed through the buffer cache.
+			 */
+			result2 = sfs_clearblock(sfs, diskblock);
+			if (result2) {
+				return result2;
+			}
+		}
+		return result;
+	}
 
-	/*
-	 * Temporarily set the residue to be one block size.
-	 */
-	KASSERT(uio->uio_resid >= SFS_BLOCKSIZE);
 	saveres = uio->uio_resid;
-	diskres = SFS_BLOCKSIZE;
-	uio->uio_resid = diskres;
+	result = uiomove(buffer_map(buf), SFS_BLOCKSIZE, uio);
+	if (uio->uio_rw == UIO_WRITE) {
+		if (result && fresh) {
+			/*
+			 * The copy stopped partway. The rest of the buffer
+			 * may hold some other block's old contents, so
+			 * zero it rather than let that reach the disk.
+			 */
+			done = saveres - uio->uio_resid;
+			bzero((char *)buffer_map(buf) + done,
+			      SFS_BLOCKSIZE - done);
+		}
+		/*
+		 * If the copy stopped partway into an existing block
+		 * that wasn't cached, the rest of the buffer is not the
+		 * block's. Leave it unfilled: releasing it drops it, and
+		 * the block keeps its old contents on disk.
+		 */
+		if (result == 0 || fresh || buffer_valid(buf)) {
+			buffer_mark_dirty(buf);
+		}
+	}
+	buffer_release(buf);
 
-	result = sfs_rwblock(sfs, uio);
+	return result;
+}
 
-	/*
-	 * Now, restore the original uio_offset and uio_resid and update
-	 * them by the amount of I/O done.
-	 */
-	uio->uio_offset = (uio->uio_offset - diskoff) + saveoff;
-	uio->uio_resid = (uio->uio_resid - diskres) + saveres;
+/*
+ * Read-ahead for sequential readers. A read counts as sequential if
+ * it starts in the block where the last read of the file stopped.
+ * Then the file's next blocks, up to the buffer cache's read-ahead
+ * window past the end of this read, are queued to be read in the
+ * background. sv_raend remembers how far has been queued, so each
+ * block is only asked for once per sequential run. Holes and blocks
+ * past EOF are skipped.
+ *
+ * This is per file rather than per open file, because that's all the
+ * filesystem sees; two processes reading the same file in step still
+ * look sequential.
+ */
+static
+void
+sfs_readahead(struct sfs_vnode *sv, off_t startpos, off_t endpos)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	uint32_t startblock, fileblock, lastblock, nblocks;
+	daddr_t diskblock;
+	unsigned window;
 
-	return result;
+	startblock = startpos / SFS_BLOCKSIZE;
+	if (startblock != sv->sv_nextread) {
+		/* Not sequential; start over */
+		sv->sv_raend = 0;
+	}
+	else {
+		window = buffer_readahead_window();
+		nblocks = DIVROUNDUP(sv->sv_i.sfi_size, SFS_BLOCKSIZE);
+		lastblock = endpos / SFS_BLOCKSIZE + window;
+		if (lastblock > nblocks) {
+			lastblock = nblocks;
+		}
+		fileblock = endpos / SFS_BLOCKSIZE;
+		if (fileblock < sv->sv_raend) {
+			fileblock = sv->sv_raend;
+		}
+		for (; fileblock < lastblock; fileblock++) {
+			if (sfs_bmap(sv, fileblock, SFS_BMAP_LOOKUP,
+				     &diskblock)) {
+				break;
+			}
+			if (diskblock != 0 &&
+			    !buffer_readahead(sfs->sfs_device, diskblock)) {
+				/* Queue full; try this block again next time */
+				break;
+			}
+		}
+		sv->sv_raend = fileblock;
+	}
+	sv->sv_nextread = endpos / SFS_BLOCKSIZE;
 }
 
 /*
@@ -295,8 +345,12 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	uint32_t nblocks, i;
 	int result = 0;
 	uint32_t origresid, extraresid = 0;
+	off_t origoffset;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
 	origresid = uio->uio_resid;
+	origoffset = uio->uio_offset;
 
 	/*
 	 * If reading, check for EOF. If we can read a partial area,
@@ -353,6 +407,13 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	KASSERT(uio->uio_offset % SFS_BLOCKSIZE == 0);
 	nblocks = uio->uio_resid / SFS_BLOCKSIZE;
 	for (i=0; i<nblocks; i++) {
+		if (uio->uio_rw == UIO_WRITE) {
+			/* Don't let a long write overflow the journal */
+			result = sfs_jrestart(sv, uio->uio_offset);
+			if (result) {
+				goto out;
+			}
+		}
 		result = sfs_blockio(sv, uio);
 		if (result) {
 			goto out;
@@ -381,6 +442,11 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 		sv->sv_dirty = true;
 	}
 
+	/* If reading, queue up the blocks a sequential reader wants next */
+	if (uio->uio_rw == UIO_READ && result == 0) {
+		sfs_readahead(sv, origoffset, uio->uio_offset);
+	}
+
 	/* Add in any extra amount we couldn't read because of EOF */
 	uio->uio_resid += extraresid;
 
@@ -411,34 +477,26 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 	uint32_t vnblock;
 	uint32_t blockoffset;
 	daddr_t diskblock;
-	bool doalloc;
+	int allocmode;
+	struct buf *buf;
+	char *ioptr;
 	int result;
 
-	/*
-	 * I/O buffer for metadata ops.
-	 *
-	 * Note: in real life (and when you've done the fs assignment) you
-	 * would get space from the disk buffer cache for this, not use a
-	 * static area.
-	 */
-	static char metaiobuf[SFS_BLOCKSIZE];
-
-	/* We're using a global static buffer; it had better be locked */
-	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
 	/* Figure out which block of the vnode (directory, whatever) this is */
 	vnblock = actualpos / SFS_BLOCKSIZE;
 	blockoffset = actualpos % SFS_BLOCKSIZE;
 
 	/* Get the disk block number */
-	doalloc = (rw == UIO_WRITE);
-	result = sfs_bmap(sv, vnblock, doalloc, &diskblock);
+	allocmode = (rw == UIO_WRITE) ? SFS_BMAP_ALLOC : SFS_BMAP_LOOKUP;
+	result = sfs_bmap(sv, vnblock, allocmode, &diskblock);
 	if (result) {
 		return result;
 	}
 
 	if (diskblock == 0) {
-		/* Should only get block 0 back if doalloc is false */
+		/* Should only get block 0 back if we didn't allocate */
 		KASSERT(rw == UIO_READ);
 
 		/* Sparse file, read as zeros. */
@@ -446,26 +504,21 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 		return 0;
 	}
 
-	/* Read the block */
-	result = sfs_readblock(sfs, diskblock, metaiobuf, sizeof(metaiobuf));
+	/* Get the block from the buffer cache */
+	result = buffer_read(sfs->sfs_device, diskblock, &buf);
 	if (result) {
 		return result;
 	}
+	ioptr = buffer_map(buf);
 
 	if (rw == UIO_READ) {
 		/* Copy out the selected region */
-		memcpy(data, metaiobuf + blockoffset, len);
+		memcpy(data, ioptr + blockoffset, len);
 	}
 	else {
-		/* Update the selected region */
-		memcpy(metaiobuf + blockoffset, data, len);
-
-		/* Write the block back */
-		result = sfs_writeblock(sfs, diskblock,
-					metaiobuf, sizeof(metaiobuf));
-		if (result) {
-			return result;
-		}
+		/* Update the selected region; it gets written back later */
+		memcpy(ioptr + blockoffset, data, len);
+		sfs_jdirty(sfs, buf, diskblock);
 
 		/* Update the vnode size if needed */
 		endpos = actualpos + len;
@@ -474,6 +527,7 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 			sv->sv_dirty = true;
 		}
 	}
+	buffer_release(buf);
 
 	/* Done */
 	return 0;
@@ -0,0 +1,701 @@
+/*
+ * SFS filesystem
+ *
+ * Metadata journal.
+ *
+ * Every change to metadata - inodes, indirect blocks, directory
+ * blocks, the freemap and the superblock - is made inside a
+ * transaction. Operations join the running transaction with
+ * sfs_jbegin() and leave it with sfs_jend(); many operations share
+ * one transaction, which is committed as a whole (group commit) when
+ * it fills up, on sync and fsync, and every few seconds when the
+ * buffer cache's syncer syncs the file systems.
+ *
+ * Metadata is changed in the buffer cache as before, but through
+ * sfs_jdirty(), which pins the buffer so that the block doesn't reach
+ * its home on disk ahead of the rest of the transaction, and adds it
+ * to the transaction's list. Committing then:
+ *
+ *    1. waits for the operations in the transaction to finish, and
+ *       keeps new ones out until the commit is done;
+ *    2. applies the transaction's frees to the freemap, and logs the
+ *       freemap (freed blocks stay allocated until now, so they can't
+ *       be reused, and overwritten, before the free is on disk);
+ *    3. writes back file data, so that it is on disk before any
+ *       metadata that points at it (only metadata is logged);
+ *    4. writes copies of the logged blocks into the journal, a few
+ *       consecutive blocks per transfer, and after them the
+ *       descriptor that lists them - once it is on disk the
+ *       transaction has committed;
+ *    5. unpins the buffers and writes them to their home blocks, and
+ *       moves the journal header's sequence number past the
+ *       transaction so that it isn't replayed.
+ *
+ * The journal holds one transaction at a time. A crash between steps
+ * 4 and 5 leaves a descriptor that matches the header; mounting the
+ * volume (or running sfsck on it) replays it by copying the logged
+ * blocks home. A crash anywhere else leaves the volume as the last
+ * commit left it. Either way the volume is consistent without a full
+ * check, bar one thing: a file removed while still open is only freed
+ * at its last close, so a crash in between leaves an orphaned inode
+ * for sfsck to find.
+ *
+ * sfs_jlock protects the transaction state. While a commit is under
+ * way nobody else can touch the transaction, so the committing thread
+ * works on it without the lock.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <bitmap.h>
+#include <spinlock.h>
+#include <clock.h>
+#include <synch.h>
+#include <uio.h>
+#include <device.h>
+#include <blkio.h>
+#include <buf.h>
+#include <sfs.h>
+#include "sfsprivate.h"
+
+#define SFS_JCREDITS  10        /* most blocks an operation logs between checks */
+#define SFS_JCHUNK    8         /* log blocks per transfer */
+
+/*
+ * Journal statistics, over all volumes.
+ */
+static struct spinlock journal_statlock = SPINLOCK_INITIALIZER;
+static struct {
+	unsigned ops;           /* sfs_jbegin calls */
+	unsigned commits;       /* transactions written to the journal */
+	unsigned full;          /* ...of which because they filled up */
+	unsigned blocks;        /* blocks logged by them */
+	unsigned freed;         /* blocks freed by them */
+	uint64_t commitns;      /* time spent committing */
+} journal_stats;
+
+/* Set by sfs_journal_crashtest */
+static volatile bool journal_crash;
+
+/*
+ * Checksum for the descriptor: 32-bit FNV-1a, continuing from HASH.
+ */
+static
+uint32_t
+sfs_jchecksum(uint32_t hash, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	size_t i;
+
+	for (i=0; i<len; i++) {
+		hash ^= p[i];
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+/*
+ * Read or write blocks of the journal, straight to the disk. Journal
+ * blocks are never read back in normal operation, so caching them
+ * would only push useful blocks out of the buffer cache.
+ */
+static
+int
+sfs_jio(struct sfs_fs *sfs, uint32_t jblock, void *data, unsigned nblocks,
+	enum uio_rw rw)
+{
+	KASSERT(jblock + nblocks <= SFS_JOURNALBLOCKS);
+	return blkio(sfs->sfs_device, sfs->sfs_sb.sb_journalstart + jblock,
+		     data, nblocks * SFS_BLOCKSIZE, rw);
+}
+
+////////////////////////////////////////////////////////////
+// Recovery
+
+/*
+ * Write the journal header with the given sequence number.
+ */
+static
+int
+sfs_jwriteheader(struct sfs_fs *sfs, uint32_t seq)
+{
+	struct sfs_jheader *jh = sfs->sfs_jstage;
+
+	bzero(jh, sizeof(*jh));
+	jh->jh_magic = SFS_JHEADER_MAGIC;
+	jh->jh_seq = seq;
+	return sfs_jio(sfs, SFS_JHEADER_BLOCK, jh, 1, UIO_WRITE);
+}
+
+/*
+ * Replay the transaction in the journal, if it committed but didn't
+ * make it home. Called at mount, after the superblock is loaded and
+ * before anything else is read.
+ */
+static
+int
+sfs_jrecover(struct sfs_fs *sfs)
+{
+	struct sfs_jheader *jh = sfs->sfs_jstage;
+	struct sfs_jdesc *jd = sfs->sfs_jdesc;
+	char *stage = sfs->sfs_jstage;
+	struct timespec before, after, duration;
+	uint32_t start = sfs->sfs_sb.sb_journalstart;
+	uint32_t seq, n, i, j, k, block, hash;
+	struct buf *buf;
+	int result;
+
+	gettime(&before);
+
+	result = sfs_jio(sfs, SFS_JHEADER_BLOCK, jh, 1, UIO_READ);
+	if (result) {
+		return result;
+	}
+	if (jh->jh_magic != SFS_JHEADER_MAGIC) {
+		kprintf("sfs: %s: Wrong magic number in journal header "
+			"(0x%x, should be 0x%x)\n", sfs->sfs_sb.sb_volname,
+			jh->jh_magic, SFS_JHEADER_MAGIC);
+		return EINVAL;
+	}
+	seq = jh->jh_seq;
+	sfs->sfs_jseq = seq;
+
+	result = sfs_jio(sfs, SFS_JDESC_BLOCK, jd, 1, UIO_READ);
+	if (result) {
+		return result;
+	}
+	n = jd->jd_nblocks;
+	if (jd->jd_magic != SFS_JDESC_MAGIC || jd->jd_seq != seq ||
+	    n > SFS_JMAXBLOCKS) {
+		/* Nothing committed since the last checkpoint */
+		return 0;
+	}
+
+	/* Make sure all of it is there before touching anything */
+	hash = sfs_jchecksum(SFS_JCHECKSUM_INIT, jd->jd_blocks,
+			     n * sizeof(jd->jd_blocks[0]));
+	for (i=0; i<n; i+=k) {
+		k = n - i < SFS_JCHUNK ? n - i : SFS_JCHUNK;
+		result = sfs_jio(sfs, SFS_JLOG_START + i, stage, k, UIO_READ);
+		if (result) {
+			return result;
+		}
+		hash = sfs_jchecksum(hash, stage, k * SFS_BLOCKSIZE);
+	}
+	if (hash != jd->jd_checksum) {
+		kprintf("sfs: %s: journal transaction %u incomplete; "
+			"discarded\n", sfs->sfs_sb.sb_volname, seq);
+		return 0;
+	}
+	for (i=0; i<n; i++) {
+		block = jd->jd_blocks[i];
+		if (block >= sfs->sfs_sb.sb_nblocks ||
+		    (block >= start && block < start + SFS_JOURNALBLOCKS)) {
+			kprintf("sfs: %s: journal transaction %u logs "
+				"invalid block %u\n", sfs->sfs_sb.sb_volname,
+				seq, block);
+			return EINVAL;
+		}
+	}
+
+	/*
+	 * Copy it home. Go through the buffer cache, which may already
+	 * hold some of these blocks (the superblock, at least).
+	 */
+	for (i=0; i<n; i+=k) {
+		k = n - i < SFS_JCHUNK ? n - i : SFS_JCHUNK;
+		result = sfs_jio(sfs, SFS_JLOG_START + i, stage, k, UIO_READ);
+		if (result) {
+			return result;
+		}
+		for (j=0; j<k; j++) {
+			result = buffer_get(sfs->sfs_device, jd->jd_blocks[i+j],
+					    &buf);
+			if (result) {
+				return result;
+			}
+			memcpy(buffer_map(buf), stage + j * SFS_BLOCKSIZE,
+			       SFS_BLOCKSIZE);
+			buffer_mark_dirty(buf);
+			buffer_release(buf);
+		}
+	}
+	result = buffer_sync(sfs->sfs_device);
+	if (result) {
+		return result;
+	}
+	result = sfs_jwriteheader(sfs, seq + 1);
+	if (result) {
+		return result;
+	}
+	sfs->sfs_jseq = seq + 1;
+
+	/* The superblock may have been among them */
+	result = sfs_readblock(sfs, SFS_SUPER_BLOCK, &sfs->sfs_sb,
+			       sizeof(sfs->sfs_sb));
+	if (result) {
+		return result;
+	}
+	sfs->sfs_sb.sb_volname[sizeof(sfs->sfs_sb.sb_volname)-1] = 0;
+
+	gettime(&after);
+	timespec_sub(&after, &before, &duration);
+	kprintf("sfs: %s: replayed journal transaction %u (%u blocks) "
+		"in %llu ms\n", sfs->sfs_sb.sb_volname, seq, n,
+		(unsigned long long)(duration.tv_sec * 1000 +
+				     duration.tv_nsec / 1000000));
+	return 0;
+}
+
+/*
+ * Set up the journal at mount time, replaying it if need be. Volumes
+ * without one are left unjournaled.
+ */
+int
+sfs_jmount(struct sfs_fs *sfs)
+{
+	uint32_t nblocks = sfs->sfs_sb.sb_nblocks;
+	uint32_t start = sfs->sfs_sb.sb_journalstart;
+	uint32_t freemapblocks = SFS_FREEMAPBLOCKS(nblocks);
+	unsigned cap;
+	int result;
+
+	if (sfs->sfs_sb.sb_journalblocks == 0) {
+		return 0;
+	}
+	if (sfs->sfs_sb.sb_journalblocks != SFS_JOURNALBLOCKS ||
+	    start < SFS_FREEMAP_START + freemapblocks ||
+	    start + SFS_JOURNALBLOCKS > nblocks) {
+		kprintf("sfs: %s: Invalid journal (%u blocks at block %u)\n",
+			sfs->sfs_sb.sb_volname,
+			sfs->sfs_sb.sb_journalblocks, start);
+		return EINVAL;
+	}
+
+	sfs->sfs_jblocks = kmalloc(SFS_JMAXBLOCKS * sizeof(uint32_t));
+	sfs->sfs_jdesc = kmalloc(sizeof(struct sfs_jdesc));
+	sfs->sfs_jstage = kmalloc(SFS_JCHUNK * SFS_BLOCKSIZE);
+	sfs->sfs_jfreed = bitmap_create(SFS_FREEMAPBITS(nblocks));
+	if (sfs->sfs_jblocks == NULL || sfs->sfs_jdesc == NULL ||
+	    sfs->sfs_jstage == NULL || sfs->sfs_jfreed == NULL) {
+		return ENOMEM;
+	}
+
+	result = sfs_jrecover(sfs);
+	if (result) {
+		return result;
+	}
+
+	/*
+	 * A transaction's blocks stay pinned in the buffer cache until
+	 * it commits, so keep it to half the cache. Each commit also
+	 * logs the whole freemap.
+	 */
+	cap = buffer_maxcount() / 2;
+	if (cap > SFS_JMAXBLOCKS) {
+		cap = SFS_JMAXBLOCKS;
+	}
+	if (cap < freemapblocks + 2 * SFS_JCREDITS) {
+		kprintf("sfs: %s: buffer cache too small to journal in; "
+			"journal disabled\n", sfs->sfs_sb.sb_volname);
+		return 0;
+	}
+	sfs->sfs_jcap = cap - freemapblocks;
+	sfs->sfs_jnblocks = 0;
+	sfs->sfs_jnfreed = 0;
+	sfs->sfs_journaled = true;
+	return 0;
+}
+
+/*
+ * Free what sfs_jmount allocated. The volume must have been synced.
+ */
+void
+sfs_jdestroy(struct sfs_fs *sfs)
+{
+	KASSERT(sfs->sfs_jnblocks == 0 && sfs->sfs_jnfreed == 0);
+	KASSERT(sfs->sfs_jusers == 0);
+	if (sfs->sfs_jfreed != NULL) {
+		bitmap_destroy(sfs->sfs_jfreed);
+	}
+	kfree(sfs->sfs_jstage);
+	kfree(sfs->sfs_jdesc);
+	kfree(sfs->sfs_jblocks);
+}
+
+////////////////////////////////////////////////////////////
+// Commit
+
+/*
+ * Step 2: apply the transaction's frees. Freed blocks need neither
+ * logging nor writing back, so drop them from the transaction and
+ * from the buffer cache.
+ */
+static
+void
+sfs_japplyfrees(struct sfs_fs *sfs)
+{
+	uint32_t i, j, block, nblocks = sfs->sfs_sb.sb_nblocks;
+
+	lock_acquire(sfs->sfs_freemaplock);
+	if (sfs->sfs_jnfreed == 0) {
+		lock_release(sfs->sfs_freemaplock);
+		return;
+	}
+
+	for (i=j=0; i<sfs->sfs_jnblocks; i++) {
+		if (!bitmap_isset(sfs->sfs_jfreed, sfs->sfs_jblocks[i])) {
+			sfs->sfs_jblocks[j++] = sfs->sfs_jblocks[i];
+		}
+	}
+	sfs->sfs_jnblocks = j;
+
+	for (block=0; block<nblocks && sfs->sfs_jnfreed > 0; block++) {
+		if (!bitmap_isset(sfs->sfs_jfreed, block)) {
+			continue;
+		}
+		buffer_forget(sfs->sfs_device, block);
+		bitmap_unmark(sfs->sfs_jfreed, block);
+		bitmap_unmark(sfs->sfs_freemap, block);
+		sfs->sfs_jnfreed--;
+
+		spinlock_acquire(&journal_statlock);
+		journal_stats.freed++;
+		spinlock_release(&journal_statlock);
+	}
+	sfs->sfs_freemapdirty = true;
+	lock_release(sfs->sfs_freemaplock);
+}
+
+/*
+ * Steps 2-5: write out the transaction. Called with sfs_jcommitting
+ * set and no operations in the transaction, without sfs_jlock.
+ *
+ * There is no good way to back out of a failed commit - the
+ * operations in it have long since returned success - so I/O errors
+ * are fatal.
+ */
+static
+void
+sfs_jwrite(struct sfs_fs *sfs)
+{
+	struct device *dev = sfs->sfs_device;
+	struct sfs_jdesc *jd = sfs->sfs_jdesc;
+	char *stage = sfs->sfs_jstage;
+	struct timespec before, after, duration;
+	uint32_t i, j, k, n, hash;
+	struct buf *buf;
+	int result;
+
+	KASSERT(sfs->sfs_jcommitting && sfs->sfs_jusers == 0);
+	gettime(&before);
+
+	sfs_japplyfrees(sfs);
+	result = sfs_sync_freemap(sfs);
+	if (result) {
+		goto fail;
+	}
+
+	/* File data first */
+	result = buffer_sync(dev);
+	if (result) {
+		goto fail;
+	}
+
+	n = sfs->sfs_jnblocks;
+	if (n == 0) {
+		return;
+	}
+
+	/* The logged blocks, then the descriptor that commits them */
+	hash = sfs_jchecksum(SFS_JCHECKSUM_INIT, sfs->sfs_jblocks,
+			     n * sizeof(sfs->sfs_jblocks[0]));
+	for (i=0; i<n; i+=k) {
+		k = n - i < SFS_JCHUNK ? n - i : SFS_JCHUNK;
+		for (j=0; j<k; j++) {
+			/* Pinned, so always a cache hit */
+			result = buffer_read(dev, sfs->sfs_jblocks[i+j], &buf);
+			if (result) {
+				goto fail;
+			}
+			memcpy(stage + j * SFS_BLOCKSIZE, buffer_map(buf),
+			       SFS_BLOCKSIZE);
+			buffer_release(buf);
+		}
+		hash = sfs_jchecksum(hash, stage, k * SFS_BLOCKSIZE);
+		result = sfs_jio(sfs, SFS_JLOG_START + i, stage, k,
+				 UIO_WRITE);
+		if (result) {
+			goto fail;
+		}
+	}
+
+	bzero(jd, sizeof(*jd));
+	jd->jd_magic = SFS_JDESC_MAGIC;
+	jd->jd_seq = sfs->sfs_jseq;
+	jd->jd_nblocks = n;
+	jd->jd_checksum = hash;
+	memcpy(jd->jd_blocks, sfs->sfs_jblocks, n * sizeof(jd->jd_blocks[0]));
+	result = sfs_jio(sfs, SFS_JDESC_BLOCK, jd, 1, UIO_WRITE);
+	if (result) {
+		goto fail;
+	}
+
+	if (journal_crash) {
+		panic("sfs: %s: simulated crash after committing "
+		      "transaction %u\n", sfs->sfs_sb.sb_volname,
+		      sfs->sfs_jseq);
+	}
+
+	/* Checkpoint */
+	for (i=0; i<n; i++) {
+		buffer_unpin(dev, sfs->sfs_jblocks[i]);
+	}
+	result = buffer_sync(dev);
+	if (result) {
+		goto fail;
+	}
+	result = sfs_jwriteheader(sfs, sfs->sfs_jseq + 1);
+	if (result) {
+		goto fail;
+	}
+	sfs->sfs_jseq++;
+	sfs->sfs_jnblocks = 0;
+
+	gettime(&after);
+	timespec_sub(&after, &before, &duration);
+	spinlock_acquire(&journal_statlock);
+	journal_stats.commits++;
+	journal_stats.blocks += n;
+	journal_stats.commitns += duration.tv_sec * 1000000000ULL +
+		duration.tv_nsec;
+	spinlock_release(&journal_statlock);
+	return;
+
+ fail:
+	panic("sfs: %s: journal commit of transaction %u failed: %s\n",
+	      sfs->sfs_sb.sb_volname, sfs->sfs_jseq, strerror(result));
+}
+
+/*
+ * Step 1, and the rest. Requires sfs_jlock, and that the caller isn't
+ * in the transaction. If a commit is already under way, wait for it
+ * instead; it includes everything the caller did.
+ */
+static
+void
+sfs_jcommit_locked(struct sfs_fs *sfs)
+{
+	KASSERT(lock_do_i_hold(sfs->sfs_jlock));
+
+	if (sfs->sfs_jcommitting) {
+		while (sfs->sfs_jcommitting) {
+			cv_wait(sfs->sfs_jcv, sfs->sfs_jlock);
+		}
+		return;
+	}
+
+	sfs->sfs_jcommitting = true;
+	while (sfs->sfs_jusers > 0) {
+		cv_wait(sfs->sfs_jcv, sfs->sfs_jlock);
+	}
+	lock_release(sfs->sfs_jlock);
+
+	sfs_jwrite(sfs);
+
+	lock_acquire(sfs->sfs_jlock);
+	sfs->sfs_jcommitting = false;
+	cv_broadcast(sfs->sfs_jcv, sfs->sfs_jlock);
+}
+
+/*
+ * Commit the running transaction and write everything back, for sync
+ * and fsync. Without a journal that's just writing everything back.
+ */
+int
+sfs_jcommit(struct sfs_fs *sfs)
+{
+	if (!sfs->sfs_journaled) {
+		return buffer_sync(sfs->sfs_device);
+	}
+
+	lock_acquire(sfs->sfs_jlock);
+	sfs_jcommit_locked(sfs);
+	lock_release(sfs->sfs_jlock);
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// Transactions
+
+/*
+ * Join the running transaction. Each operation in it is counted on
+ * to log no more than SFS_JCREDITS blocks (or to call sfs_jrestart
+ * often enough); if there isn't room for that, commit first.
+ */
+void
+sfs_jbegin(struct sfs_fs *sfs)
+{
+	if (!sfs->sfs_journaled) {
+		return;
+	}
+
+	lock_acquire(sfs->sfs_jlock);
+	while (true) {
+		if (sfs->sfs_jcommitting) {
+			cv_wait(sfs->sfs_jcv, sfs->sfs_jlock);
+		}
+		else if (sfs->sfs_jnblocks +
+			 (sfs->sfs_jusers + 1) * SFS_JCREDITS > sfs->sfs_jcap) {
+			spinlock_acquire(&journal_statlock);
+			journal_stats.full++;
+			spinlock_release(&journal_statlock);
+			sfs_jcommit_locked(sfs);
+		}
+		else {
+			break;
+		}
+	}
+	sfs->sfs_jusers++;
+	lock_release(sfs->sfs_jlock);
+
+	spinlock_acquire(&journal_statlock);
+	journal_stats.ops++;
+	spinlock_release(&journal_statlock);
+}
+
+/*
+ * Leave the running transaction. Any inodes the operation changed
+ * must have been synced into their buffers by now.
+ */
+void
+sfs_jend(struct sfs_fs *sfs)
+{
+	if (!sfs->sfs_journaled) {
+		return;
+	}
+
+	lock_acquire(sfs->sfs_jlock);
+	KASSERT(sfs->sfs_jusers > 0);
+	sfs->sfs_jusers--;
+	if (sfs->sfs_jusers == 0) {
+		cv_broadcast(sfs->sfs_jcv, sfs->sfs_jlock);
+	}
+	lock_release(sfs->sfs_jlock);
+}
+
+/*
+ * For long writes: if the running transaction is getting full, end
+ * it and join the next one, so a single write can log any number of
+ * blocks. POS is how far the write has got; the file's size and
+ * inode are brought up to date first, so each transaction leaves the
+ * file consistent. Requires sv_lock.
+ */
+int
+sfs_jrestart(struct sfs_vnode *sv, off_t pos)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	bool full;
+	int result;
+
+	if (!sfs->sfs_journaled) {
+		return 0;
+	}
+
+	lock_acquire(sfs->sfs_jlock);
+	full = sfs->sfs_jnblocks + sfs->sfs_jusers * SFS_JCREDITS >
+		sfs->sfs_jcap;
+	lock_release(sfs->sfs_jlock);
+	if (!full) {
+		return 0;
+	}
+
+	if (pos > (off_t)sv->sv_i.sfi_size) {
+		sv->sv_i.sfi_size = pos;
+		sv->sv_dirty = true;
+	}
+	result = sfs_sync_inode(sv);
+	if (result) {
+		return result;
+	}
+	sfs_jend(sfs);
+	sfs_jbegin(sfs);
+	return 0;
+}
+
+/*
+ * Mark a busy metadata buffer dirty, as part of the running
+ * transaction. BLOCK is the block it holds.
+ */
+void
+sfs_jdirty(struct sfs_fs *sfs, struct buf *buf, daddr_t block)
+{
+	buffer_mark_dirty(buf);
+	if (!sfs->sfs_journaled) {
+		return;
+	}
+
+	lock_acquire(sfs->sfs_jlock);
+	KASSERT(sfs->sfs_jusers > 0 || sfs->sfs_jcommitting);
+	if (buffer_pin(buf)) {
+		if (sfs->sfs_jnblocks >= SFS_JMAXBLOCKS) {
+			panic("sfs: %s: journal transaction %u overflowed\n",
+			      sfs->sfs_sb.sb_volname, sfs->sfs_jseq);
+		}
+		sfs->sfs_jblocks[sfs->sfs_jnblocks++] = block;
+	}
+	lock_release(sfs->sfs_jlock);
+}
+
+////////////////////////////////////////////////////////////
+// Statistics
+
+/*
+ * Print the journal statistics.
+ */
+void
+sfs_journal_printstats(void)
+{
+	unsigned ops, commits, full, blocks, freed;
+	uint64_t commitns;
+
+	spinlock_acquire(&journal_statlock);
+	ops = journal_stats.ops;
+	commits = journal_stats.commits;
+	full = journal_stats.full;
+	blocks = journal_stats.blocks;
+	freed = journal_stats.freed;
+	commitns = journal_stats.commitns;
+	spinlock_release(&journal_statlock);
+
+	kprintf("sfs journal: %u operations, %u commits (%u when full)\n",
+		ops, commits, full);
+	if (commits > 0) {
+		kprintf("sfs journal: %u operations, %u blocks logged and "
+			"%llu us per commit\n", ops / commits,
+			blocks / commits,
+			(unsigned long long)(commitns / commits / 1000));
+	}
+	kprintf("sfs journal: %u blocks freed at commit\n", freed);
+}
+
+/*
+ * Reset the journal statistics.
+ */
+void
+sfs_journal_resetstats(void)
+{
+	spinlock_acquire(&journal_statlock);
+	bzero(&journal_stats, sizeof(journal_stats));
+	spinlock_release(&journal_statlock);
+}
+
+/*
+ * Make the next commit panic once its transaction has committed, to
+ * test recovery.
+ */
+void
+sfs_journal_crashtest(void)
+{
+	journal_crash = true;
+}
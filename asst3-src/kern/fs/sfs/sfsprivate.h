@@ -32,6 +32,8 @@
 
 #include <uio.h> /* for uio_rw */
 
+struct buf;
+
 
 /* ops tables (in sfs_vnops.c) */
 extern const struct vnode_ops sfs_fileops;
@@ -43,12 +45,17 @@ extern const struct vnode_ops sfs_dirops;
 
 
 /* Functions in sfs_balloc.c */
-int sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock);
+int sfs_balloc(struct sfs_fs *sfs, daddr_t goal, bool clear,
+		daddr_t *diskblock);
 void sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock);
 int sfs_bused(struct sfs_fs *sfs, daddr_t diskblock);
+int sfs_clearblock(struct sfs_fs *sfs, daddr_t block);
 
 /* Functions in sfs_bmap.c */
-int sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
+#define SFS_BMAP_LOOKUP 0       /* unallocated blocks come back as 0 */
+#define SFS_BMAP_ALLOC  1       /* allocate them, zeroed */
+#define SFS_BMAP_FILL   2       /* allocate them; the caller fills all of it */
+int sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int allocmode,
 		daddr_t *diskblock);
 int sfs_itrunc(struct sfs_vnode *sv, off_t len);
 
@@ -62,9 +69,22 @@ int sfs_lookonce(struct sfs_vnode *sv, const char *name,
 		struct sfs_vnode **ret,
 		int *slot);
 
+/* Functions in sfs_fsops.c */
+int sfs_sync_freemap(struct sfs_fs *sfs);
+
+/* Functions in sfs_journal.c */
+int sfs_jmount(struct sfs_fs *sfs);
+void sfs_jdestroy(struct sfs_fs *sfs);
+void sfs_jbegin(struct sfs_fs *sfs);
+void sfs_jend(struct sfs_fs *sfs);
+int sfs_jrestart(struct sfs_vnode *sv, off_t pos);
+void sfs_jdirty(struct sfs_fs *sfs, struct buf *buf, daddr_t block);
+int sfs_jcommit(struct sfs_fs *sfs);
+
 /* Functions in sfs_inode.c */
 int sfs_sync_inode(struct sfs_vnode *sv);
 int sfs_reclaim(struct vnode *v);
+int sfs_purge_vnodes(struct sfs_fs *sfs, unsigned *remaining);
 int sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		struct sfs_vnode **ret);
 int sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret);
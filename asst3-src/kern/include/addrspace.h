@@ -34,12 +34,14 @@
  * Address space structure and operations.
  */
 
+#include <array.h>
 #include <vm.h>
 #include "opt-dumbvm.h"
 
-#define NUM_STACK_PAGES 16 /* fixed-size stack size */
+#define NUM_STACK_PAGES 32 /* fixed-size stack size - room for a full ARG_MAX argv and 16 pages of stack below it */
 
 struct vnode;
+struct textfile;
 
 /* region specification */
 struct region {
@@ -47,9 +49,23 @@ struct region {
 	size_t npages; /* npages in region */
 	bool readable, writeable; /* whether the region is readable/writeable */
 	bool can_write; /* real write permissions - unlike writeable, this should not change */
-	struct region *next; /* pntr to next region */
+	struct vnode *file; /* file the pages are read from, holding a reference - NULL for anonymous memory */
+	off_t file_offset; /* offset in the file of the byte at file_start */
+	vaddr_t file_start, file_end; /* part of the region read from the file - the rest is zero-filled */
+	bool file_shared; /* written pages go back to the file (mmap), rather than being private (exec) */
+	struct textfile *text; /* shared page cache of a read-only program segment, holding a reference - or NULL */
 };
 
+/*
+ * Array of regions, kept sorted by vbase.
+ */
+#ifndef ASINLINE
+#define ASINLINE INLINE
+#endif
+
+DECLARRAY(region, ASINLINE);
+DEFARRAY(region, ASINLINE);
+
 /*
  * Address space - data structure associated with the virtual memory
  * space of a process.
@@ -68,8 +84,14 @@ struct addrspace {
 	paddr_t as_stackpbase;
 #else
 	/* addrspace.c members */
-	uint32_t nregions;
-	struct region *region_list;
+	uint32_t nregions; /* checked against the regions array in debug builds */
+	struct regionarray regions; /* regions sorted by vbase */
+	struct region *last_region; /* region found by the last as_find_region() */
+	struct region *heap; /* heap region, may have no pages - NULL until as_complete_load() */
+	vaddr_t heap_end; /* current break, see as_sbrk() */
+	uint32_t asid; /* tlb asid, plus its generation times NUM_ASIDS - 0 if none, see vm_activate() */
+	uint32_t tlb_cpus; /* bitmask of cpus that may hold tlb entries under asid */
+	uint32_t tlb_stale; /* bitmask of cpus that may hold entries for frames the ptable no longer maps */
 #endif
 };
 
@@ -80,6 +102,10 @@ void make_page_read_only(vaddr_t vaddr);
 ptable_entry search_ptable(struct addrspace *as, vaddr_t vaddr, ptable_entry *prev);
 void free_region(struct addrspace *as, vaddr_t vaddr, uint32_t npages);
 int copy_region(struct region *reg, struct addrspace *old, struct addrspace *newas);
+int writeback_region(struct addrspace *as, struct region *reg);
+int prefault_region(struct addrspace *as, struct region *reg, vaddr_t start, vaddr_t end);
+void vm_activate(struct addrspace *as);
+void vm_forget_tlb(struct addrspace *as);
 
 /*
  * Functions in addrspace.c:
@@ -118,6 +144,32 @@ int copy_region(struct region *reg, struct addrspace *old, struct addrspace *new
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
  *
+ *    as_find_region - return the region containing a virtual address,
+ *                or NULL if there is none. Binary search over the
+ *                sorted regions array, with the last hit cached.
+ *
+ *    as_sbrk   - move the break, the end of the heap region, by amount
+ *                bytes. Hands back the old break. Pages are allocated
+ *                lazily by vm_fault(); pages given back are freed.
+ *
+ *    as_map_segment - have the pages of the segment at vaddr read in
+ *                from a file by vm_fault() when they are first touched,
+ *                instead of being loaded by exec.
+ *
+ *    as_mmap   - map length bytes of a file, from a page-aligned offset,
+ *                at an address chosen between the heap and the stack.
+ *                Pages are read in from the file by vm_fault().
+ *
+ *    as_munmap - remove the mapping starting at addr, writing the pages
+ *                written through it back to the file first.
+ *
+ *    as_msync  - write back the written pages of every mapping of a
+ *                file, for fsync().
+ *
+ *    as_prefault - read in the untouched file-backed pages of a user
+ *                buffer, before a read() or write() copies to or from
+ *                it with a vnode locked.
+ *
  * Note that when using dumbvm, addrspace.c is not used and these
  * functions are found in dumbvm.c.
  */
@@ -131,6 +183,15 @@ int as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 int as_prepare_load(struct addrspace *as);
 int as_complete_load(struct addrspace *as);
 int as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
+struct region *as_find_region(struct addrspace *as, vaddr_t vaddr);
+int as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *oldbreak);
+int as_map_segment(struct addrspace *as, vaddr_t vaddr, struct vnode *file, off_t offset,
+	size_t filesize);
+int as_mmap(struct addrspace *as, struct vnode *file, off_t offset, size_t length,
+	int writeable, vaddr_t *addr);
+int as_munmap(struct addrspace *as, vaddr_t addr);
+int as_msync(struct addrspace *as, struct vnode *file);
+int as_prefault(struct addrspace *as, userptr_t buf, size_t len);
 
 /*
  * Functions in loadelf.c
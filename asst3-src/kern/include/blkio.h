@@ -0,0 +1,38 @@
+#ifndef _BLKIO_H_
+#define _BLKIO_H_
+
+/*
+ * Block I/O between a block device and a kernel buffer.
+ *
+ * blkio() hands the whole transfer to the driver as one request, so
+ * a driver with a request queue (see devop_blkio in <device.h>) can
+ * schedule it among other threads' requests and move every block of
+ * it without waking the caller in between. Devices without one are
+ * driven through devop_io as before. Transfers must be a whole number
+ * of device blocks, and the caller sleeps until the transfer is done.
+ */
+
+#include <uio.h>
+
+struct device;
+
+/* One transfer, as handed to a driver's devop_blkio */
+struct blkreq {
+	uint32_t br_block;          /* first device block */
+	uint32_t br_nblocks;        /* number of blocks */
+	char *br_data;              /* kernel buffer */
+	enum uio_rw br_rw;
+
+	/* driver's use while the request is queued */
+	uint32_t br_xfered;         /* blocks done so far */
+	int br_result;
+	bool br_done;
+	unsigned br_slot;           /* what the waiting thread sleeps on */
+	struct blkreq *br_next;
+};
+
+/* Transfer len bytes starting at the given device block */
+int blkio(struct device *dev, uint32_t block, void *data, size_t len,
+	  enum uio_rw rw);
+
+#endif /* _BLKIO_H_ */
@@ -0,0 +1,92 @@
+#ifndef _BUF_H_
+#define _BUF_H_
+
+/*
+ * Buffer cache for block devices.
+ *
+ * Buffers hold one BUFFER_SIZE block each and are keyed by (device,
+ * block number). A buffer handed out by buffer_read() or buffer_get()
+ * is busy - nobody else can get it - until buffer_release(). Released
+ * buffers sit on an LRU list; when the cache is full the least recently
+ * used one is reused, and written back first if it is dirty. Dirty
+ * buffers are also written back in the background by a syncer thread
+ * (write-behind), and by buffer_sync().
+ *
+ * buffer_readahead() asks for a block to be read in the background, so
+ * that a later buffer_read() of it hits; the file system decides which
+ * blocks, using buffer_readahead_window() as how far ahead to go.
+ *
+ * A journaling file system pins the buffers of blocks it has logged
+ * but not yet committed with buffer_pin(): they stay in the cache,
+ * dirty, and are not written back until buffer_unpin().
+ *
+ * The cache is sized from physical memory by buffer_bootstrap().
+ */
+
+struct device;
+struct buf;
+
+#define BUFFER_SIZE 512 /* bytes per buffer - the sector size of the disks */
+
+/* Size the cache (called during boot) */
+void buffer_bootstrap(void);
+
+/* Get a buffer holding the block's contents, reading it in if needed */
+int buffer_read(struct device *dev, daddr_t block, struct buf **ret);
+
+/*
+ * Get a buffer for the block without reading it; the caller must fill
+ * all of it and mark it dirty, or it is dropped again on release
+ */
+int buffer_get(struct device *dev, daddr_t block, struct buf **ret);
+
+/* The buffer's data, valid until buffer_release() */
+void *buffer_map(struct buf *b);
+
+/* Whether the buffer holds the block's contents (false for an unfilled buffer_get buffer) */
+bool buffer_valid(struct buf *b);
+
+/* Note that the caller changed the buffer, so it must be written back */
+void buffer_mark_dirty(struct buf *b);
+
+/* Keep a busy dirty buffer from being written back; false if it already was */
+bool buffer_pin(struct buf *b);
+
+/* Let a pinned buffer be written back again */
+void buffer_unpin(struct device *dev, daddr_t block);
+
+/* Most buffers the cache will hold */
+unsigned buffer_maxcount(void);
+
+/* Hand a buffer back to the cache */
+void buffer_release(struct buf *b);
+
+/* Discard any buffer for a block that was freed, without writing it */
+void buffer_forget(struct device *dev, daddr_t block);
+
+/* Write back every dirty buffer of a device */
+int buffer_sync(struct device *dev);
+
+/*
+ * Drop every buffer of a device (e.g. on unmount), writing back dirty
+ * ones first. If that fails, or a buffer is pinned, nothing is dropped
+ * and the error (EBUSY if pinned) is returned - unless DISCARD is set,
+ * in which case the unwritten blocks are thrown away with a warning.
+ */
+int buffer_invalidate(struct device *dev, bool discard);
+
+/*
+ * Queue a block to be read in the background if it isn't cached. Returns
+ * false if the block couldn't be queued because the queue is full.
+ */
+bool buffer_readahead(struct device *dev, daddr_t block);
+
+/* How many blocks ahead sequential readers should read (0: none), and setting it */
+unsigned buffer_readahead_window(void);
+void buffer_set_readahead_window(unsigned nblocks);
+
+/* Print/reset cache statistics (called from the kernel menu) */
+void buffer_printstats(void);
+void buffer_resetstats(void);
+
+#endif /* _BUF_H_ */
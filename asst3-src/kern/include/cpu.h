@@ -61,6 +61,11 @@ struct cpu {
 	struct threadlist c_zombies;	/* List of exited threads */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
 	unsigned c_spinlocks;		/* Counter of spinlocks held */
+	uint32_t c_asid;		/* ASID loaded in the MMU */
+	uint32_t c_asid_generation;	/* ASID generation of TLB contents */
+	uint64_t c_tlb_used;		/* TLB slots holding an entry */
+	uint64_t c_tlb_plru;		/* Pseudo-LRU tree over TLB slots */
+	unsigned c_tlb_hand;		/* Next TLB slot for round robin */
 
 	/*
 	 * Accessed by other cpus.
@@ -88,6 +93,20 @@ struct cpu {
 	unsigned c_numshootdown;
 	struct spinlock c_ipi_lock;
 
+	/*
+	 * Accessed by other cpus only to drain it when memory is short.
+	 * Protected by the frame cache lock.
+	 *
+	 * c_frames is a cache of up to FRAMECACHE_SIZE free frames,
+	 * linked through their frame table entries, that single-page
+	 * allocations take from without the global frame list lock.
+	 */
+	struct frame_table_entry *c_frames;
+	unsigned c_nframes;
+	unsigned c_frame_hits;		/* Allocations served from the cache */
+	unsigned c_frame_misses;	/* Allocations that refilled it */
+	struct spinlock c_frames_lock;
+
 	/*
 	 * Accessed by other cpus. Protected inside hangman.c.
 	 */
@@ -112,6 +131,12 @@ void cpu_machdep_init(struct cpu *);
 /*ASMLINKAGE*/ void cpu_start_secondary(void);
 void cpu_hatch(unsigned software_number);
 
+/*
+ * Return the cpu with the given software number, or NULL if there
+ * is no such cpu. Numbers run from 0 with no gaps.
+ */
+struct cpu *cpu_getnum(unsigned software_number);
+
 /*
  * Produce a string describing the CPU type.
  */
@@ -155,6 +180,8 @@ void cpu_halt(void);
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
  * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * ipi_tlbshootdown_broadcast sends it to all CPUs except the current
+ * one, and returns how many CPUs were sent it.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -169,6 +196,7 @@ void cpu_halt(void);
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
 void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
+unsigned ipi_tlbshootdown_broadcast(const struct tlbshootdown *mapping);
 
 void interprocessor_interrupt(void);
 
@@ -36,6 +36,7 @@
 
 
 struct uio;  /* in <uio.h> */
+struct blkreq;  /* in <blkio.h> */
 
 /*
  * Filesystem-namespace-accessible device.
@@ -56,11 +57,14 @@ struct device {
  *      devop_eachopen - called on each open call to allow denying the open
  *      devop_io - for both reads and writes (the uio indicates the direction)
  *      devop_ioctl - miscellaneous control operations
+ *      devop_blkio - optional: queue a block transfer to/from a kernel
+ *                    buffer and wait for it (see <blkio.h>)
  */
 struct device_ops {
 	int (*devop_eachopen)(struct device *, int flags_from_open);
 	int (*devop_io)(struct device *, struct uio *);
 	int (*devop_ioctl)(struct device *, int op, userptr_t data);
+	int (*devop_blkio)(struct device *, struct blkreq *);
 };
 
 /*
@@ -69,6 +73,7 @@ struct device_ops {
 #define DEVOP_EACHOPEN(d, f)	((d)->d_ops->devop_eachopen(d, f))
 #define DEVOP_IO(d, u)		((d)->d_ops->devop_io(d, u))
 #define DEVOP_IOCTL(d, op, p)	((d)->d_ops->devop_ioctl(d, op, p))
+#define DEVOP_BLKIO(d, r)	((d)->d_ops->devop_blkio(d, r))
 
 
 /* Create vnode for a vfs-level device. */
@@ -77,6 +82,9 @@ struct vnode *dev_create_vnode(struct device *dev);
 /* Undo dev_create_vnode. */
 void dev_uncreate_vnode(struct vnode *vn);
 
+/* Get the device behind a device vnode (NULL if it isn't one). */
+struct device *dev_getdevice(struct vnode *vn);
+
 /* Initialization functions for builtin vfs-level devices. */
 void devnull_create(void);
 
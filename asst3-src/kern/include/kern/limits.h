@@ -64,10 +64,11 @@
 
 /* Max bytes for an exec function (should be at least 16K) */
 /*
- * UNSW Note: We use max 4K to avoid the frametable allocator needing
- * to deal with greater than 4K allocations
+ * UNSW Note: This used to be 4K to avoid the frametable allocator
+ * needing to deal with greater than 4K allocations. exec now holds
+ * the argv a page at a time, so it no longer does.
  */
-#define __ARG_MAX       (4 * 1024)
+#define __ARG_MAX       (64 * 1024)
 
 /*
  * Important for system behavior, but not a big part of the API.
@@ -0,0 +1,15 @@
+#ifndef _KERN_MMAN_H_
+#define _KERN_MMAN_H_
+
+/*
+ * Protection flags for the UNSW mmap(), shared between the kernel and
+ * <unistd.h>. Mappings are always readable; PROT_WRITE mappings are
+ * shared with the file, and pages written through them are written
+ * back to it on munmap(), fsync() and exit.
+ */
+
+#define PROT_READ     1      /* Pages may be read */
+#define PROT_WRITE    2      /* Pages may be written */
+
+
+#endif /* _KERN_MMAN_H_ */
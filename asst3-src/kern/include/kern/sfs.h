@@ -41,8 +41,8 @@
 #define SFS_VOLNAME_SIZE  32            /* max length of volume name */
 #define SFS_NDIRECT       15            /* # of direct blocks in inode */
 #define SFS_NINDIRECT     1             /* # of indirect blocks in inode */
-#define SFS_NDINDIRECT    0             /* # of 2x indirect blocks in inode */
-#define SFS_NTINDIRECT    0             /* # of 3x indirect blocks in inode */
+#define SFS_NDINDIRECT    1             /* # of 2x indirect blocks in inode */
+#define SFS_NTINDIRECT    1             /* # of 3x indirect blocks in inode */
 #define SFS_DBPERIDB      128           /* # direct blks per indirect blk */
 #define SFS_NAMELEN       60            /* max length of filename */
 #define SFS_SUPER_BLOCK   0             /* block the superblock lives in */
@@ -62,6 +62,23 @@
 /* Size of free block bitmap (in blocks) */
 #define SFS_FREEMAPBLOCKS(nblocks)  (SFS_FREEMAPBITS(nblocks)/SFS_BITSPERBLOCK)
 
+/*
+ * Metadata journal. On volumes that have one, the superblock gives its
+ * first block and its length, which is always SFS_JOURNALBLOCKS: a
+ * header block, a descriptor block, and room to log SFS_JMAXBLOCKS
+ * blocks right after the descriptor.
+ */
+#define SFS_JHEADER_MAGIC 0x6a686472    /* "jhdr" */
+#define SFS_JDESC_MAGIC   0x6a647363    /* "jdsc" */
+#define SFS_JMAXBLOCKS    124           /* most blocks in one transaction */
+#define SFS_JOURNALBLOCKS (2 + SFS_JMAXBLOCKS)
+#define SFS_JHEADER_BLOCK 0             /* blocks within the journal */
+#define SFS_JDESC_BLOCK   1
+#define SFS_JLOG_START    2
+
+/* Initial value for jd_checksum; see struct sfs_jdesc */
+#define SFS_JCHECKSUM_INIT 2166136261U
+
 /* File types for sfi_type */
 #define SFS_TYPE_INVAL    0       /* Should not appear on disk */
 #define SFS_TYPE_FILE     1
@@ -74,7 +91,9 @@ struct sfs_superblock {
 	uint32_t sb_magic;		/* Magic number; should be SFS_MAGIC */
 	uint32_t sb_nblocks;			/* Number of blocks in fs */
 	char sb_volname[SFS_VOLNAME_SIZE];	/* Name of this volume */
-	uint32_t reserved[118];			/* unused, set to 0 */
+	uint32_t sb_journalstart;		/* First block of the journal */
+	uint32_t sb_journalblocks;		/* Its length; 0 if none */
+	uint32_t reserved[116];			/* unused, set to 0 */
 };
 
 /*
@@ -86,7 +105,9 @@ struct sfs_dinode {
 	uint16_t sfi_linkcount;			/* # hard links to this file */
 	uint32_t sfi_direct[SFS_NDIRECT];	/* Direct blocks */
 	uint32_t sfi_indirect;			/* Indirect block */
-	uint32_t sfi_waste[128-3-SFS_NDIRECT];	/* unused space, set to 0 */
+	uint32_t sfi_dindirect;			/* Double indirect block */
+	uint32_t sfi_tindirect;			/* Triple indirect block */
+	uint32_t sfi_waste[128-5-SFS_NDIRECT];	/* unused space, set to 0 */
 };
 
 /*
@@ -97,5 +118,32 @@ struct sfs_direntry {
 	char sfd_name[SFS_NAMELEN];		/* Filename */
 };
 
+/*
+ * On-disk journal header. The descriptor is only replayed if its
+ * sequence number matches jh_seq; once a transaction has been written
+ * to its home blocks, jh_seq moves on past it.
+ */
+struct sfs_jheader {
+	uint32_t jh_magic;			/* SFS_JHEADER_MAGIC */
+	uint32_t jh_seq;			/* Transaction to replay */
+	uint32_t reserved[126];			/* unused, set to 0 */
+};
+
+/*
+ * On-disk journal descriptor: transaction jd_seq consists of copies of
+ * blocks jd_blocks[0..jd_nblocks), stored in that order from
+ * SFS_JLOG_START on. It is written after them, so a descriptor that is
+ * there at all describes a complete transaction. jd_checksum is the
+ * 32-bit FNV-1a hash, from SFS_JCHECKSUM_INIT, of the bytes of
+ * jd_blocks[0..jd_nblocks) as stored followed by the logged blocks.
+ */
+struct sfs_jdesc {
+	uint32_t jd_magic;			/* SFS_JDESC_MAGIC */
+	uint32_t jd_seq;			/* Transaction number */
+	uint32_t jd_nblocks;			/* Blocks in it */
+	uint32_t jd_checksum;			/* Hash of the above */
+	uint32_t jd_blocks[SFS_JMAXBLOCKS];	/* Their home block numbers */
+};
+
 
 #endif /* _KERN_SFS_H_ */
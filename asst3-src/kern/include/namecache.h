@@ -0,0 +1,38 @@
+#ifndef _NAMECACHE_H_
+#define _NAMECACHE_H_
+
+/*
+ * Directory name lookup cache.
+ *
+ * Maps (directory vnode, name) to the inode number the name refers
+ * to, and to the slot its entry occupies in the directory (whatever
+ * that means to the filesystem). An inode number of 0 records that
+ * the name does *not* exist, so failed lookups are cached too.
+ *
+ * The cache doesn't lock directories; the filesystem must call in
+ * with the directory locked and must keep the cache up to date when
+ * it adds or removes entries, and purge a directory's names before
+ * its vnode is destroyed. Names longer than NC_NAMELEN aren't cached.
+ */
+
+struct vnode;
+
+#define NC_NAMELEN 31
+
+/* Allocate the cache (called during boot) */
+void namecache_bootstrap(void);
+
+/* Look a name up; false on a miss. On a hit *ino is 0 if the name doesn't exist */
+bool namecache_lookup(struct vnode *dir, const char *name, uint32_t *ino, int *slot);
+
+/* Record a name's inode and slot, or (ino 0) that it doesn't exist */
+void namecache_enter(struct vnode *dir, const char *name, uint32_t ino, int slot);
+
+/* Forget everything about a directory */
+void namecache_purge(struct vnode *dir);
+
+/* Print/reset cache statistics (called from the kernel menu) */
+void namecache_printstats(void);
+void namecache_resetstats(void);
+
+#endif /* _NAMECACHE_H_ */
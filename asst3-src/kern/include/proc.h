@@ -60,6 +60,7 @@ struct proc {
 
 	/* VM */
 	struct addrspace *p_addrspace;	/* virtual address space */
+	unsigned p_tlbmisses;		/* TLB misses taken by this process */
 
 	/* VFS */
 	struct vnode *p_cwd;		/* current working directory */
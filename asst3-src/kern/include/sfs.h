@@ -48,6 +48,36 @@
  */
 #include <kern/sfs.h>
 
+/*
+ * Locking. There is no global lock; each piece of state has its own,
+ * always taken in this order:
+ *
+ *    directory sv_lock -> file sv_lock -> sfs_vnlock -> sfs_freemaplock
+ *        -> sfs_jlock
+ *
+ * sfs_superlock and the buffer cache's internal lock are leaves.
+ * On a journaled volume, joining a transaction (sfs_jbegin) may wait
+ * for a commit, which waits for every operation in the transaction to
+ * finish; so it comes after the sv_locks and before sfs_vnlock, and an
+ * operation must not wait for a vnode lock once it has joined.
+ * vfs_biglock, which the VFS layer still holds around mount, unmount
+ * and sync, comes before all of them.
+ * sv_lock covers the inode (sv_i, sv_dirty) and the file's blocks,
+ * including its indirect block. The inode type, inode number and
+ * volume name never change once loaded, so they can be read unlocked.
+ */
+
+/*
+ * bmap cache entry: a file block past the direct blocks and the disk
+ * block it maps to (0 for an empty entry). See sfs_bmap.c.
+ */
+struct sfs_bmapent {
+	uint32_t be_fileblock;
+	uint32_t be_diskblock;
+};
+
+#define SFS_BMAPCACHE  16       /* bmap cache entries per vnode */
+
 /*
  * In-memory inode
  */
@@ -56,8 +86,31 @@ struct sfs_vnode {
 	struct sfs_dinode sv_i;		/* copy of on-disk inode */
 	uint32_t sv_ino;                /* inode number */
 	bool sv_dirty;                  /* true if sv_i modified */
+	struct lock *sv_lock;           /* protects sv_i, sv_dirty and the file's blocks */
+	int sv_dirfree;                 /* directories: no free slots below this one */
+	uint32_t sv_nextread;           /* block a sequential read would start in */
+	uint32_t sv_raend;              /* read-ahead has been queued up to here */
+	daddr_t sv_lastalloc;           /* block most recently allocated to the file */
+	struct sfs_bmapent sv_bmapcache[SFS_BMAPCACHE]; /* recent translations */
+
+	/* These are protected by the volume's sfs_vnlock */
+	struct sfs_vnode *sv_hashnext;  /* vnode table hash chain */
+	bool sv_inactive;               /* unused, kept for reuse; on the LRU list */
+	struct sfs_vnode *sv_lruprev;   /* inactive LRU list */
+	struct sfs_vnode *sv_lrunext;
 };
 
+/*
+ * Loaded vnodes are hashed by inode number. When the last reference
+ * to a vnode goes away it isn't destroyed straight off: it becomes
+ * inactive, keeping one reference that belongs to the vnode table,
+ * and goes on an LRU list, so reopening a recently used file costs
+ * no disk I/O. Past SFS_MAXINACTIVE inactive vnodes the least
+ * recently used one is destroyed.
+ */
+#define SFS_VNHASH_SIZE   256   /* vnode table hash chains */
+#define SFS_MAXINACTIVE   128   /* inactive vnodes kept per volume */
+
 /*
  * In-memory info for a whole fs volume
  */
@@ -65,10 +118,33 @@ struct sfs_fs {
 	struct fs sfs_absfs;            /* abstract filesystem structure */
 	struct sfs_superblock sfs_sb;	/* copy of on-disk superblock */
 	bool sfs_superdirty;            /* true if superblock modified */
+	struct lock *sfs_superlock;     /* protects sfs_sb and sfs_superdirty */
 	struct device *sfs_device;      /* device mounted on */
-	struct vnodearray *sfs_vnodes;  /* vnodes loaded into memory */
+	struct sfs_vnode *sfs_vnhash[SFS_VNHASH_SIZE]; /* vnodes loaded into memory */
+	unsigned sfs_nvnodes;           /* ...how many, active or not */
+	struct sfs_vnode *sfs_lruhead;  /* inactive vnodes, least recently used first */
+	struct sfs_vnode *sfs_lrutail;
+	unsigned sfs_ninactive;         /* length of that list */
+	struct lock *sfs_vnlock;        /* protects all of the above */
 	struct bitmap *sfs_freemap;     /* blocks in use are marked 1 */
 	bool sfs_freemapdirty;          /* true if freemap modified */
+	daddr_t sfs_allochint;          /* where the last allocation left off */
+	struct lock *sfs_freemaplock;   /* protects sfs_freemap, sfs_freemapdirty, sfs_allochint */
+
+	/* Metadata journal (see sfs_journal.c); unused if sfs_journaled is false */
+	bool sfs_journaled;             /* set at mount, never changed */
+	struct lock *sfs_jlock;         /* protects the transaction state below */
+	struct cv *sfs_jcv;             /* waits for sfs_jusers and sfs_jcommitting */
+	unsigned sfs_jusers;            /* operations in the running transaction */
+	bool sfs_jcommitting;           /* a commit is under way; nobody may join */
+	unsigned sfs_jcap;              /* blocks a transaction may log, less the freemap */
+	uint32_t sfs_jseq;              /* sequence number of the running transaction */
+	unsigned sfs_jnblocks;          /* blocks it has logged... */
+	uint32_t *sfs_jblocks;          /* ...and which (SFS_JMAXBLOCKS entries) */
+	struct bitmap *sfs_jfreed;      /* blocks it has freed; under sfs_freemaplock */
+	unsigned sfs_jnfreed;           /* ...how many; also under sfs_freemaplock */
+	struct sfs_jdesc *sfs_jdesc;    /* descriptor being written */
+	void *sfs_jstage;               /* SFS_JCHUNK blocks of staging for the log */
 };
 
 /*
@@ -76,5 +152,19 @@ struct sfs_fs {
  */
 int sfs_mount(const char *device);
 
+/*
+ * Block allocator statistics, for the menu.
+ */
+void sfs_balloc_printstats(void);
+void sfs_balloc_resetstats(void);
+
+/*
+ * Journal statistics, for the menu, and a crash test: the next commit
+ * panics right after its transaction is committed.
+ */
+void sfs_journal_printstats(void);
+void sfs_journal_resetstats(void);
+void sfs_journal_crashtest(void);
+
 
 #endif /* _SFS_H_ */
@@ -0,0 +1,29 @@
+#ifndef _SWAP_H_
+#define _SWAP_H_
+
+/*
+ * Swap space for paging out user pages.
+ *
+ * Swap lives on the raw device SWAP_DEVICE, attached with vfs_swapon()
+ * by swap_bootstrap(). Each page-sized slot on the device is tracked
+ * in a bitmap. If the device is missing the system runs without swap
+ * and swap_alloc() always fails.
+ */
+
+#define SWAP_DEVICE "lhd0:" /* lhd1 holds the SFS volume used by the tests */
+
+/* Attach the swap device (called by vm_bootstrap) */
+void swap_bootstrap(void);
+
+/* Allocate/free a swap slot */
+int swap_alloc(uint32_t *slot);
+void swap_free(uint32_t slot);
+
+/* Copy a page between a swap slot and the frame at kernel virtual address kvaddr */
+int swap_read(uint32_t slot, vaddr_t kvaddr);
+int swap_write(uint32_t slot, vaddr_t kvaddr);
+
+/* Number of slots in use and in total */
+void swap_usage(uint32_t *used, uint32_t *total);
+
+#endif /* _SWAP_H_ */
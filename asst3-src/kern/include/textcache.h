@@ -0,0 +1,74 @@
+#ifndef _TEXTCACHE_H_
+#define _TEXTCACHE_H_
+
+/*
+ * Shared page cache for read-only program segments.
+ *
+ * Each program file with a read-only segment mapped by some address
+ * space has a textfile, holding one frame per page of the file that
+ * has been read in so far. vm_fault() maps these frames read-only into
+ * every address space running the program, instead of reading a
+ * private copy for each. The cache holds its own reference on each
+ * frame, so the frames stay shared until the last region using the
+ * textfile is gone; textcache_reclaim() gives back the ones nobody
+ * maps any more when memory runs short.
+ *
+ * Only whole, page-aligned pages of the file are cached.
+ *
+ * File systems call textcache_invalidate() after writing or truncating
+ * a file, so that later faults don't map pages read before the change.
+ * They only need to if vn_textfiles is nonzero, which they can check
+ * without a lock: a textfile made after the check was made after the
+ * write, so it can only ever hold pages read after the write too.
+ */
+
+#include "opt-dumbvm.h"
+
+struct vnode;
+struct textfile;
+
+/* Set up the cache (called by vm_bootstrap) */
+void textcache_bootstrap(void);
+
+/*
+ * Get the textfile for a program file, creating it if need be, and
+ * take a reference to it. Returns NULL if it can't be set up, in which
+ * case pages are simply read privately.
+ */
+struct textfile *textcache_get(struct vnode *file);
+void textcache_incref(struct textfile *tf);
+void textcache_put(struct textfile *tf);
+
+/*
+ * Return the frame holding the page at file offset pos, with an extra
+ * reference for the caller to map, or 0 if it isn't cached.
+ */
+vaddr_t textcache_lookup(struct textfile *tf, off_t pos);
+
+/*
+ * Offer a frame just read from file offset pos, holding one reference.
+ * Returns the frame the caller should map, with that reference: either
+ * the same one, now also in the cache, or one cached in the meantime,
+ * in which case the caller's frame has been freed.
+ */
+vaddr_t textcache_insert(struct textfile *tf, off_t pos, vaddr_t frame);
+
+/* Free cached frames that no page maps any more; returns how many */
+unsigned textcache_reclaim(void);
+
+/*
+ * Drop the cached pages of a file that has been written to or
+ * truncated. Regions already using its textfile keep it, but it caches
+ * nothing more; the next exec of the file gets a new one.
+ */
+#if OPT_DUMBVM
+#define textcache_invalidate(file) ((void)(file))
+#else
+void textcache_invalidate(struct vnode *file);
+#endif
+
+/* Stats for the vs menu command */
+void textcache_stats(uint32_t *cached, uint32_t *hits, uint32_t *misses);
+void textcache_resetstats(void);
+
+#endif /* _TEXTCACHE_H_ */
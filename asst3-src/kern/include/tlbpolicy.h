@@ -0,0 +1,30 @@
+#ifndef _TLBPOLICY_H_
+#define _TLBPOLICY_H_
+
+/*
+ * TLB replacement policy, chosen at build time in the kernel config:
+ *
+ *    options tlbrr     round robin - slots are reused in order (FIFO)
+ *    options tlblru    pseudo-LRU - a tree of NUM_TLB-1 bits points
+ *                      away from recently used slots
+ *    neither           the processor's tlb_random
+ *
+ * The round robin and pseudo-LRU policies fill empty slots first.
+ * Each cpu keeps its own state, since each has its own TLB. All of
+ * these must be called with interrupts off.
+ */
+
+/* Load a new entry into the slot chosen by the policy */
+void tlbpolicy_load(uint32_t entryhi, uint32_t entrylo);
+
+/* Note that the entry in slot was rewritten in place (it is in use) */
+void tlbpolicy_touch(unsigned slot);
+
+/* Note that slot was invalidated / the whole TLB was flushed */
+void tlbpolicy_forget(unsigned slot);
+void tlbpolicy_reset(void);
+
+/* Name of the configured policy, for stats */
+const char *tlbpolicy_name(void);
+
+#endif /* _TLBPOLICY_H_ */
@@ -38,15 +38,33 @@
 
 #define PAGE_BITS 12 /* this was not defined anywhere */
 
+struct addrspace;
+
 /* frame table entry */
 typedef struct frame_table_entry *ftable_entry;
 struct frame_table_entry {
 	uint32_t addr : 20; /* physical frame number */
-	uint32_t padding : 12; /* unused */
+	uint32_t refcount : 12; /* number of pages mapping the frame, 0 if free */
+	uint32_t vpage : 20; /* virtual page number the owner maps the frame at */
+	uint32_t busy : 1; /* frame is being evicted */
+	uint32_t run : 11; /* frames allocated together starting here, 0 if not the first */
+	volatile uint8_t referenced; /* set on tlb refill, cleared by the clock hand - not locked */
+	struct addrspace *owner; /* user addrspace mapping the frame, NULL if unknown or kernel */
 	ftable_entry next; /* next free frame */
+	ftable_entry prev; /* previous free frame, so runs can be unlinked from the middle */
 };
 
+#define FRAME_MAX_REFS 0xfff /* largest refcount that fits in the entry */
+#define FRAME_MAX_RUN 0x7ff /* largest allocation that fits in the entry */
+#define FRAMECACHE_SIZE 32 /* most free frames each cpu keeps to itself */
+#define FRAMECACHE_BATCH 16 /* frames moved between a cpu and the free list at once */
+#define ZEROPOOL_SIZE 64 /* most frames kept zeroed ahead of first-touch faults */
+#define ZEROPOOL_LOW 16 /* the zeroing thread is woken when the pool drops to this */
+#define ZEROPOOL_RESERVE 128 /* free frames the zeroing thread leaves for everyone else */
+
 extern struct frame_table_entry *ftable;
+extern uint32_t total_frames; /* number of frames in physical memory */
+extern uint32_t nfree_frames; /* number of frames on the free list, not counting per-cpu caches */
 
 /* hashed page table entry */
 typedef struct page_table_entry *ptable_entry;
@@ -57,8 +75,22 @@ struct page_table_entry {
 	ptable_entry next; /* internal chaining for collisions */
 };
 
+/*
+ * Software bit in entrylo for pages that have been swapped out.
+ * TLBLO_VALID is clear and the TLBLO_PPAGE bits hold the swap slot instead.
+ */
+#define HPT_SWAPPED 0x00000001
+#define HPT_IN_USE(e) (((e)->entrylo & (TLBLO_VALID | HPT_SWAPPED)) != 0)
+
 extern struct page_table_entry *ptable;
 
+/*
+ * The hpt is split into HPT_NSTRIPES equally sized stripes, each with its own lock.
+ * Collision chains never cross a stripe boundary.
+ */
+#define HPT_NSTRIPES 64
+#define HPT_HASH_MULT 2654435761U /* multiplicative hash constant (golden ratio * 2^32) */
+
 /* Fault-type arguments to vm_fault() */
 #define VM_FAULT_READ     0 /* A read was attempted */
 #define VM_FAULT_WRITE    1 /* A write was attempted */
@@ -74,6 +106,48 @@ int vm_fault(int faulttype, vaddr_t faultaddress);
 vaddr_t alloc_kpages(unsigned npages);
 void free_kpages(vaddr_t addr);
 
+/* Reference counting for frames shared copy-on-write */
+bool frame_share(vaddr_t addr);
+unsigned frame_refcount(vaddr_t addr);
+
+/* Owner/reference metadata and victim selection for page replacement */
+void frame_set_owner(vaddr_t addr, struct addrspace *as, vaddr_t vaddr);
+void frame_disown(vaddr_t addr, struct addrspace *as);
+void frame_adopt(vaddr_t addr, struct addrspace *as, vaddr_t vaddr);
+void frame_set_referenced(vaddr_t addr);
+vaddr_t frame_choose_victim(struct addrspace **as, vaddr_t *vaddr);
+void frame_release_victim(vaddr_t addr, bool forget_owner);
+void framecache_stats(uint32_t *cached, uint32_t *hits, uint32_t *misses);
+void framecache_resetstats(void);
+
+/* Let the zeroing thread know frames were freed (called by free_kpages) */
+void zeropool_frames_freed(void);
+
+/* Print/reset VM fault statistics (called from the kernel menu) */
+void vm_printstats(void);
+void vm_resetstats(void);
+
+/* If false, every TLB refill looks up the faulting region first (for benchmarking) */
+extern bool vm_fastrefill;
+
+/* If false, fork copies every resident page instead of sharing it copy-on-write */
+extern bool vm_cow;
+
+/* If false, first-touch faults zero their own frame instead of taking a pre-zeroed one */
+extern bool vm_zeropool;
+
+/* If false, the whole TLB is flushed on every context switch instead of relying on ASIDs */
+extern bool vm_asids;
+
+/* If true, each process prints its TLB miss count when it exits */
+extern bool vm_tlbreport;
+
+/* If false, exec reads every program segment in up front instead of as its pages are touched */
+extern bool vm_lazyload;
+
+/* If false, each process reads its own copy of read-only program pages instead of sharing cached ones */
+extern bool vm_textcache;
+
 /* TLB shootdown handling called from interprocessor_interrupt */
 void vm_tlbshootdown(const struct tlbshootdown *);
 
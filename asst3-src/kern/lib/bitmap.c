@@ -95,29 +95,105 @@ bitmap_getdata(struct bitmap *b)
         return b->v;
 }
 
+/*
+ * Return the number of the lowest clear bit in W, which must not be
+ * full. ~w & (w+1) isolates that bit; then a binary search finds it.
+ */
+static
+inline
+unsigned
+bitmap_ffz(WORD_TYPE w)
+{
+        unsigned bit = 0;
+
+        KASSERT(w != WORD_ALLBITS);
+        w = (WORD_TYPE)(~w & (w + 1));
+        if ((w & 0x0f) == 0) {
+                bit += 4;
+        }
+        if ((w & 0x33) == 0) {
+                bit += 2;
+        }
+        if ((w & 0x55) == 0) {
+                bit += 1;
+        }
+        return bit;
+}
+
+/*
+ * Return the index of the first word in [ix, maxix) that isn't full,
+ * or maxix if there is none. Full stretches are skipped four words at
+ * a time by ANDing them together, which keeps the data byte-sized (and
+ * so endian-independent) without paying a test per byte.
+ */
+static
+unsigned
+bitmap_scan(const struct bitmap *b, unsigned ix, unsigned maxix)
+{
+        while (ix + 4 <= maxix &&
+               (b->v[ix] & b->v[ix+1] & b->v[ix+2] & b->v[ix+3])
+               == WORD_ALLBITS) {
+                ix += 4;
+        }
+        while (ix < maxix && b->v[ix] == WORD_ALLBITS) {
+                ix++;
+        }
+        return ix;
+}
+
+/*
+ * Set the lowest bit that is clear in both word IX and MASKED (word
+ * IX with some bits forced on) and return its index.
+ */
+static
+unsigned
+bitmap_take(struct bitmap *b, unsigned ix, WORD_TYPE masked)
+{
+        unsigned offset;
+
+        offset = bitmap_ffz(masked);
+        KASSERT((b->v[ix] & ((WORD_TYPE)1 << offset)) == 0);
+        b->v[ix] |= (WORD_TYPE)1 << offset;
+        KASSERT(ix*BITS_PER_WORD + offset < b->nbits);
+        return ix*BITS_PER_WORD + offset;
+}
+
 int
-bitmap_alloc(struct bitmap *b, unsigned *index)
+bitmap_alloc_near(struct bitmap *b, unsigned goal, unsigned *index)
 {
-        unsigned ix;
         unsigned maxix = DIVROUNDUP(b->nbits, BITS_PER_WORD);
-        unsigned offset;
+        unsigned goalix, ix;
+        WORD_TYPE above;
 
-        for (ix=0; ix<maxix; ix++) {
-                if (b->v[ix]!=WORD_ALLBITS) {
-                        for (offset = 0; offset < BITS_PER_WORD; offset++) {
-                                WORD_TYPE mask = ((WORD_TYPE)1) << offset;
-
-                                if ((b->v[ix] & mask)==0) {
-                                        b->v[ix] |= mask;
-                                        *index = (ix*BITS_PER_WORD)+offset;
-                                        KASSERT(*index < b->nbits);
-                                        return 0;
-                                }
-                        }
-                        KASSERT(0);
+        if (goal >= b->nbits) {
+                goal = 0;
+        }
+        goalix = goal / BITS_PER_WORD;
+
+        /* The goal itself, or a later bit in the same word */
+        above = b->v[goalix] |
+                (WORD_TYPE)(((WORD_TYPE)1 << (goal % BITS_PER_WORD)) - 1);
+        if (above != WORD_ALLBITS) {
+                *index = bitmap_take(b, goalix, above);
+                return 0;
+        }
+
+        /* Then on to the end, then around from the start */
+        ix = bitmap_scan(b, goalix+1, maxix);
+        if (ix == maxix) {
+                ix = bitmap_scan(b, 0, goalix+1);
+                if (ix == goalix+1) {
+                        return ENOSPC;
                 }
         }
-        return ENOSPC;
+        *index = bitmap_take(b, ix, b->v[ix]);
+        return 0;
+}
+
+int
+bitmap_alloc(struct bitmap *b, unsigned *index)
+{
+        return bitmap_alloc_near(b, 0, index);
 }
 
 static
@@ -46,6 +46,8 @@
 #include <mainbus.h>
 #include <vfs.h>
 #include <device.h>
+#include <buf.h>
+#include <namecache.h>
 #include <pid.h>
 #include <syscall.h>
 #include <test.h>
@@ -128,6 +130,8 @@ boot(void)
 
 	/* Late phase of initialization. */
 	vm_bootstrap();
+	buffer_bootstrap();
+	namecache_bootstrap();
 	kprintf_bootstrap();
 	exec_bootstrap();
 	thread_start_cpus();
@@ -41,12 +41,16 @@
 #include <thread.h>
 #include <proc.h>
 #include <vfs.h>
+#include <buf.h>
+#include <namecache.h>
 #include <sfs.h>
+#include <vm.h>
 #include <pid.h>
 #include <syscall.h>
 #include <test.h>
 #include "opt-sfs.h"
 #include "opt-net.h"
+#include "opt-dumbvm.h"
 
 /*
  * In-kernel menu and command dispatcher.
@@ -500,6 +504,244 @@ cmd_kheapdump(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_bufstats(int nargs, char **args)
+{
+	if (nargs == 1) {
+		buffer_printstats();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "reset")) {
+		buffer_resetstats();
+	}
+	else {
+		kprintf("Usage: bs [reset]\n");
+	}
+
+	return 0;
+}
+
+static
+int
+cmd_namecachestats(int nargs, char **args)
+{
+	if (nargs == 1) {
+		namecache_printstats();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "reset")) {
+		namecache_resetstats();
+	}
+	else {
+		kprintf("Usage: nc [reset]\n");
+	}
+
+	return 0;
+}
+
+static
+int
+cmd_readahead(int nargs, char **args)
+{
+	if (nargs == 1) {
+		kprintf("Read-ahead window: %u blocks\n",
+			buffer_readahead_window());
+	}
+	else if (nargs == 2 && atoi(args[1]) >= 0) {
+		buffer_set_readahead_window(atoi(args[1]));
+	}
+	else {
+		kprintf("Usage: ra [blocks]\n");
+		return EINVAL;
+	}
+
+	return 0;
+}
+
+#if OPT_SFS
+static
+int
+cmd_ballocstats(int nargs, char **args)
+{
+	if (nargs == 1) {
+		sfs_balloc_printstats();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "reset")) {
+		sfs_balloc_resetstats();
+	}
+	else {
+		kprintf("Usage: ba [reset]\n");
+	}
+
+	return 0;
+}
+
+static
+int
+cmd_journalstats(int nargs, char **args)
+{
+	if (nargs == 1) {
+		sfs_journal_printstats();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "reset")) {
+		sfs_journal_resetstats();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "crash")) {
+		/* panic once the next commit is on disk; remount to recover */
+		sfs_journal_crashtest();
+	}
+	else {
+		kprintf("Usage: js [reset|crash]\n");
+	}
+
+	return 0;
+}
+#endif
+
+#if !OPT_DUMBVM
+static
+int
+cmd_vmstats(int nargs, char **args)
+{
+	if (nargs == 1) {
+		vm_printstats();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "reset")) {
+		vm_resetstats();
+	}
+	else {
+		kprintf("Usage: vs [reset]\n");
+	}
+
+	return 0;
+}
+
+static
+int
+cmd_vmfastrefill(int nargs, char **args)
+{
+	if (nargs == 2 && !strcmp(args[1], "on")) {
+		vm_fastrefill = true;
+	}
+	else if (nargs == 2 && !strcmp(args[1], "off")) {
+		vm_fastrefill = false;
+	}
+	else {
+		kprintf("Usage: vfr on|off\n");
+		return EINVAL;
+	}
+
+	return 0;
+}
+
+static
+int
+cmd_vmcow(int nargs, char **args)
+{
+	if (nargs == 2 && !strcmp(args[1], "on")) {
+		vm_cow = true;
+	}
+	else if (nargs == 2 && !strcmp(args[1], "off")) {
+		vm_cow = false;
+	}
+	else {
+		kprintf("Usage: vcow on|off\n");
+		return EINVAL;
+	}
+
+	return 0;
+}
+
+static
+int
+cmd_vmzeropool(int nargs, char **args)
+{
+	if (nargs == 2 && !strcmp(args[1], "on")) {
+		vm_zeropool = true;
+	}
+	else if (nargs == 2 && !strcmp(args[1], "off")) {
+		vm_zeropool = false;
+	}
+	else {
+		kprintf("Usage: vzp on|off\n");
+		return EINVAL;
+	}
+
+	return 0;
+}
+
+static
+int
+cmd_vmasids(int nargs, char **args)
+{
+	if (nargs == 2 && !strcmp(args[1], "on")) {
+		vm_asids = true;
+	}
+	else if (nargs == 2 && !strcmp(args[1], "off")) {
+		vm_asids = false;
+	}
+	else {
+		kprintf("Usage: vasid on|off\n");
+		return EINVAL;
+	}
+
+	return 0;
+}
+
+static
+int
+cmd_vmtlbreport(int nargs, char **args)
+{
+	if (nargs == 2 && !strcmp(args[1], "on")) {
+		vm_tlbreport = true;
+	}
+	else if (nargs == 2 && !strcmp(args[1], "off")) {
+		vm_tlbreport = false;
+	}
+	else {
+		kprintf("Usage: vtlb on|off\n");
+		return EINVAL;
+	}
+
+	return 0;
+}
+
+static
+int
+cmd_vmlazyload(int nargs, char **args)
+{
+	if (nargs == 2 && !strcmp(args[1], "on")) {
+		vm_lazyload = true;
+	}
+	else if (nargs == 2 && !strcmp(args[1], "off")) {
+		vm_lazyload = false;
+	}
+	else {
+		kprintf("Usage: vlazy on|off\n");
+		return EINVAL;
+	}
+
+	return 0;
+}
+
+static
+int
+cmd_vmtextcache(int nargs, char **args)
+{
+	if (nargs == 2 && !strcmp(args[1], "on")) {
+		vm_textcache = true;
+	}
+	else if (nargs == 2 && !strcmp(args[1], "off")) {
+		vm_textcache = false;
+	}
+	else {
+		kprintf("Usage: vtext on|off\n");
+		return EINVAL;
+	}
+
+	return 0;
+}
+#endif
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -566,6 +808,7 @@ static const char *testmenu[] = {
 	"[km2] kmalloc stress test           ",
 	"[km3] Large kmalloc test            ",
 	"[km4] Multipage kmalloc test        ",
+	"[km5] Mixed-size kmalloc test       ",
 	"[tt1] Thread test 1                 ",
 	"[tt2] Thread test 2                 ",
 	"[tt3] Thread test 3                 ",
@@ -584,6 +827,9 @@ static const char *testmenu[] = {
 	"[fs4] FS write stress 2             ",
 	"[fs5] FS long stress                ",
 	"[fs6] FS create stress              ",
+#if !OPT_DUMBVM
+	"[vm1] HPT fault scaling test        ",
+#endif
 	NULL
 };
 
@@ -606,6 +852,23 @@ static const char *mainmenu[] = {
 	"[kh] Kernel heap stats              ",
 	"[khgen] Next kernel heap generation ",
 	"[khdump] Dump kernel heap           ",
+	"[bs] Buffer cache stats             ",
+	"[nc] Name cache stats               ",
+	"[ra] Set read-ahead window          ",
+#if OPT_SFS
+	"[ba] SFS block allocator stats      ",
+	"[js] SFS journal stats              ",
+#endif
+#if !OPT_DUMBVM
+	"[vs] VM fault stats                 ",
+	"[vfr] Toggle fast TLB refill        ",
+	"[vcow] Toggle copy-on-write fork    ",
+	"[vzp] Toggle pre-zeroed frame pool  ",
+	"[vasid] Toggle TLB ASID tagging     ",
+	"[vtlb] Report TLB misses on exit    ",
+	"[vlazy] Toggle lazy program loading ",
+	"[vtext] Toggle shared text pages    ",
+#endif
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -657,6 +920,23 @@ static struct {
 	{ "kh",         cmd_kheapstats },
 	{ "khgen",      cmd_kheapgeneration },
 	{ "khdump",     cmd_kheapdump },
+	{ "bs",		cmd_bufstats },
+	{ "nc",		cmd_namecachestats },
+	{ "ra",		cmd_readahead },
+#if OPT_SFS
+	{ "ba",		cmd_ballocstats },
+	{ "js",		cmd_journalstats },
+#endif
+#if !OPT_DUMBVM
+	{ "vs",		cmd_vmstats },
+	{ "vfr",	cmd_vmfastrefill },
+	{ "vcow",	cmd_vmcow },
+	{ "vzp",	cmd_vmzeropool },
+	{ "vasid",	cmd_vmasids },
+	{ "vtlb",	cmd_vmtlbreport },
+	{ "vlazy",	cmd_vmlazyload },
+	{ "vtext",	cmd_vmtextcache },
+#endif
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -667,6 +947,7 @@ static struct {
 	{ "km2",	kmallocstress },
 	{ "km3",	kmalloctest3 },
 	{ "km4",	kmalloctest4 },
+	{ "km5",	kmalloctest5 },
 #if OPT_NET
 	{ "net",	nettest },
 #endif
@@ -716,6 +997,11 @@ static struct {
 	{ "fs5",	longstress },
 	{ "fs6",	createstress },
 
+	/* virtual memory assignment tests */
+#if !OPT_DUMBVM
+	{ "vm1",	hptscale },
+#endif
+
 	{ NULL, NULL }
 };
 
@@ -52,6 +52,8 @@
 #include <vnode.h>
 #include <pid.h>
 #include <filetable.h>
+#include <vm.h>
+#include "opt-dumbvm.h"
 
 /*
  * The process for the kernel; this holds all the kernel-only threads.
@@ -90,6 +92,7 @@ proc_create(const char *name)
 
 	/* VM fields */
 	proc->p_addrspace = NULL;
+	proc->p_tlbmisses = 0;
 
 	/* VFS fields */
 	proc->p_cwd = NULL;
@@ -366,6 +369,13 @@ proc_exit(int status)
 	/* There should be no threads left in the target process. */
 	KASSERT(threadarray_num(&proc->p_threads) == 0);
 
+#if !OPT_DUMBVM
+	if (vm_tlbreport) {
+		kprintf("%s (pid %d): %u tlb misses\n", proc->p_name,
+			proc->p_pid, proc->p_tlbmisses);
+	}
+#endif
+
 	/* Now we can destroy the process. */
 	proc_destroy(proc);
 
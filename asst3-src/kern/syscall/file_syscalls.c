@@ -41,6 +41,7 @@
 #include <uio.h>
 #include <proc.h>
 #include <current.h>
+#include <addrspace.h>
 #include <synch.h>
 #include <copyinout.h>
 #include <vfs.h>
@@ -142,6 +143,16 @@ sys_readwrite(int fd, userptr_t buf, size_t size, enum uio_rw rw,
 		goto fail;
 	}
 
+	/*
+	 * Fault in any part of the buffer that is read from a file on
+	 * first touch, e.g. a mapping of this same file, before the
+	 * file system locks the vnode to copy to or from it.
+	 */
+	result = as_prefault(proc_getas(), buf, size);
+	if (result) {
+		goto fail;
+	}
+
 	/* set up a uio with the buffer, its size, and the current offset */
 	uio_uinit(&iov, &useruio, buf, size, pos, rw);
 
@@ -42,8 +42,9 @@
  * circumstances, as_prepare_load and as_complete_load probably don't
  * need to do anything.
  *
- * If you wanted to support memory-mapped executables you would need
- * to rearrange this to map each segment.
+ * Unless vm_lazyload is turned off, segments aren't actually read
+ * here: as_map_segment() leaves each page to be read from the file by
+ * vm_fault() when it is first touched.
  *
  * To support dynamically linked executables with shared libraries
  * you'd need to change this to load the "ELF interpreter" (dynamic
@@ -52,6 +53,7 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/stat.h>
 #include <lib.h>
 #include <uio.h>
 #include <proc.h>
@@ -72,7 +74,8 @@
  * Note that uiomove will catch it if someone tries to load an
  * executable whose load address is in kernel space. If you should
  * change this code to not use uiomove, be sure to check for this case
- * explicitly.
+ * explicitly. (The lazy path does, and also checks up front that the
+ * file isn't truncated, since its pages are only read later.)
  */
 static
 int
@@ -90,6 +93,28 @@ load_segment(struct addrspace *as, struct vnode *v,
 		filesize = memsize;
 	}
 
+#if !OPT_DUMBVM
+	if (vm_lazyload) {
+		struct stat st;
+
+		if (vaddr + memsize < vaddr || vaddr + memsize > USERSPACETOP) {
+			return EFAULT;
+		}
+		result = VOP_STAT(v, &st);
+		if (result) {
+			return result;
+		}
+		if (offset + filesize > st.st_size) {
+			kprintf("ELF: short segment - file truncated?\n");
+			return ENOEXEC;
+		}
+
+		DEBUG(DB_EXEC, "ELF: Mapping %lu bytes at 0x%lx\n",
+		      (unsigned long) filesize, (unsigned long) vaddr);
+		return as_map_segment(as, vaddr, v, offset, filesize);
+	}
+#endif
+
 	DEBUG(DB_EXEC, "ELF: Loading %lu bytes to 0x%lx\n",
 	      (unsigned long) filesize, (unsigned long) vaddr);
 
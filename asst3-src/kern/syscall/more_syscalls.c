@@ -37,6 +37,7 @@
 #include <kern/limits.h>
 #include <kern/seek.h>
 #include <kern/stat.h>
+#include <kern/mman.h>
 #include <lib.h>
 #include <uio.h>
 #include <proc.h>
@@ -47,6 +48,7 @@
 #include <vnode.h>
 #include <openfile.h>
 #include <filetable.h>
+#include <addrspace.h>
 #include <syscall.h>
 
 /*
@@ -385,9 +387,15 @@ sys_fsync(int fd)
 	/*
 	 * No need to lock the openfile - it cannot disappear under us,
 	 * and we're not using any of its non-constant fields.
+	 *
+	 * Pages written through our own mappings of the file go to
+	 * the file first, so they get synced too.
 	 */
 
-	err = VOP_FSYNC(file->of_vnode);
+	err = as_msync(proc_getas(), file->of_vnode);
+	if (err == 0) {
+		err = VOP_FSYNC(file->of_vnode);
+	}
 	filetable_put(curproc->p_filetable, fd, file);
 	return err;
 }
@@ -427,3 +435,59 @@ sys_ftruncate(int fd, off_t len)
 	filetable_put(curproc->p_filetable, fd, file);
 	return err;
 }
+
+/*
+ * mmap - map part of an open file into memory, at an address the
+ * kernel chooses. The file must be readable, and also writable for
+ * PROT_WRITE, since written pages go back to it.
+ */
+int
+sys_mmap(size_t length, int prot, int fd, off_t offset, vaddr_t *retval)
+{
+	struct openfile *file;
+	int err;
+
+	if (length == 0 || offset < 0 || offset % PAGE_SIZE != 0) {
+		return EINVAL;
+	}
+	if ((prot & ~(PROT_READ | PROT_WRITE)) != 0) {
+		return EINVAL;
+	}
+
+	err = filetable_get(curproc->p_filetable, fd, &file);
+	if (err) {
+		return err;
+	}
+
+	/* of_accmode should have only the O_ACCMODE bits in it */
+	KASSERT((file->of_accmode & O_ACCMODE) == file->of_accmode);
+
+	if (file->of_accmode == O_WRONLY ||
+	    ((prot & PROT_WRITE) && file->of_accmode != O_RDWR)) {
+		filetable_put(curproc->p_filetable, fd, file);
+		return EACCES;
+	}
+
+	/*
+	 * No need to lock the openfile - the mapping takes its own
+	 * reference to the vnode.
+	 */
+
+	err = VOP_MMAP(file->of_vnode);
+	if (err == 0) {
+		err = as_mmap(proc_getas(), file->of_vnode, offset, length,
+			      (prot & PROT_WRITE) != 0, retval);
+	}
+	filetable_put(curproc->p_filetable, fd, file);
+	return err;
+}
+
+/*
+ * munmap - remove a mapping made by mmap, given the address mmap
+ * returned.
+ */
+int
+sys_munmap(vaddr_t addr)
+{
+	return as_munmap(proc_getas(), addr);
+}
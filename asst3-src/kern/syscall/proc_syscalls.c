@@ -41,6 +41,7 @@
 #include <proc.h>
 #include <current.h>
 #include <copyinout.h>
+#include <addrspace.h>
 #include <pid.h>
 #include <syscall.h>
 
@@ -58,6 +59,23 @@ sys_getpid(pid_t *retval)
 	return 0;
 }
 
+/*
+ * sys_sbrk
+ *
+ * move the end of the heap; the work is in as_sbrk().
+ */
+int
+sys_sbrk(intptr_t amount, vaddr_t *retval)
+{
+	struct addrspace *as;
+
+	as = proc_getas();
+	if (as == NULL) {
+		return ENOMEM;
+	}
+	return as_sbrk(as, amount, retval);
+}
+
 /*
  * sys__exit()
  *
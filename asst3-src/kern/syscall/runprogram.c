@@ -55,11 +55,28 @@
  *
  * This is an abstraction that holds an argv while it's being shuffled
  * through the kernel during exec.
+ *
+ * The strings are stored back to back, null terminators included, in
+ * pages allocated one at a time as the copyin reaches them, so a big
+ * argv never needs a large contiguous allocation and is copied in
+ * exactly once. A string may run across a page boundary. The limit of
+ * ARG_MAX covers the strings and the argv pointers together, since
+ * both end up on the new process's stack.
+ */
+#define ARGBUF_NPAGES	(ARG_MAX / PAGE_SIZE)
+
+/*
+ * Number of argv pointers moved between user and kernel space by one
+ * copyin or copyout. They are staged in buf->ptrs, which is allocated
+ * up front because copyout must not fail once the old address space
+ * is gone.
  */
+#define ARGBUF_NPTRS	64
+
 struct argbuf {
-	char *data;
+	char *pages[ARGBUF_NPAGES];
+	userptr_t *ptrs;
 	size_t len;
-	size_t max;
 	int nargs;
 	bool tooksem;
 };
@@ -88,14 +105,23 @@ exec_bootstrap(void)
  * Initialize an argv buffer.
  */
 static
-void
+int
 argbuf_init(struct argbuf *buf)
 {
-	buf->data = NULL;
+	int i;
+
+	for (i=0; i<ARGBUF_NPAGES; i++) {
+		buf->pages[i] = NULL;
+	}
 	buf->len = 0;
-	buf->max = 0;
 	buf->nargs = 0;
 	buf->tooksem = false;
+
+	buf->ptrs = kmalloc(ARGBUF_NPTRS * sizeof(userptr_t));
+	if (buf->ptrs == NULL) {
+		return ENOMEM;
+	}
+	return 0;
 }
 
 /*
@@ -105,12 +131,17 @@ static
 void
 argbuf_cleanup(struct argbuf *buf)
 {
-	if (buf->data != NULL) {
-		kfree(buf->data);
-		buf->data = NULL;
+	int i;
+
+	for (i=0; i<ARGBUF_NPAGES; i++) {
+		if (buf->pages[i] != NULL) {
+			free_kpages((vaddr_t)buf->pages[i]);
+			buf->pages[i] = NULL;
+		}
 	}
+	kfree(buf->ptrs);
+	buf->ptrs = NULL;
 	buf->len = 0;
-	buf->max = 0;
 	buf->nargs = 0;
 	if (buf->tooksem) {
 		V(execthrottle);
@@ -119,17 +150,46 @@ argbuf_cleanup(struct argbuf *buf)
 }
 
 /*
- * Allocate the memory for an argv buffer.
+ * Find room for the next bytes of the argument currently being added
+ * (argument number buf->nargs). Returns where they go and how many
+ * fit, which is up to the end of the page holding buf->len or the
+ * ARG_MAX limit, whichever comes first. Allocates the page if it
+ * hasn't been used yet.
  */
 static
 int
-argbuf_allocate(struct argbuf *buf, size_t size)
+argbuf_space(struct argbuf *buf, char **ptr_ret, size_t *space_ret)
 {
-	buf->data = kmalloc(size);
-	if (buf->data == NULL) {
-		return ENOMEM;
+	size_t used, page, offset;
+	vaddr_t kpage;
+
+	/* the strings so far, plus pointers for this argument and the NULL */
+	used = buf->len + (buf->nargs + 2) * sizeof(userptr_t);
+	if (used >= ARG_MAX) {
+		return E2BIG;
+	}
+
+	page = buf->len / PAGE_SIZE;
+	offset = buf->len % PAGE_SIZE;
+	if (buf->pages[page] == NULL) {
+		/* Past the first page, wait on the semaphore to throttle */
+		if (page > 0 && !buf->tooksem) {
+			P(execthrottle);
+			buf->tooksem = true;
+		}
+
+		kpage = alloc_kpages(1);
+		if (kpage == 0) {
+			return ENOMEM;
+		}
+		buf->pages[page] = (char *)kpage;
+	}
+
+	*ptr_ret = buf->pages[page] + offset;
+	*space_ret = PAGE_SIZE - offset;
+	if (*space_ret > ARG_MAX - used) {
+		*space_ret = ARG_MAX - used;
 	}
-	buf->max = size;
 	return 0;
 }
 
@@ -143,16 +203,20 @@ static
 int
 argbuf_fromkernel(struct argbuf *buf, const char *progname)
 {
-	size_t len;
+	char *ptr;
+	size_t len, space;
 	int result;
 
 	len = strlen(progname) + 1;
 
-	result = argbuf_allocate(buf, len);
+	result = argbuf_space(buf, &ptr, &space);
 	if (result) {
 		return result;
 	}
-	strcpy(buf->data, progname);
+	if (len > space) {
+		return E2BIG;
+	}
+	strcpy(ptr, progname);
 	buf->len = len;
 	buf->nargs = 1;
 
@@ -160,91 +224,118 @@ argbuf_fromkernel(struct argbuf *buf, const char *progname)
 }
 
 /*
- * Copy an argv array into kernel space, using an argvdata buffer.
+ * Copy one argument string into an argv buffer, a page at a time.
  */
 static
 int
-argbuf_copyin(struct argbuf *buf, userptr_t uargv)
+argbuf_copyinstr(struct argbuf *buf, userptr_t thisarg)
 {
-	userptr_t thisarg;
-	size_t thisarglen;
+	char *ptr;
+	size_t space, thisarglen;
 	int result;
 
-	/* loop through the argv, grabbing each arg string */
-	buf->nargs = 0;
 	while (1) {
-		/*
-		 * First, grab the pointer at argv.
-		 * (argv is incremented at the end of the loop)
-		 */
-		result = copyin(uargv, &thisarg, sizeof(userptr_t));
+		result = argbuf_space(buf, &ptr, &space);
 		if (result) {
 			return result;
 		}
 
-		/* If we got NULL, we're at the end of the argv. */
-		if (thisarg == NULL) {
+		result = copyinstr(thisarg, ptr, space, &thisarglen);
+		if (result != ENAMETOOLONG) {
 			break;
 		}
 
-		/* Use the pointer to fetch the argument string. */
-		result = copyinstr(thisarg, buf->data + buf->len,
-				   buf->max - buf->len, &thisarglen);
-		if (result == ENAMETOOLONG) {
-			return E2BIG;
-		}
-		else if (result) {
-			return result;
-		}
-
-		/* Move ahead. Note: thisarglen includes the \0. */
-		buf->len += thisarglen;
-		uargv += sizeof(userptr_t);
-		buf->nargs++;
+		/*
+		 * The string filled all the space there was, so
+		 * exactly that much was copied; carry on with the
+		 * rest. If it was ARG_MAX that ran out, the next
+		 * argbuf_space fails.
+		 */
+		buf->len += space;
+		thisarg += space;
+	}
+	if (result) {
+		return result;
 	}
 
+	/* Note: thisarglen includes the \0. */
+	buf->len += thisarglen;
+	buf->nargs++;
 	return 0;
 }
 
 /*
- * Get an argv from user space.
+ * Copy an argv array into kernel space, using an argvdata buffer.
+ *
+ * The argv pointers are fetched up to ARGBUF_NPTRS at a time, but
+ * never past the end of the user page the next one is on, since
+ * the array may end right before an unmapped page.
  */
 static
 int
 argbuf_fromuser(struct argbuf *buf, userptr_t uargv)
 {
+	size_t pageleft;
+	unsigned i, n;
 	int result;
 
-	/* try with a small buffer */
-	result = argbuf_allocate(buf, PAGE_SIZE);
-	if (result) {
-		return result;
-	}
-
-	/* do the copyin */
-	result = argbuf_copyin(buf, uargv);
-	if (result == E2BIG) {
-		/*
-		 * Try again with the full-size buffer. Just start
-		 * over instead of trying to keep the page we already
-		 * did; this is a bit inefficient but it's not that
-		 * important.
-		 */
-		argbuf_cleanup(buf);
-		argbuf_init(buf);
-
-		/* Wait on the semaphore, to throttle this allocation */
-		P(execthrottle);
-		buf->tooksem = true;
+	/* loop through the argv, grabbing each arg string */
+	buf->nargs = 0;
+	while (1) {
+		pageleft = PAGE_SIZE - ((vaddr_t)uargv % PAGE_SIZE);
+		n = pageleft / sizeof(userptr_t);
+		if (n == 0) {
+			/* misaligned pointer across the page boundary */
+			n = 1;
+		}
+		if (n > ARGBUF_NPTRS) {
+			n = ARGBUF_NPTRS;
+		}
 
-		result = argbuf_allocate(buf, ARG_MAX);
+		result = copyin(uargv, buf->ptrs, n * sizeof(userptr_t));
 		if (result) {
 			return result;
 		}
 
-		result = argbuf_copyin(buf, uargv);
+		for (i=0; i<n; i++) {
+			/* If we got NULL, we're at the end of the argv. */
+			if (buf->ptrs[i] == NULL) {
+				return 0;
+			}
+
+			result = argbuf_copyinstr(buf, buf->ptrs[i]);
+			if (result) {
+				return result;
+			}
+		}
+		uargv += n * sizeof(userptr_t);
 	}
-	return result;
+}
+
+/*
+ * Add one pointer to the batch of argv pointers being copied out,
+ * flushing the batch to the user argv array if it is full or if
+ * FLUSH is set.
+ */
+static
+int
+argbuf_putptr(struct argbuf *buf, unsigned *nptrs, userptr_t *uargv_i,
+	      userptr_t thisarg, bool flush)
+{
+	int result;
+
+	buf->ptrs[(*nptrs)++] = thisarg;
+	if (*nptrs < ARGBUF_NPTRS && !flush) {
+		return 0;
+	}
+
+	result = copyout(buf->ptrs, *uargv_i, *nptrs * sizeof(userptr_t));
+	if (result) {
+		return result;
+	}
+	*uargv_i += *nptrs * sizeof(userptr_t);
+	*nptrs = 0;
+	return 0;
 }
 
 /*
@@ -259,9 +350,10 @@ argbuf_copyout(struct argbuf *buf, vaddr_t *ustackp,
 {
 	vaddr_t ustack;
 	userptr_t ustringbase, uargvbase, uargv_i;
-	userptr_t thisarg;
-	size_t thisarglen;
-	size_t pos;
+	unsigned nptrs;
+	size_t pos, thislen;
+	bool argstart;
+	int nargs;
 	int result;
 
 	/* Begin the stack at the passed in top. */
@@ -270,7 +362,7 @@ argbuf_copyout(struct argbuf *buf, vaddr_t *ustackp,
 	/*
 	 * Allocate space.
 	 *
-	 * buf->pos is the amount of space used by the strings; put that
+	 * buf->len is the amount of space used by the strings; put that
 	 * first, then align the stack, then make space for the argv
 	 * pointers. Allow an extra slot for the ending NULL.
 	 */
@@ -282,36 +374,47 @@ argbuf_copyout(struct argbuf *buf, vaddr_t *ustackp,
 	ustack -= (buf->nargs + 1) * sizeof(userptr_t);
 	uargvbase = (userptr_t)ustack;
 
-	/* Now copy the data out. */
-	pos = 0;
-	uargv_i = uargvbase;
-	while (pos < buf->len) {
-		/* The user address of the string will be ustringbase + pos. */
-		thisarg = ustringbase + pos;
-
-		/* Place it in the argv array. */
-		result = copyout(&thisarg, uargv_i, sizeof(thisarg));
-		if (result) {
-			return result;
+	/*
+	 * The strings are contiguous in user space just as they are
+	 * in the buffer, so push them out a page at a time.
+	 */
+	for (pos = 0; pos < buf->len; pos += thislen) {
+		thislen = buf->len - pos;
+		if (thislen > PAGE_SIZE) {
+			thislen = PAGE_SIZE;
 		}
-
-		/* Push out the string. */
-		result = copyoutstr(buf->data + pos, thisarg,
-				    buf->len - pos, &thisarglen);
+		result = copyout(buf->pages[pos / PAGE_SIZE],
+				 ustringbase + pos, thislen);
 		if (result) {
 			return result;
 		}
+	}
 
-		/* thisarglen includes the \0 */
-		pos += thisarglen;
-		uargv_i += sizeof(thisarg);
+	/*
+	 * Now the argv array. Each string starts after the \0 of the
+	 * one before it.
+	 */
+	nptrs = 0;
+	nargs = 0;
+	uargv_i = uargvbase;
+	argstart = true;
+	for (pos = 0; pos < buf->len; pos++) {
+		if (argstart) {
+			result = argbuf_putptr(buf, &nptrs, &uargv_i,
+					       ustringbase + pos, false);
+			if (result) {
+				return result;
+			}
+			nargs++;
+		}
+		argstart = buf->pages[pos / PAGE_SIZE][pos % PAGE_SIZE] == 0;
 	}
 	/* Should have come out even... */
-	KASSERT(pos == buf->len);
+	KASSERT(nargs == buf->nargs);
+	KASSERT(argstart);
 
 	/* Add the NULL. */
-	thisarg = NULL;
-	result = copyout(&thisarg, uargv_i, sizeof(userptr_t));
+	result = argbuf_putptr(buf, &nptrs, &uargv_i, NULL, true);
 	if (result) {
 		return result;
 	}
@@ -511,7 +614,11 @@ runprogram(char *progname)
 	 * Cons up argv.
 	 */
 
-	argbuf_init(&kargv);
+	result = argbuf_init(&kargv);
+	if (result) {
+		argbuf_cleanup(&kargv);
+		return result;
+	}
 	result = argbuf_fromkernel(&kargv, progname);
 	if (result) {
 		argbuf_cleanup(&kargv);
@@ -574,7 +681,12 @@ sys_execv(userptr_t prog, userptr_t uargv)
 
 	/* get the argv strings. */
 
-	argbuf_init(&kargv);
+	result = argbuf_init(&kargv);
+	if (result) {
+		argbuf_cleanup(&kargv);
+		kfree(path);
+		return result;
+	}
 
 	result = argbuf_fromuser(&kargv, uargv);
 	if (result) {
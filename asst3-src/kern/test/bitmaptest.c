@@ -39,7 +39,7 @@ bitmaptest(int nargs, char **args)
 {
 	struct bitmap *b;
 	char data[TESTSIZE];
-	uint32_t x;
+	uint32_t x, goal, j;
 	int i;
 
 	(void)nargs;
@@ -89,6 +89,21 @@ bitmaptest(int nargs, char **args)
 		}
 	}
 
+	/* Allocating near a goal takes the next clear bit, wrapping around */
+	for (i=0; i<TESTSIZE/4; i++) {
+		goal = random() % TESTSIZE;
+		for (j=0; j<TESTSIZE && data[(goal+j) % TESTSIZE]==0; j++) {
+			/* nothing */
+		}
+		if (bitmap_alloc_near(b, goal, &x)) {
+			KASSERT(j == TESTSIZE);
+			break;
+		}
+		KASSERT(x == (goal+j) % TESTSIZE);
+		KASSERT(bitmap_isset(b, x));
+		data[x] = 0;
+	}
+
 	while (bitmap_alloc(b, &x)==0) {
 		KASSERT(x < TESTSIZE);
 		KASSERT(bitmap_isset(b, x));
@@ -378,3 +378,132 @@ kmalloctest4(int nargs, char **args)
 	kprintf("Multipage kmalloc test done\n");
 	return 0;
 }
+
+////////////////////////////////////////////////////////////
+// km5
+
+/*
+ * Mixed-size kmalloc stress test. Each thread keeps a window of live
+ * blocks whose sizes cycle through sub-page and multi-page sizes, so
+ * single-page and contiguous multi-page allocations are interleaved
+ * and fragment physical memory. Every block is filled with a pattern
+ * identifying its owner and is checked before it is freed, which
+ * catches multi-page runs that overlap each other or a subpage.
+ */
+
+#define NUM_KM5_SIZES 9
+#define KM5_NSLOTS    7
+
+static
+void
+km5fill(unsigned char *ptr, size_t size, unsigned long num, unsigned slot)
+{
+	size_t i;
+
+	for (i=0; i<size; i++) {
+		ptr[i] = (unsigned char)(num * 31 + slot * 7 + i / 4);
+	}
+}
+
+static
+void
+km5check(unsigned char *ptr, size_t size, unsigned long num, unsigned slot)
+{
+	size_t i;
+
+	for (i=0; i<size; i++) {
+		if (ptr[i] != (unsigned char)(num * 31 + slot * 7 + i / 4)) {
+			panic("kmalloctest5: thread %lu: block %p (%zu bytes) "
+			      "corrupted at offset %zu\n", num, ptr, size, i);
+		}
+	}
+}
+
+static
+void
+kmalloctest5thread(void *sm, unsigned long num)
+{
+	static const size_t sizes[NUM_KM5_SIZES] = {
+		24, 3 * PAGE_SIZE, 500, 1 * PAGE_SIZE, 7 * PAGE_SIZE,
+		2000, 2 * PAGE_SIZE + 1, 5 * PAGE_SIZE, 128,
+	};
+
+	struct semaphore *sem = sm;
+	unsigned char *ptrs[KM5_NSLOTS];
+	size_t ptrsizes[KM5_NSLOTS];
+	unsigned slot, s;
+	unsigned i;
+
+	for (i=0; i<KM5_NSLOTS; i++) {
+		ptrs[i] = NULL;
+	}
+	s = num % NUM_KM5_SIZES;
+
+	for (i=0; i<NTRIES; i++) {
+		slot = i % KM5_NSLOTS;
+		if (ptrs[slot] != NULL) {
+			km5check(ptrs[slot], ptrsizes[slot], num, slot);
+			kfree(ptrs[slot]);
+		}
+		ptrsizes[slot] = sizes[s];
+		ptrs[slot] = kmalloc(ptrsizes[slot]);
+		if (ptrs[slot] == NULL) {
+			panic("kmalloctest5: thread %lu: "
+			      "allocating %zu bytes failed\n",
+			      num, ptrsizes[slot]);
+		}
+		km5fill(ptrs[slot], ptrsizes[slot], num, slot);
+		s = (s + 1) % NUM_KM5_SIZES;
+	}
+
+	for (i=0; i<KM5_NSLOTS; i++) {
+		if (ptrs[i] != NULL) {
+			km5check(ptrs[i], ptrsizes[i], num, i);
+			kfree(ptrs[i]);
+		}
+	}
+
+	V(sem);
+}
+
+int
+kmalloctest5(int nargs, char **args)
+{
+	struct semaphore *sem;
+	unsigned nthreads;
+	unsigned i;
+	int result;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting mixed-size kmalloc test...\n");
+#if OPT_DUMBVM
+	kprintf("(This test will not work with dumbvm)\n");
+#endif
+
+	sem = sem_create("kmalloctest5", 0);
+	if (sem == NULL) {
+		panic("kmalloctest5: sem_create failed\n");
+	}
+
+	/* use 6 instead of 8 threads, like km4 */
+	nthreads = (3*NTHREADS)/4;
+
+	for (i=0; i<nthreads; i++) {
+		result = thread_fork("kmalloctest5", NULL,
+				     kmalloctest5thread, sem, i);
+		if (result) {
+			panic("kmalloctest5: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+
+	for (i=0; i<nthreads; i++) {
+		P(sem);
+	}
+
+	sem_destroy(sem);
+	kprintf("Mixed-size kmalloc test done\n");
+	return 0;
+}
@@ -0,0 +1,147 @@
+/*
+ * Test code for the VM system.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <thread.h>
+#include <synch.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <test.h>
+
+////////////////////////////////////////////////////////////
+// vm1
+
+/*
+ * Measure how hashed page table fault throughput scales with the
+ * number of threads faulting at once. Each thread owns a private
+ * address space and repeatedly faults in VMT_NPAGES pages with
+ * insert_ptable_entry() before tearing them down with free_region(),
+ * which is the same HPT work a first-touch fault and a process exit
+ * do. On a multi-CPU sys161 config the threads migrate to idle CPUs,
+ * so with independently locked HPT stripes the faults/sec figure
+ * should grow with the thread count until the CPUs run out.
+ *
+ * Runs 1, 2, 4, ... threads up to VMT_MAXTHREADS, or up to the
+ * thread count given as an argument.
+ */
+
+#define VMT_NPAGES     64
+#define VMT_NROUNDS    32
+#define VMT_MAXTHREADS 8
+#define VMT_BASE       0x400000
+
+static volatile bool vmt_failed;
+
+static
+void
+hptthread(void *sm, unsigned long num)
+{
+	struct semaphore *sem = sm;
+	struct addrspace *as;
+	vaddr_t addr;
+	int i, result;
+
+	as = as_create();
+	if (as == NULL) {
+		kprintf("thread %lu: as_create failed\n", num);
+		vmt_failed = true;
+		V(sem);
+		return;
+	}
+
+	for (i=0; i<VMT_NROUNDS && !vmt_failed; i++) {
+		for (addr = VMT_BASE;
+		     addr < VMT_BASE + VMT_NPAGES * PAGE_SIZE;
+		     addr += PAGE_SIZE) {
+			result = insert_ptable_entry(as, addr, true, false);
+			if (result) {
+				kprintf("thread %lu: insert_ptable_entry: %s\n",
+					num, strerror(result));
+				vmt_failed = true;
+				break;
+			}
+		}
+		free_region(as, VMT_BASE, VMT_NPAGES);
+	}
+
+	as_destroy(as);
+	V(sem);
+}
+
+static
+int
+hptrun(struct semaphore *sem, unsigned nthreads)
+{
+	struct timespec before, after, duration;
+	unsigned i, faults, msecs;
+	int result;
+
+	gettime(&before);
+	for (i=0; i<nthreads; i++) {
+		result = thread_fork("hptscale", NULL, hptthread, sem, i);
+		if (result) {
+			panic("hptscale: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<nthreads; i++) {
+		P(sem);
+	}
+	gettime(&after);
+	timespec_sub(&after, &before, &duration);
+
+	if (vmt_failed) {
+		return ENOMEM;
+	}
+
+	faults = nthreads * VMT_NROUNDS * VMT_NPAGES;
+	msecs = duration.tv_sec * 1000 + duration.tv_nsec / 1000000;
+	kprintf("%2u threads: %6u faults in %llu.%09lu seconds",
+		nthreads, faults,
+		(unsigned long long) duration.tv_sec,
+		(unsigned long) duration.tv_nsec);
+	if (msecs > 0) {
+		kprintf(" (%u faults/sec)", faults * 1000 / msecs);
+	}
+	kprintf("\n");
+	return 0;
+}
+
+int
+hptscale(int nargs, char **args)
+{
+	struct semaphore *sem;
+	unsigned n, maxthreads;
+	int result = 0;
+
+	maxthreads = VMT_MAXTHREADS;
+	if (nargs > 1) {
+		maxthreads = atoi(args[1]);
+		if (maxthreads == 0) {
+			kprintf("Usage: vm1 [maxthreads]\n");
+			return EINVAL;
+		}
+	}
+
+	sem = sem_create("hptscale", 0);
+	if (sem == NULL) {
+		panic("hptscale: sem_create failed\n");
+	}
+
+	kprintf("Starting HPT fault scaling test...\n");
+	vmt_failed = false;
+	for (n=1; n<=maxthreads && result == 0; n*=2) {
+		result = hptrun(sem, n);
+	}
+	sem_destroy(sem);
+
+	if (result) {
+		kprintf("HPT fault scaling test failed\n");
+		return result;
+	}
+	kprintf("HPT fault scaling test done\n");
+	return 0;
+}
@@ -0,0 +1,40 @@
+/*
+ * Generic block I/O: checks a transfer against the device and passes
+ * it to the driver's request queue if it has one, or turns it into a
+ * kernel uio for devop_io if not.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <uio.h>
+#include <device.h>
+#include <blkio.h>
+
+int blkio(struct device *dev, uint32_t block, void *data, size_t len,
+	  enum uio_rw rw) {
+	struct blkreq req;
+	struct iovec iov;
+	struct uio ku;
+	uint32_t nblocks;
+	int result;
+
+	KASSERT(dev->d_blocksize > 0);
+	if (len % dev->d_blocksize != 0) return EINVAL;
+	nblocks = len / dev->d_blocksize;
+	if (block > dev->d_blocks || nblocks > dev->d_blocks - block) return EINVAL;
+	if (nblocks == 0) return 0;
+
+	if (dev->d_ops->devop_blkio != NULL) {
+		bzero(&req, sizeof(req));
+		req.br_block = block;
+		req.br_nblocks = nblocks;
+		req.br_data = data;
+		req.br_rw = rw;
+		return DEVOP_BLKIO(dev, &req);
+	}
+
+	uio_kinit(&iov, &ku, data, len, (off_t) block * dev->d_blocksize, rw);
+	result = DEVOP_IO(dev, &ku);
+	if (result == 0 && ku.uio_resid != 0) result = EIO; /* short transfer */
+	return result;
+}
@@ -0,0 +1,742 @@
+/*
+ * Buffer cache.
+ *
+ * Every buffer lives on buf_all[] once allocated, on a hash chain while
+ * it names a block, and on the LRU list (least recently used first)
+ * unless it is busy. Buffers are allocated lazily up to buf_max; after
+ * that a miss recycles the least recently used idle buffer. buf_lock
+ * protects all of it, but is never held across device I/O: a buffer
+ * being read or written is busy instead, and anyone who wants it waits
+ * on buf_cv.
+ *
+ * Two kernel threads work in the background. The read-ahead thread
+ * reads blocks queued by buffer_readahead() into idle buffers, a run
+ * of consecutive blocks at a time. The syncer writes back idle dirty
+ * buffers every BUF_SYNCSECS seconds, so writers rarely wait for a
+ * dirty eviction. All write-back (syncer, buffer_sync() and eviction)
+ * writes a dirty buffer together with the dirty buffers of the blocks
+ * after it as one transfer, up to BUF_MAXRUN blocks. Every
+ * BUF_FSSYNCSECS the syncer also syncs the file systems, which is what
+ * bounds how long a journaled file system's transaction stays open.
+ *
+ * A pinned buffer (see buffer_pin()) is dirty but must not reach its
+ * block yet, so write-back and eviction pass it over until it is
+ * unpinned. Pinned buffers stay cached, and stay dirty.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <uio.h>
+#include <synch.h>
+#include <clock.h>
+#include <thread.h>
+#include <device.h>
+#include <vfs.h>
+#include <blkio.h>
+#include <mainbus.h>
+#include <vm.h>
+#include <buf.h>
+
+#define BUF_HASHSIZE 251       /* hash chains - prime */
+#define BUF_MIN      32        /* never fewer buffers than this */
+#define BUF_RAMSHIFT 4         /* use 1/16 of physical memory */
+#define BUF_MAXRUN   8         /* most blocks per device transfer */
+#define BUF_RAQSIZE  64        /* most blocks waiting to be read ahead */
+#define BUF_SYNCSECS 1         /* syncer period */
+#define BUF_FSSYNCSECS 5       /* how often the syncer calls vfs_sync() */
+
+struct buf {
+	struct device *b_dev;  /* NULL if the buffer holds no block */
+	daddr_t b_block;
+	bool b_valid;          /* contents match the block - a buffer_get buffer only once it is marked dirty */
+	bool b_dirty;          /* contents must be written back */
+	bool b_busy;           /* handed out, or doing I/O */
+	bool b_ra;             /* read ahead, and not looked up since */
+	bool b_pinned;         /* dirty, but not to be written back yet */
+	struct buf *b_hnext;   /* hash chain */
+	struct buf *b_prev;    /* LRU list */
+	struct buf *b_next;
+	void *b_data;
+};
+
+static struct lock *buf_lock;
+static struct cv *buf_cv;
+static struct buf **buf_all;
+static unsigned buf_num, buf_max;
+static struct buf *buf_hash[BUF_HASHSIZE];
+static struct buf *lru_head, *lru_tail;
+
+/* Read-ahead queue, a ring; ra_dev is the device the read-ahead thread is reading */
+static struct {
+	struct device *dev;
+	daddr_t block;
+} ra_queue[BUF_RAQSIZE];
+static unsigned ra_head, ra_count;
+static struct device *ra_dev;
+static struct cv *ra_cv;
+static unsigned ra_window = 8;  /* blocks ahead for sequential readers */
+
+static struct {
+	unsigned hits, misses;     /* lookups */
+	unsigned reads, writes;    /* device transfers */
+	unsigned rblocks, wblocks; /* blocks moved by them */
+	unsigned evictions;        /* dirty buffers written back to be reused */
+	unsigned raqueued, rahits, rawasted; /* read-ahead blocks: queued, then used or evicted unused */
+} buf_stats;
+
+static void buf_reader(void *unused1, unsigned long unused2);
+static void buf_syncer(void *unused1, unsigned long unused2);
+
+void buffer_bootstrap(void) {
+	unsigned frames = mainbus_ramsize() / PAGE_SIZE;
+	buf_max = (frames >> BUF_RAMSHIFT) * (PAGE_SIZE / BUFFER_SIZE);
+	if (buf_max < BUF_MIN) buf_max = BUF_MIN;
+
+	buf_lock = lock_create("buffer cache");
+	buf_cv = cv_create("buffer cache");
+	ra_cv = cv_create("read-ahead");
+	buf_all = kmalloc(buf_max * sizeof(struct buf *));
+	if (buf_lock == NULL || buf_cv == NULL || ra_cv == NULL || buf_all == NULL) {
+		panic("buffer_bootstrap: out of memory\n");
+	}
+	kprintf("buffer cache: up to %u buffers\n", buf_max);
+
+	int result = thread_fork("bufreader", NULL, buf_reader, NULL, 0);
+	if (result == 0) result = thread_fork("bufsyncer", NULL, buf_syncer, NULL, 0);
+	if (result) panic("buffer_bootstrap: can't start threads: %s\n", strerror(result));
+}
+
+static unsigned buf_hashidx(struct device *dev, daddr_t block) {
+	return ((uint32_t) dev * 2654435761U + block) % BUF_HASHSIZE;
+}
+
+static struct buf *buf_lookup(struct device *dev, daddr_t block) {
+	struct buf *b;
+	for (b = buf_hash[buf_hashidx(dev, block)]; b != NULL; b = b->b_hnext) {
+		if (b->b_dev == dev && b->b_block == block) return b;
+	}
+	return NULL;
+}
+
+static void buf_unhash(struct buf *b) {
+	struct buf **p = &buf_hash[buf_hashidx(b->b_dev, b->b_block)];
+	while (*p != b) p = &(*p)->b_hnext;
+	*p = b->b_hnext;
+	b->b_hnext = NULL;
+	b->b_dev = NULL;
+	b->b_valid = b->b_dirty = b->b_ra = b->b_pinned = false;
+}
+
+static void buf_rehash(struct buf *b, struct device *dev, daddr_t block) {
+	if (b->b_dev != NULL) buf_unhash(b);
+	unsigned idx = buf_hashidx(dev, block);
+	b->b_dev = dev;
+	b->b_block = block;
+	b->b_hnext = buf_hash[idx];
+	buf_hash[idx] = b;
+}
+
+static void lru_remove(struct buf *b) {
+	if (b->b_prev) b->b_prev->b_next = b->b_next;
+	else lru_head = b->b_next;
+	if (b->b_next) b->b_next->b_prev = b->b_prev;
+	else lru_tail = b->b_prev;
+	b->b_prev = b->b_next = NULL;
+}
+
+/* Most recently used end */
+static void lru_append(struct buf *b) {
+	b->b_prev = lru_tail;
+	b->b_next = NULL;
+	if (lru_tail) lru_tail->b_next = b;
+	else lru_head = b;
+	lru_tail = b;
+}
+
+/* Least recently used end - for buffers that no longer hold anything */
+static void lru_prepend(struct buf *b) {
+	b->b_prev = NULL;
+	b->b_next = lru_head;
+	if (lru_head) lru_head->b_prev = b;
+	else lru_tail = b;
+	lru_head = b;
+}
+
+/*
+ * Do one device transfer, retrying I/O errors.
+ */
+static int buf_devio(struct device *dev, daddr_t block, void *data, unsigned n, enum uio_rw rw) {
+	uint32_t devblock;
+	int result, tries = 0;
+
+	KASSERT(BUFFER_SIZE % dev->d_blocksize == 0);
+	devblock = block * (BUFFER_SIZE / dev->d_blocksize);
+	do {
+		result = blkio(dev, devblock, data, n * BUFFER_SIZE, rw);
+		if (result == EINVAL) {
+			/* out of range or misaligned - our fault, not the disk's */
+			panic("buffer: block %u: blkio returned EINVAL\n", block);
+		}
+		if (result == EIO && tries == 0) {
+			kprintf("buffer: block %u I/O error, retrying\n", block);
+		}
+	} while (result == EIO && ++tries < 10);
+	if (result == EIO) {
+		kprintf("buffer: block %u I/O error, giving up after %d retries\n",
+			block, tries);
+	}
+	if (rw == UIO_READ) {
+		buf_stats.reads++;
+		buf_stats.rblocks += n;
+	} else {
+		buf_stats.writes++;
+		buf_stats.wblocks += n;
+	}
+	return result;
+}
+
+/*
+ * Do device I/O on a run of busy buffers for consecutive blocks, as one
+ * transfer through a staging area if one can be had, otherwise block by
+ * block. Called without buf_lock.
+ */
+static int buf_iorun(struct buf **run, unsigned n, enum uio_rw rw) {
+	char *stage;
+	unsigned i;
+	int result;
+
+	for (i = 0; i < n; i++) {
+		KASSERT(run[i]->b_busy);
+		KASSERT(run[i]->b_dev == run[0]->b_dev && run[i]->b_block == run[0]->b_block + i);
+	}
+
+	stage = n > 1 ? kmalloc(n * BUFFER_SIZE) : NULL;
+	if (stage == NULL) {
+		for (i = 0, result = 0; i < n && result == 0; i++) {
+			result = buf_devio(run[i]->b_dev, run[i]->b_block, run[i]->b_data, 1, rw);
+		}
+		return result;
+	}
+
+	if (rw == UIO_WRITE) {
+		for (i = 0; i < n; i++) memcpy(stage + i * BUFFER_SIZE, run[i]->b_data, BUFFER_SIZE);
+	}
+	result = buf_devio(run[0]->b_dev, run[0]->b_block, stage, n, rw);
+	if (result == 0 && rw == UIO_READ) {
+		for (i = 0; i < n; i++) memcpy(run[i]->b_data, stage + i * BUFFER_SIZE, BUFFER_SIZE);
+	}
+	kfree(stage);
+	return result;
+}
+
+static int buf_io(struct buf *b, enum uio_rw rw) {
+	return buf_iorun(&b, 1, rw);
+}
+
+/*
+ * Write back a busy dirty buffer, along with the idle dirty buffers of
+ * the blocks right after it. The others are made busy for the transfer
+ * and idle again afterwards; b stays busy. Called with buf_lock, which
+ * is dropped during the I/O.
+ */
+static int buf_writerun(struct buf *b) {
+	struct buf *run[BUF_MAXRUN];
+	unsigned n, i;
+	int result;
+
+	KASSERT(b->b_busy && b->b_dirty && !b->b_pinned);
+	run[0] = b;
+	for (n = 1; n < BUF_MAXRUN; n++) {
+		struct buf *next = buf_lookup(b->b_dev, b->b_block + n);
+		if (next == NULL || next->b_busy || !next->b_dirty || next->b_pinned) break;
+		next->b_busy = true;
+		run[n] = next;
+	}
+
+	lock_release(buf_lock);
+	result = buf_iorun(run, n, UIO_WRITE);
+	lock_acquire(buf_lock);
+
+	for (i = 0; i < n; i++) {
+		if (result == 0) run[i]->b_dirty = false;
+		if (i > 0) run[i]->b_busy = false;
+	}
+	cv_broadcast(buf_cv, buf_lock);
+	return result;
+}
+
+/*
+ * Find a buffer to hold a new block: a fresh one while under buf_max,
+ * otherwise the least recently used idle unpinned one. Returns it busy and off
+ * the LRU list, still hashed under its old block. Returns NULL if it had
+ * to wait, in which case the caller must look up its block again.
+ */
+static struct buf *buf_victim(void) {
+	struct buf *b;
+
+	if (buf_num < buf_max) {
+		b = kmalloc(sizeof(struct buf));
+		void *data = kmalloc(BUFFER_SIZE);
+		if (b != NULL && data != NULL) {
+			bzero(b, sizeof(*b));
+			b->b_data = data;
+			b->b_busy = true;
+			buf_all[buf_num++] = b;
+			return b;
+		}
+		kfree(b);
+		kfree(data);
+		/* no memory - cap the cache here and recycle instead */
+		buf_max = buf_num;
+	}
+	for (b = lru_head; b != NULL && (b->b_busy || b->b_pinned); b = b->b_next);
+	if (b == NULL) {
+		cv_wait(buf_cv, buf_lock);
+		return NULL;
+	}
+	lru_remove(b);
+	b->b_busy = true;
+	return b;
+}
+
+/*
+ * Get the buffer for a block, busy: the cached one if there is one,
+ * otherwise a victim rehashed under the block, with b_valid false.
+ * Called with buf_lock, which may be dropped while waiting.
+ */
+static int buf_claim(struct device *dev, daddr_t block, struct buf **ret) {
+	struct buf *b;
+	int result;
+
+	KASSERT(dev != NULL);
+ again:
+	b = buf_lookup(dev, block);
+	if (b != NULL) {
+		if (b->b_busy) {
+			cv_wait(buf_cv, buf_lock);
+			goto again;
+		}
+		lru_remove(b);
+		b->b_busy = true;
+	} else {
+		b = buf_victim();
+		if (b == NULL) goto again;
+
+		if (b->b_dirty) {
+			/* write the old block back first; it stays findable (and busy) meanwhile */
+			result = buf_writerun(b);
+			buf_stats.evictions++;
+			if (result) {
+				/* keep the dirty data and give up on this request */
+				b->b_busy = false;
+				lru_append(b);
+				cv_broadcast(buf_cv, buf_lock);
+				return result;
+			}
+			if (buf_lookup(dev, block) != NULL) {
+				/* someone brought our block in while we slept */
+				b->b_busy = false;
+				lru_append(b);
+				cv_broadcast(buf_cv, buf_lock);
+				goto again;
+			}
+		}
+		if (b->b_ra) buf_stats.rawasted++;
+		/* the old block's waiters will look it up again and miss */
+		cv_broadcast(buf_cv, buf_lock);
+		buf_rehash(b, dev, block);
+	}
+	*ret = b;
+	return 0;
+}
+
+static int buf_getbuf(struct device *dev, daddr_t block, bool doread, struct buf **ret) {
+	struct buf *b;
+	int result;
+
+	lock_acquire(buf_lock);
+	result = buf_claim(dev, block, &b);
+	if (result) {
+		lock_release(buf_lock);
+		return result;
+	}
+
+	if (b->b_valid) {
+		buf_stats.hits++;
+		if (b->b_ra) {
+			buf_stats.rahits++;
+			b->b_ra = false;
+		}
+	} else {
+		buf_stats.misses++;
+	}
+
+	if (!b->b_valid && doread) {
+		lock_release(buf_lock);
+		result = buf_io(b, UIO_READ);
+		lock_acquire(buf_lock);
+		if (result) {
+			buf_unhash(b);
+			b->b_busy = false;
+			lru_prepend(b);
+			cv_broadcast(buf_cv, buf_lock);
+			lock_release(buf_lock);
+			return result;
+		}
+		b->b_valid = true;
+	}
+	lock_release(buf_lock);
+	*ret = b;
+	return 0;
+}
+
+int buffer_read(struct device *dev, daddr_t block, struct buf **ret) {
+	return buf_getbuf(dev, block, true, ret);
+}
+
+int buffer_get(struct device *dev, daddr_t block, struct buf **ret) {
+	return buf_getbuf(dev, block, false, ret);
+}
+
+void *buffer_map(struct buf *b) {
+	KASSERT(b->b_busy);
+	return b->b_data;
+}
+
+bool buffer_valid(struct buf *b) {
+	KASSERT(b->b_busy);
+	return b->b_valid;
+}
+
+void buffer_mark_dirty(struct buf *b) {
+	KASSERT(b->b_busy);
+	b->b_valid = true;
+	b->b_dirty = true;
+}
+
+bool buffer_pin(struct buf *b) {
+	bool was;
+
+	lock_acquire(buf_lock);
+	KASSERT(b->b_busy && b->b_dirty);
+	was = b->b_pinned;
+	b->b_pinned = true;
+	lock_release(buf_lock);
+	return !was;
+}
+
+void buffer_unpin(struct device *dev, daddr_t block) {
+	struct buf *b;
+
+	lock_acquire(buf_lock);
+	b = buf_lookup(dev, block);
+	if (b != NULL && b->b_pinned) {
+		b->b_pinned = false;
+		/* someone may be waiting for a buffer to recycle */
+		cv_broadcast(buf_cv, buf_lock);
+	}
+	lock_release(buf_lock);
+}
+
+unsigned buffer_maxcount(void) {
+	return buf_max;
+}
+
+void buffer_release(struct buf *b) {
+	lock_acquire(buf_lock);
+	KASSERT(b->b_busy);
+	b->b_busy = false;
+	if (b->b_valid) {
+		lru_append(b);
+	} else {
+		/* a buffer_get buffer that was never filled in - drop it */
+		buf_unhash(b);
+		lru_prepend(b);
+	}
+	cv_broadcast(buf_cv, buf_lock);
+	lock_release(buf_lock);
+}
+
+void buffer_forget(struct device *dev, daddr_t block) {
+	struct buf *b;
+
+	lock_acquire(buf_lock);
+	while ((b = buf_lookup(dev, block)) != NULL && b->b_busy) {
+		cv_wait(buf_cv, buf_lock);
+	}
+	if (b != NULL) {
+		buf_unhash(b);
+		lru_remove(b);
+		lru_prepend(b);
+	}
+	lock_release(buf_lock);
+}
+
+/*
+ * Write back the dirty buffers of a device, or of every device if dev
+ * is NULL. If wait is set, wait for busy dirty buffers and stop at the
+ * first error; otherwise skip them and carry on. Pinned buffers are
+ * always skipped. Each write starts at
+ * the first block of a run of dirty blocks, so it covers as many as it
+ * can. Called with buf_lock.
+ */
+static int buf_flush(struct device *dev, bool wait) {
+	unsigned i, k;
+	int result = 0;
+
+	for (i = 0; i < buf_num; i++) {
+		struct buf *b = buf_all[i], *orig = b;
+		if (b->b_dev == NULL || (dev != NULL && b->b_dev != dev) || !b->b_dirty || b->b_pinned) continue;
+		if (b->b_busy) {
+			if (!wait) continue;
+			/* whoever has it may still be changing it - wait and look again */
+			cv_wait(buf_cv, buf_lock);
+			i--;
+			continue;
+		}
+		for (k = 1; k < BUF_MAXRUN && b->b_block > 0; k++) {
+			struct buf *prev = buf_lookup(b->b_dev, b->b_block - 1);
+			if (prev == NULL || prev->b_busy || !prev->b_dirty || prev->b_pinned) break;
+			b = prev;
+		}
+		/* write in place: it keeps its LRU position */
+		b->b_busy = true;
+		result = buf_writerun(b);
+		b->b_busy = false;
+		cv_broadcast(buf_cv, buf_lock);
+		if (result) {
+			if (wait) break;
+			result = 0;
+			continue;
+		}
+		if (b != orig) i--;    /* look again in case the run stopped short of it */
+	}
+	return result;
+}
+
+int buffer_sync(struct device *dev) {
+	int result;
+
+	lock_acquire(buf_lock);
+	result = buf_flush(dev, true);
+	lock_release(buf_lock);
+	return result;
+}
+
+int buffer_invalidate(struct device *dev, bool discard) {
+	unsigned i, j, ndiscarded = 0;
+	int result;
+
+	lock_acquire(buf_lock);
+
+	/* an earlier sync may have failed - try again, and give up if it still can't */
+	result = buf_flush(dev, true);
+	if (result && !discard) {
+		lock_release(buf_lock);
+		return result;
+	}
+	if (!discard) {
+		for (i = 0; i < buf_num; i++) {
+			if (buf_all[i]->b_dev == dev && buf_all[i]->b_pinned) {
+				lock_release(buf_lock);
+				return EBUSY;
+			}
+		}
+	}
+
+	/* cancel queued read-ahead and wait out any in progress */
+	for (i = j = 0; i < ra_count; i++) {
+		unsigned from = (ra_head + i) % BUF_RAQSIZE;
+		if (ra_queue[from].dev == dev) continue;
+		ra_queue[(ra_head + j++) % BUF_RAQSIZE] = ra_queue[from];
+	}
+	ra_count = j;
+	while (ra_dev == dev) cv_wait(buf_cv, buf_lock);
+
+	for (i = 0; i < buf_num; i++) {
+		struct buf *b = buf_all[i];
+		if (b->b_dev != dev) continue;
+		if (b->b_busy) {
+			/* only the syncer can still have it, briefly */
+			cv_wait(buf_cv, buf_lock);
+			i--;
+			continue;
+		}
+		if (b->b_dirty) ndiscarded++;
+		buf_unhash(b);
+		lru_remove(b);
+		lru_prepend(b);
+	}
+	lock_release(buf_lock);
+
+	if (ndiscarded > 0) {
+		kprintf("buffer cache: discarded %u unwritten blocks\n", ndiscarded);
+	}
+	return 0;
+}
+
+static bool ra_isqueued(struct device *dev, daddr_t block) {
+	unsigned i;
+	for (i = 0; i < ra_count; i++) {
+		unsigned k = (ra_head + i) % BUF_RAQSIZE;
+		if (ra_queue[k].dev == dev && ra_queue[k].block == block) return true;
+	}
+	return false;
+}
+
+bool buffer_readahead(struct device *dev, daddr_t block) {
+	bool queued = true;
+	lock_acquire(buf_lock);
+	if (buf_lookup(dev, block) == NULL && !ra_isqueued(dev, block)) {
+		if (ra_count < BUF_RAQSIZE) {
+			ra_queue[(ra_head + ra_count) % BUF_RAQSIZE].dev = dev;
+			ra_queue[(ra_head + ra_count) % BUF_RAQSIZE].block = block;
+			ra_count++;
+			buf_stats.raqueued++;
+			cv_signal(ra_cv, buf_lock);
+		} else {
+			queued = false;
+		}
+	}
+	lock_release(buf_lock);
+	return queued;
+}
+
+unsigned buffer_readahead_window(void) {
+	return ra_window;
+}
+
+void buffer_set_readahead_window(unsigned nblocks) {
+	ra_window = nblocks;
+}
+
+/* Whether a buffer can be had without waiting for one */
+static bool buf_haveidle(void) {
+	struct buf *b;
+	if (buf_num < buf_max) return true;
+	for (b = lru_head; b != NULL && (b->b_busy || b->b_pinned); b = b->b_next);
+	return b != NULL;
+}
+
+/*
+ * Read-ahead thread. Takes the block at the head of the queue, plus
+ * the blocks queued right behind it if they follow on from it, and
+ * reads the ones not already cached in one transfer. The buffers are
+ * marked b_ra so that a later lookup counts as a read-ahead hit. A run
+ * stops at the first block that is already cached, and when no buffer
+ * is idle, so the thread never waits while holding buffers busy.
+ */
+static void buf_reader(void *unused1, unsigned long unused2) {
+	struct buf *run[BUF_MAXRUN];
+	struct device *dev;
+	daddr_t block;
+	unsigned n, i;
+	int result;
+
+	(void) unused1;
+	(void) unused2;
+
+	lock_acquire(buf_lock);
+	while (true) {
+		while (ra_count == 0) cv_wait(ra_cv, buf_lock);
+		dev = ra_queue[ra_head].dev;
+		block = ra_queue[ra_head].block;
+		ra_head = (ra_head + 1) % BUF_RAQSIZE;
+		ra_count--;
+		ra_dev = dev;
+
+		n = 0;
+		while (true) {
+			struct buf *b;
+			result = buf_claim(dev, block, &b);
+			if (result) break;
+			if (b->b_valid) {
+				/* cached already: leave it be, and stop here */
+				b->b_busy = false;
+				lru_append(b);
+				cv_broadcast(buf_cv, buf_lock);
+				break;
+			}
+			run[n++] = b;
+			if (n == BUF_MAXRUN || ra_count == 0 ||
+			    ra_queue[ra_head].dev != dev || ra_queue[ra_head].block != block + 1 ||
+			    buf_lookup(dev, block + 1) != NULL || !buf_haveidle()) {
+				break;
+			}
+			block++;
+			ra_head = (ra_head + 1) % BUF_RAQSIZE;
+			ra_count--;
+		}
+
+		if (n > 0) {
+			lock_release(buf_lock);
+			result = buf_iorun(run, n, UIO_READ);
+			lock_acquire(buf_lock);
+			for (i = 0; i < n; i++) {
+				struct buf *b = run[i];
+				b->b_busy = false;
+				if (result) {
+					buf_unhash(b);
+					lru_prepend(b);
+				} else {
+					b->b_valid = true;
+					b->b_ra = true;
+					lru_append(b);
+				}
+			}
+		}
+		ra_dev = NULL;
+		cv_broadcast(buf_cv, buf_lock);
+	}
+}
+
+/*
+ * Syncer thread: write-behind for dirty buffers nobody is using, and
+ * a periodic file system sync.
+ */
+static void buf_syncer(void *unused1, unsigned long unused2) {
+	unsigned secs = 0;
+
+	(void) unused1;
+	(void) unused2;
+
+	while (true) {
+		clocksleep(BUF_SYNCSECS);
+		lock_acquire(buf_lock);
+		buf_flush(NULL, false);
+		lock_release(buf_lock);
+
+		secs += BUF_SYNCSECS;
+		if (secs >= BUF_FSSYNCSECS) {
+			secs = 0;
+			vfs_sync();
+		}
+	}
+}
+
+void buffer_printstats(void) {
+	unsigned i, ndirty = 0, npinned = 0, lookups;
+
+	lock_acquire(buf_lock);
+	for (i = 0; i < buf_num; i++) {
+		if (buf_all[i]->b_dirty) ndirty++;
+		if (buf_all[i]->b_pinned) npinned++;
+	}
+	lookups = buf_stats.hits + buf_stats.misses;
+	kprintf("buffer cache: %u/%u buffers, %u dirty, %u pinned\n", buf_num, buf_max, ndirty, npinned);
+	kprintf("buffer cache: %u hits, %u misses (%u%% hit rate)\n",
+		buf_stats.hits, buf_stats.misses,
+		lookups ? buf_stats.hits * 100 / lookups : 0);
+	kprintf("buffer cache: %u reads (%u blocks), %u writes (%u blocks), %u dirty evictions\n",
+		buf_stats.reads, buf_stats.rblocks, buf_stats.writes, buf_stats.wblocks,
+		buf_stats.evictions);
+	kprintf("buffer cache: read-ahead window %u, %u blocks queued, %u used, %u evicted unused\n",
+		ra_window, buf_stats.raqueued, buf_stats.rahits, buf_stats.rawasted);
+	lock_release(buf_lock);
+}
+
+void buffer_resetstats(void) {
+	lock_acquire(buf_lock);
+	bzero(&buf_stats, sizeof(buf_stats));
+	lock_release(buf_lock);
+}
@@ -237,15 +237,15 @@ null_fsync(struct vnode *v)
 }
 
 /*
- * For mmap. If you want this to do anything, you have to write it
- * yourself. Some devices may not make sense to map. Others do.
+ * For mmap. Mapped pages are filled with VOP_READ one page at a time,
+ * which most devices can't do sensibly, so none of them can be mapped.
  */
 static
 int
-dev_mmap(struct vnode *v  /* add stuff as needed */)
+dev_mmap(struct vnode *v)
 {
 	(void)v;
-	return ENOSYS;
+	return ENODEV;
 }
 
 /*
@@ -386,3 +386,16 @@ dev_uncreate_vnode(struct vnode *vn)
 	vnode_cleanup(vn);
 	kfree(vn);
 }
+
+/*
+ * Return the device a vnode made by dev_create_vnode refers to, for
+ * code (such as swap) that wants to do block I/O on it directly.
+ */
+struct device *
+dev_getdevice(struct vnode *vn)
+{
+	if (vn->vn_ops != &dev_vnode_ops) {
+		return NULL;
+	}
+	return vn->vn_data;
+}
@@ -0,0 +1,185 @@
+/*
+ * Directory name lookup cache.
+ *
+ * A fixed pool of entries, allocated at boot, each on a hash chain
+ * (while in use) and on an LRU list, least recently used first. When
+ * the pool is exhausted the entry at the head of the LRU list is
+ * reused. Every operation is short and never sleeps, so a spinlock
+ * protects the lot.
+ */
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <namecache.h>
+
+#define NC_SIZE     1024      /* entries */
+#define NC_HASHSIZE 251       /* hash chains - prime */
+
+struct ncentry {
+	struct vnode *nc_dir;      /* NULL if the entry is unused */
+	uint32_t nc_ino;           /* 0 for a negative entry */
+	int nc_slot;
+	char nc_name[NC_NAMELEN+1];
+	struct ncentry *nc_hnext;  /* hash chain */
+	struct ncentry *nc_prev;   /* LRU list */
+	struct ncentry *nc_next;
+};
+
+static struct spinlock nc_lock = SPINLOCK_INITIALIZER;
+static struct ncentry *nc_pool;
+static struct ncentry *nc_hash[NC_HASHSIZE];
+static struct ncentry *lru_head, *lru_tail;
+
+static struct {
+	unsigned hits, neghits, misses;
+	unsigned enters, replaced;     /* replaced: live entries thrown out to make room */
+} nc_stats;
+
+static void lru_remove(struct ncentry *nc) {
+	if (nc->nc_prev) nc->nc_prev->nc_next = nc->nc_next;
+	else lru_head = nc->nc_next;
+	if (nc->nc_next) nc->nc_next->nc_prev = nc->nc_prev;
+	else lru_tail = nc->nc_prev;
+	nc->nc_prev = nc->nc_next = NULL;
+}
+
+static void lru_append(struct ncentry *nc) {
+	nc->nc_prev = lru_tail;
+	nc->nc_next = NULL;
+	if (lru_tail) lru_tail->nc_next = nc;
+	else lru_head = nc;
+	lru_tail = nc;
+}
+
+static void lru_prepend(struct ncentry *nc) {
+	nc->nc_prev = NULL;
+	nc->nc_next = lru_head;
+	if (lru_head) lru_head->nc_prev = nc;
+	else lru_tail = nc;
+	lru_head = nc;
+}
+
+void namecache_bootstrap(void) {
+	unsigned i;
+
+	nc_pool = kmalloc(NC_SIZE * sizeof(struct ncentry));
+	if (nc_pool == NULL) {
+		panic("namecache_bootstrap: out of memory\n");
+	}
+	bzero(nc_pool, NC_SIZE * sizeof(struct ncentry));
+	for (i = 0; i < NC_SIZE; i++) {
+		lru_append(&nc_pool[i]);
+	}
+}
+
+static unsigned nc_hashidx(struct vnode *dir, const char *name) {
+	uint32_t h = (uint32_t) dir;
+	while (*name) h = h * 31 + (unsigned char) *name++;
+	return h % NC_HASHSIZE;
+}
+
+static struct ncentry *nc_find(struct vnode *dir, const char *name, unsigned idx) {
+	struct ncentry *nc;
+	for (nc = nc_hash[idx]; nc != NULL; nc = nc->nc_hnext) {
+		if (nc->nc_dir == dir && !strcmp(nc->nc_name, name)) return nc;
+	}
+	return NULL;
+}
+
+static void nc_unhash(struct ncentry *nc) {
+	struct ncentry **p = &nc_hash[nc_hashidx(nc->nc_dir, nc->nc_name)];
+	while (*p != nc) p = &(*p)->nc_hnext;
+	*p = nc->nc_hnext;
+	nc->nc_hnext = NULL;
+	nc->nc_dir = NULL;
+}
+
+bool namecache_lookup(struct vnode *dir, const char *name, uint32_t *ino, int *slot) {
+	struct ncentry *nc;
+
+	if (strlen(name) > NC_NAMELEN) return false;
+
+	spinlock_acquire(&nc_lock);
+	nc = nc_find(dir, name, nc_hashidx(dir, name));
+	if (nc == NULL) {
+		nc_stats.misses++;
+		spinlock_release(&nc_lock);
+		return false;
+	}
+	if (nc->nc_ino == 0) nc_stats.neghits++;
+	else nc_stats.hits++;
+	*ino = nc->nc_ino;
+	if (slot != NULL) *slot = nc->nc_slot;
+	lru_remove(nc);
+	lru_append(nc);
+	spinlock_release(&nc_lock);
+	return true;
+}
+
+void namecache_enter(struct vnode *dir, const char *name, uint32_t ino, int slot) {
+	struct ncentry *nc;
+	unsigned idx;
+
+	if (strlen(name) > NC_NAMELEN) return;
+
+	idx = nc_hashidx(dir, name);
+	spinlock_acquire(&nc_lock);
+	nc = nc_find(dir, name, idx);
+	if (nc == NULL) {
+		/* reuse the least recently used entry */
+		nc = lru_head;
+		if (nc->nc_dir != NULL) {
+			nc_stats.replaced++;
+			nc_unhash(nc);
+		}
+		strcpy(nc->nc_name, name);
+		nc->nc_dir = dir;
+		nc->nc_hnext = nc_hash[idx];
+		nc_hash[idx] = nc;
+	}
+	nc->nc_ino = ino;
+	nc->nc_slot = slot;
+	lru_remove(nc);
+	lru_append(nc);
+	nc_stats.enters++;
+	spinlock_release(&nc_lock);
+}
+
+void namecache_purge(struct vnode *dir) {
+	unsigned i;
+
+	spinlock_acquire(&nc_lock);
+	for (i = 0; i < NC_SIZE; i++) {
+		struct ncentry *nc = &nc_pool[i];
+		if (nc->nc_dir != dir) continue;
+		nc_unhash(nc);
+		lru_remove(nc);
+		lru_prepend(nc);
+	}
+	spinlock_release(&nc_lock);
+}
+
+void namecache_printstats(void) {
+	unsigned i, used = 0, lookups;
+
+	spinlock_acquire(&nc_lock);
+	for (i = 0; i < NC_SIZE; i++) {
+		if (nc_pool[i].nc_dir != NULL) used++;
+	}
+	lookups = nc_stats.hits + nc_stats.neghits + nc_stats.misses;
+	spinlock_release(&nc_lock);
+
+	/* no printing under a spinlock */
+	kprintf("name cache: %u/%u entries in use\n", used, NC_SIZE);
+	kprintf("name cache: %u hits, %u negative hits, %u misses (%u%% hit rate)\n",
+		nc_stats.hits, nc_stats.neghits, nc_stats.misses,
+		lookups ? (nc_stats.hits + nc_stats.neghits) * 100 / lookups : 0);
+	kprintf("name cache: %u entries made, %u replaced\n",
+		nc_stats.enters, nc_stats.replaced);
+}
+
+void namecache_resetstats(void) {
+	spinlock_acquire(&nc_lock);
+	bzero(&nc_stats, sizeof(nc_stats));
+	spinlock_release(&nc_lock);
+}
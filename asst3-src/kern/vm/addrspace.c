@@ -27,6 +27,8 @@
  * SUCH DAMAGE.
  */
 
+#define ASINLINE /* empty */
+
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
@@ -37,6 +39,12 @@
 #include <addrspace.h>
 #include <vm.h>
 #include <proc.h>
+#include <vnode.h>
+#include <swap.h>
+#include <textcache.h>
+
+static int as_add_region(struct addrspace *as, vaddr_t vaddr, size_t npages,
+	int readable, int writeable, struct region **ret_region);
 
 /* create a new addrspace */
 struct addrspace *as_create(void) {
@@ -45,7 +53,13 @@ struct addrspace *as_create(void) {
 
 	/* initialize as needed */
 	as->nregions = 0;
-	as->region_list = NULL;
+	regionarray_init(&as->regions);
+	as->last_region = NULL;
+	as->heap = NULL;
+	as->heap_end = 0;
+	as->asid = 0;
+	as->tlb_cpus = 0;
+	as->tlb_stale = 0;
 
 	return as;
 }
@@ -55,21 +69,37 @@ int as_copy(struct addrspace *old, struct addrspace **ret) {
 	struct addrspace *newas = as_create();
 	if (newas == NULL) return ENOMEM;
 
-	/* copy over the region list */
-	struct region *curr;
-	for (curr = old->region_list; curr != NULL; curr = curr->next) {
-		int ret = as_define_region(newas, curr->vbase, curr->npages * PAGE_SIZE, curr->readable, curr->writeable, true);
+	/* copy over the regions - old is sorted, so each one is appended */
+	unsigned num = regionarray_num(&old->regions);
+	for (unsigned i = 0; i < num; ++i) {
+		struct region *curr = regionarray_get(&old->regions, i);
+		struct region *copy;
+		int ret = as_add_region(newas, curr->vbase, curr->npages, curr->readable, curr->writeable, &copy);
 		if (ret) {
-			/* error in as_define_region() */
+			/* error in as_add_region() */
 			as_destroy(newas);
 			return ret;
 		}
+		if (curr == old->heap) newas->heap = copy;
+
+		/* the child shares the file, but gets copy-on-write copies of the pages already read in */
+		if (curr->file != NULL) {
+			VOP_INCREF(curr->file);
+			copy->file = curr->file;
+			copy->file_offset = curr->file_offset;
+			copy->file_start = curr->file_start;
+			copy->file_end = curr->file_end;
+			copy->file_shared = curr->file_shared;
+			copy->text = curr->text;
+			if (copy->text != NULL) textcache_incref(copy->text);
+		}
 	}
 	KASSERT(newas->nregions == old->nregions);
+	newas->heap_end = old->heap_end;
 
 	/* copy region data from the old address space */
-	for (curr = newas->region_list; curr != NULL; curr = curr->next) {
-		int ret = copy_region(curr, old, newas);
+	for (unsigned i = 0; i < num; ++i) {
+		int ret = copy_region(regionarray_get(&newas->regions, i), old, newas);
 		if (ret) {
 			/* error in copy_region() */
 			as_destroy(newas);
@@ -78,68 +108,56 @@ int as_copy(struct addrspace *old, struct addrspace **ret) {
 	}
 
 	*ret = newas;
-	as_activate();
+	vm_forget_tlb(old); /* the old entries that were writeable are now copy-on-write */
 	return 0;
 }
 
 /* free memory associated with an addrspace and release pages and frames */
 void as_destroy(struct addrspace *as) {
-	/* iterate through as->region_list and free each region */
-	struct region *curr = as->region_list;
-	while (curr != NULL) {
+	/* iterate through as->regions and free each region */
+	unsigned num = regionarray_num(&as->regions);
+	for (unsigned i = 0; i < num; ++i) {
+		struct region *curr = regionarray_get(&as->regions, i);
+
+		/* pages written through an mmap() go back to the file - there is nobody left to report errors to */
+		if (curr->file != NULL) (void) writeback_region(as, curr);
 		free_region(as, curr->vbase, curr->npages); /* free pages & frames */
+		if (curr->text != NULL) textcache_put(curr->text);
+		if (curr->file != NULL) VOP_DECREF(curr->file);
 
 		/* free memory used by region struct */
-		struct region *to_free = curr;
-		curr = curr->next;
-		kfree(to_free);
+		kfree(curr);
 	}
+	regionarray_setsize(&as->regions, 0);
+	regionarray_cleanup(&as->regions);
 
+	/* no tlb flush - the asid of as is never activated again, so its entries can't be used */
 	kfree(as);
-	as_activate();
 }
 
-/* invalidate all tlb entries */
+/* load the current addrspace's asid - its tlb entries can stay loaded across switches */
 void as_activate(void) {
 	struct addrspace *as = proc_getas();
 	if (as == NULL) return;
-
-	/* disable interrupts on this cpu while frobbing the tlb */
-	int spl = splhigh();
-
-	/* invalidate all tlb entries */
-	for (int i = 0; i < NUM_TLB; i++) {
-		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
-	}
-	splx(spl);
+	vm_activate(as);
 }
 
-/* invalidate all tlb entries just in case */
+/* nothing to do - tlb entries are tagged with their addrspace's asid */
 void as_deactivate(void) {
-	as_activate();
 }
 
 /*
- * Set up a segment at virtual address vaddr of size memsize. The
- * segment in memory extends from vaddr up to (but not including)
- * vaddr + memsize.
+ * Add a region of npages pages at the page-aligned vaddr to as->regions,
+ * keeping it sorted, and hand it back in ret_region if that is not NULL.
+ * Only the heap region may have no pages.
  */
-int as_define_region(struct addrspace *as, vaddr_t vaddr, size_t memsize,
-int readable, int writeable, int executable) {
-	(void) executable; /* unused */
+static int as_add_region(struct addrspace *as, vaddr_t vaddr, size_t npages,
+int readable, int writeable, struct region **ret_region) {
+	KASSERT((vaddr & PAGE_FRAME) == vaddr);
 
 	/* allocate space for new region and set up its fields */
 	struct region *new_region = kmalloc(sizeof(struct region));
 	if (new_region == NULL) return ENOMEM;
-	size_t npages;
-
-	/* align the region base and length */
-	memsize += vaddr & ~(vaddr_t)PAGE_FRAME;
-	vaddr &= PAGE_FRAME;
-	memsize = (memsize + PAGE_SIZE - 1) & PAGE_FRAME;
-
-	npages = memsize / PAGE_SIZE;
-	KASSERT(npages != 0);
 
 	/* initialize all fields of the region struct */
 	new_region->vbase     = vaddr;
@@ -147,26 +165,80 @@ int readable, int writeable, int executable) {
 	new_region->readable  = readable;
 	new_region->writeable = writeable;
 	new_region->can_write = writeable;
-	new_region->next      = NULL;
+	new_region->file      = NULL;
+	new_region->file_offset = 0;
+	new_region->file_start = 0;
+	new_region->file_end  = 0;
+	new_region->file_shared = false;
+	new_region->text      = NULL;
+
+	/* insert new_region into as->regions, keeping it sorted by vbase */
+	unsigned num = regionarray_num(&as->regions);
+	int ret = regionarray_setsize(&as->regions, num + 1);
+	if (ret) {
+		kfree(new_region);
+		return ret;
+	}
+	unsigned i;
+	for (i = num; i > 0 && regionarray_get(&as->regions, i - 1)->vbase > vaddr; --i) {
+		regionarray_set(&as->regions, i, regionarray_get(&as->regions, i - 1));
+	}
+	regionarray_set(&as->regions, i, new_region);
 
 	as->nregions++;
+	if (ret_region != NULL) *ret_region = new_region;
+
+	return 0;
+}
 
-	/* append new_region to as->region_list */
-	struct region *curr_region = as->region_list;
-	if (curr_region != NULL) {
-		struct region *old_head = as->region_list;
-		new_region->next = old_head;
+/*
+ * Take reg out of as->regions and free it, dropping its file reference.
+ * Its pages must already have been freed.
+ */
+static void as_remove_region(struct addrspace *as, struct region *reg) {
+	unsigned num = regionarray_num(&as->regions);
+	unsigned i = 0;
+	while (regionarray_get(&as->regions, i) != reg) {
+		i++;
+		KASSERT(i < num);
+	}
+	for (; i + 1 < num; ++i) {
+		regionarray_set(&as->regions, i, regionarray_get(&as->regions, i + 1));
 	}
-	as->region_list = new_region;
+	regionarray_setsize(&as->regions, num - 1); /* shrinking can't fail */
 
-	return 0;
+	as->nregions--;
+	if (as->last_region == reg) as->last_region = NULL;
+	if (reg->text != NULL) textcache_put(reg->text);
+	if (reg->file != NULL) VOP_DECREF(reg->file);
+	kfree(reg);
+}
+
+/*
+ * Set up a segment at virtual address vaddr of size memsize. The
+ * segment in memory extends from vaddr up to (but not including)
+ * vaddr + memsize.
+ */
+int as_define_region(struct addrspace *as, vaddr_t vaddr, size_t memsize,
+int readable, int writeable, int executable) {
+	(void) executable; /* unused */
+
+	/* align the region base and length */
+	memsize += vaddr & ~(vaddr_t)PAGE_FRAME;
+	vaddr &= PAGE_FRAME;
+	memsize = (memsize + PAGE_SIZE - 1) & PAGE_FRAME;
+
+	size_t npages = memsize / PAGE_SIZE;
+	KASSERT(npages != 0);
+
+	return as_add_region(as, vaddr, npages, readable, writeable, NULL);
 }
 
 /* make all regions writeable for the purposes of loading into read-only regions initially, e.g. code */
 int as_prepare_load(struct addrspace *as) {
 	/*
 	 * initial stack pointer will be USERSTACK, see as_define_stack()
-	 * base of user stack will be NUM_STACK_PAGES (16 pages) below this
+	 * base of user stack will be NUM_STACK_PAGES (32 pages) below this
 	 * this needs to be set before the possiblity of vm_fault() being triggered
 	 * vm_fault() maybe triggered before as_define_stack() is called
 	 * but not before as_prepare_load() is called
@@ -175,28 +247,50 @@ int as_prepare_load(struct addrspace *as) {
 	if (ret) return ret;
 
 	/* set writable flag to true for all regions temporarily */
-	for (struct region *curr = as->region_list; curr != NULL; curr = curr->next) {
-		curr->writeable = true;
+	unsigned num = regionarray_num(&as->regions);
+	for (unsigned i = 0; i < num; ++i) {
+		regionarray_get(&as->regions, i)->writeable = true;
 	}
 
 	return 0;
 }
 
-/* reset real permissions in all regions */
+/*
+ * Reset real permissions in all regions, and start an empty heap after the last segment.
+ * Segments left to as_map_segment() have no pages yet, so only the ones exec loaded are walked.
+ */
 int as_complete_load(struct addrspace *as) {
-	for (struct region *curr = as->region_list; curr != NULL; curr = curr->next) {
+	vaddr_t stack_base = USERSTACK - PAGE_SIZE * NUM_STACK_PAGES;
+	vaddr_t heap_base = 0;
+	bool flipped = false;
+	unsigned num = regionarray_num(&as->regions);
+	for (unsigned i = 0; i < num; ++i) {
+		struct region *curr = regionarray_get(&as->regions, i);
+
+		/* the heap starts where the highest segment below the stack ends */
+		if (curr->vbase < stack_base && curr->vbase + curr->npages * PAGE_SIZE > heap_base) {
+			heap_base = curr->vbase + curr->npages * PAGE_SIZE;
+		}
+
 		/* reset write flag to real write flag */
 		curr->writeable = curr->can_write;
 
 		/* flip the dirty bit in the ptable entry for all entires for pages in this region */
-		if (!curr->can_write) {
+		if (!curr->can_write && curr->file == NULL) {
 			for (vaddr_t addr = curr->vbase; addr != curr->vbase + curr->npages * PAGE_SIZE; addr += PAGE_SIZE) {
 				make_page_read_only(addr);
 			}
+			flipped = true;
 		}
 	}
 
-	as_activate(); /* flush the tlb since some entries are now read-only */
+	if (flipped) vm_forget_tlb(as); /* some entries that were loaded writeable are now read-only */
+
+	/* the heap has no pages until the first sbrk() */
+	KASSERT(as->heap == NULL && heap_base != 0 && heap_base <= stack_base);
+	int ret = as_add_region(as, heap_base, 0, true, true, &as->heap);
+	if (ret) return ret;
+	as->heap_end = heap_base;
 	return 0;
 }
 
@@ -206,3 +300,219 @@ int as_define_stack(struct addrspace *as, vaddr_t *stackptr) {
 	*stackptr = USERSTACK;
 	return 0;
 }
+
+/*
+ * Find the region containing vaddr, or NULL if vaddr is not in any region.
+ * The last region found is cached, since consecutive faults usually hit the
+ * same region; otherwise binary search the sorted regions array.
+ */
+struct region *as_find_region(struct addrspace *as, vaddr_t vaddr) {
+	/* assert that the address space has been set up properly */
+	unsigned num = regionarray_num(&as->regions);
+	KASSERT(num != 0);
+	KASSERT(as->nregions == num);
+
+	struct region *reg = as->last_region;
+	if (reg != NULL && vaddr >= reg->vbase && vaddr < reg->vbase + reg->npages * PAGE_SIZE) {
+		return reg;
+	}
+
+	/* find the first region starting above vaddr - the one before it may contain vaddr */
+	unsigned lo = 0, hi = num;
+	while (lo < hi) {
+		unsigned mid = lo + (hi - lo) / 2;
+		if (regionarray_get(&as->regions, mid)->vbase <= vaddr) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if (lo == 0) return NULL;
+	reg = regionarray_get(&as->regions, lo - 1);
+
+	/* assert that region is set up correctly - only the heap may be empty */
+	KASSERT(reg->vbase != 0);
+	KASSERT(reg->npages != 0 || reg == as->heap);
+	KASSERT((reg->vbase & PAGE_FRAME) == reg->vbase);
+
+	/* check if vaddr is in a valid region */
+	if (vaddr >= reg->vbase + reg->npages * PAGE_SIZE) return NULL;
+	as->last_region = reg;
+	return reg;
+}
+
+/*
+ * Move the break of as by amount bytes and hand back the old break.
+ * The heap region always covers the pages up to the break, rounded up.
+ * Growing only extends the region - vm_fault() gives the new pages frames
+ * when they are first touched, like any other page. Shrinking frees the
+ * frames and swap slots of the pages that are given back, then drops the
+ * tlb entries of as so none of them can be used again.
+ * The heap may not run into the region above it (a mapped file or the stack),
+ * and may not grow bigger than memory and swap put together, since it could
+ * never all be resident then.
+ */
+int as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *oldbreak) {
+	struct region *heap = as->heap;
+	if (heap == NULL) return ENOMEM; /* no program loaded */
+	vaddr_t heap_end = as->heap_end;
+	vaddr_t new_end;
+
+	/* the region above the heap - there is always one, the stack */
+	vaddr_t limit = USERSTACK;
+	unsigned num = regionarray_num(&as->regions);
+	for (unsigned i = 0; i < num; ++i) {
+		struct region *curr = regionarray_get(&as->regions, i);
+		if (curr->vbase > heap->vbase && curr->vbase < limit) limit = curr->vbase;
+	}
+
+	if (amount >= 0) {
+		if ((vaddr_t) amount > limit - heap_end) return ENOMEM;
+		new_end = heap_end + amount;
+	} else {
+		if ((vaddr_t) 0 - (vaddr_t) amount > heap_end - heap->vbase) return EINVAL;
+		new_end = heap_end + amount;
+	}
+
+	size_t npages = (new_end - heap->vbase + PAGE_SIZE - 1) / PAGE_SIZE;
+	if (npages > heap->npages) {
+		uint32_t swap_used, swap_total;
+		swap_usage(&swap_used, &swap_total);
+		if (npages > total_frames + swap_total) return ENOMEM;
+	} else if (npages < heap->npages) {
+		/* pages given back must not be reachable through the tlb */
+		free_region(as, heap->vbase + npages * PAGE_SIZE, heap->npages - npages);
+		vm_forget_tlb(as);
+	}
+
+	heap->npages = npages;
+	as->heap_end = new_end;
+	*oldbreak = heap_end;
+	return 0;
+}
+
+/*
+ * Leave the pages of the segment at vaddr, already defined with as_define_region(),
+ * to be read in by vm_fault() the first time they are touched, instead of having
+ * exec load the whole segment. Its first filesize bytes come from file at offset;
+ * the rest of the region is zero-filled, and nothing is ever written back.
+ */
+int as_map_segment(struct addrspace *as, vaddr_t vaddr, struct vnode *file, off_t offset,
+size_t filesize) {
+	if (filesize == 0) return 0; /* all zero-fill, e.g. bss */
+	struct region *reg = as_find_region(as, vaddr & PAGE_FRAME);
+	KASSERT(reg != NULL);
+	if (reg->file != NULL || vaddr + filesize > reg->vbase + reg->npages * PAGE_SIZE) {
+		return ENOEXEC; /* two segments in one region */
+	}
+
+	VOP_INCREF(file);
+	reg->file = file;
+	reg->file_offset = offset;
+	reg->file_start = vaddr;
+	reg->file_end = vaddr + filesize;
+	reg->file_shared = false;
+	if (!reg->can_write && vm_textcache) reg->text = textcache_get(file); /* NULL just means no sharing */
+	return 0;
+}
+
+/*
+ * Map length bytes of file, starting at the page-aligned offset, and hand
+ * back the address of the mapping. It goes in the highest gap between the
+ * heap and the stack that is big enough, so the heap keeps the room right
+ * above it to grow into. No page is read until vm_fault() first touches it.
+ */
+int as_mmap(struct addrspace *as, struct vnode *file, off_t offset, size_t length,
+int writeable, vaddr_t *addr) {
+	KASSERT(length != 0 && offset % PAGE_SIZE == 0);
+	struct region *heap = as->heap;
+	if (heap == NULL) return ENOMEM; /* no program loaded */
+	size_t npages = length / PAGE_SIZE + (length % PAGE_SIZE != 0);
+	if (npages > USERSTACK / PAGE_SIZE) return ENOMEM;
+
+	/* walk down from the stack, looking at the gap below each region */
+	vaddr_t vbase = 0;
+	for (unsigned i = regionarray_num(&as->regions) - 1; i > 0; --i) {
+		struct region *below = regionarray_get(&as->regions, i - 1);
+		vaddr_t gap_base = below->vbase + below->npages * PAGE_SIZE;
+		/* never start a mapping at the base of an empty heap - as_sbrk() would grow over it */
+		if (below == heap && below->npages == 0) gap_base += PAGE_SIZE;
+		vaddr_t gap_top = regionarray_get(&as->regions, i)->vbase;
+		if (gap_top > gap_base && gap_top - gap_base >= npages * PAGE_SIZE) {
+			vbase = gap_top - npages * PAGE_SIZE;
+			break;
+		}
+		if (below == heap) break; /* nothing below the heap is free */
+	}
+	if (vbase == 0) return ENOMEM;
+
+	struct region *reg;
+	int ret = as_add_region(as, vbase, npages, true, writeable, &reg);
+	if (ret) return ret;
+	VOP_INCREF(file);
+	reg->file = file;
+	reg->file_offset = offset;
+	reg->file_start = vbase;
+	reg->file_end = vbase + npages * PAGE_SIZE;
+	reg->file_shared = true;
+
+	*addr = vbase;
+	return 0;
+}
+
+/*
+ * Remove the mapping that starts at addr. Pages written through it are
+ * written back to the file first; if that fails the mapping is left alone.
+ */
+int as_munmap(struct addrspace *as, vaddr_t addr) {
+	struct region *reg = as_find_region(as, addr);
+	if (reg == NULL || reg->file == NULL || !reg->file_shared || reg->vbase != addr) return EINVAL;
+
+	int ret = writeback_region(as, reg);
+	if (ret) return ret;
+
+	/* the pages must not be reachable through the tlb once their frames are freed */
+	free_region(as, reg->vbase, reg->npages);
+	vm_forget_tlb(as);
+	as_remove_region(as, reg);
+	return 0;
+}
+
+/*
+ * Write back the pages written through every mapping of file in as.
+ */
+int as_msync(struct addrspace *as, struct vnode *file) {
+	unsigned num = regionarray_num(&as->regions);
+	for (unsigned i = 0; i < num; ++i) {
+		struct region *curr = regionarray_get(&as->regions, i);
+		if (curr->file != file) continue;
+		int ret = writeback_region(as, curr);
+		if (ret) return ret;
+	}
+	return 0;
+}
+
+/*
+ * Read in the file-backed pages of the user buffer [buf, buf + len) that have
+ * never been touched. The file system copies to and from user memory while
+ * holding the vnode's lock and a busy buffer, so a fault that reads a page of
+ * a mapping or program segment there could come back into the same file and
+ * deadlock. Afterwards, faults on the buffer only ever swap pages in.
+ * Parts of the buffer outside any region are left for the copy to fail on.
+ */
+int as_prefault(struct addrspace *as, userptr_t buf, size_t len) {
+	vaddr_t start = (vaddr_t) buf;
+	vaddr_t end = start + len;
+	if (end < start || end > USERSPACETOP) end = USERSPACETOP;
+
+	unsigned num = regionarray_num(&as->regions);
+	for (unsigned i = 0; i < num; ++i) {
+		struct region *curr = regionarray_get(&as->regions, i);
+		vaddr_t rstart = curr->vbase;
+		vaddr_t rend = curr->vbase + curr->npages * PAGE_SIZE;
+		if (curr->file == NULL || rend <= start || rstart >= end) continue;
+		int ret = prefault_region(as, curr, (start > rstart) ? start : rstart, (end < rend) ? end : rend);
+		if (ret) return ret;
+	}
+	return 0;
+}
@@ -2,48 +2,413 @@
 #include <kern/errno.h>
 #include <lib.h>
 #include <thread.h>
+#include <current.h>
+#include <cpu.h>
+#include <membar.h>
 #include <addrspace.h>
 #include <vm.h>
 
 ftable_entry fhead;
 struct frame_table_entry *ftable;
+uint32_t total_frames = 0;
+uint32_t nfree_frames = 0;
+static uint32_t clock_hand = 0; /* next frame considered for eviction */
+static uint32_t run_hint = 0; /* where the next search for a multi-page run starts */
 static struct spinlock stealmem_lock = SPINLOCK_INITIALIZER;
 
 /*
- * Return a kernel virtual address, not a physical
- * address for some newly-allocated frame.
- * Only one frame can be allocated at a time.
+ * Return the frame table entry for a kernel virtual address.
  */
-vaddr_t alloc_kpages(unsigned int npages) {
-	if (npages != 1) return 0;
-	paddr_t addr;
-	spinlock_acquire(&stealmem_lock);
-	if (ftable == 0) {
-		/* use ram_stealmem if ftable isn't initialised */
-		addr = ram_stealmem(npages);
+static ftable_entry kvaddr_to_frame(vaddr_t addr) {
+	return (ftable_entry) (KVADDR_TO_PADDR(addr) / PAGE_SIZE + ftable);
+}
+
+/*
+ * Add a frame to the head of the free list.
+ */
+static void freelist_push(ftable_entry entry) {
+	entry->prev = NULL;
+	entry->next = fhead;
+	if (fhead != NULL) fhead->prev = entry;
+	fhead = entry;
+	nfree_frames++;
+}
+
+/*
+ * Remove a frame from anywhere in the free list.
+ */
+static void freelist_unlink(ftable_entry entry) {
+	if (entry->prev != NULL) {
+		entry->prev->next = entry->next;
 	} else {
-		if (fhead == NULL) {
+		KASSERT(fhead == entry);
+		fhead = entry->next;
+	}
+	if (entry->next != NULL) entry->next->prev = entry->prev;
+	nfree_frames--;
+}
+
+/*
+ * Take a free frame off the free list and give it a single reference.
+ */
+static void frame_claim(ftable_entry entry, uint32_t run) {
+	KASSERT(entry->refcount == 0);
+	freelist_unlink(entry);
+	entry->refcount = 1;
+	entry->run = run;
+	entry->referenced = 0;
+	entry->busy = 0;
+	entry->owner = NULL;
+}
+
+/*
+ * Find npages physically contiguous free frames, first fit starting from
+ * run_hint, and claim them. The frame table refcounts double as the free
+ * bitmap. Returns the first frame, or NULL if there is no long enough run.
+ */
+static ftable_entry alloc_run(uint32_t npages) {
+	uint32_t start = run_hint, len = 0;
+	for (uint32_t scanned = 0; scanned < total_frames + npages; ++scanned) {
+		uint32_t i = (run_hint + scanned) % total_frames;
+		if (i == 0) len = 0; /* runs can't wrap around the end of memory */
+		if (ftable[i].refcount != 0) {
+			len = 0;
+			continue;
+		}
+		if (len == 0) start = i;
+		if (++len == npages) {
+			for (uint32_t j = 0; j < npages; ++j) {
+				frame_claim(&ftable[start + j], j == 0 ? npages : 0);
+			}
+			run_hint = (start + npages) % total_frames;
+			return &ftable[start];
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Move up to n frames from the global free list into the frame cache of c.
+ * A cached frame keeps the single reference it was claimed with, now held by
+ * the cache, so neither the clock nor the multi-page search will touch it.
+ * Requires the frame cache lock of c and stealmem_lock.
+ */
+static void framecache_fill(struct cpu *c, unsigned n) {
+	while (n-- > 0 && fhead != NULL) {
+		ftable_entry entry = fhead;
+		frame_claim(entry, 1);
+		entry->next = c->c_frames;
+		c->c_frames = entry;
+		c->c_nframes++;
+	}
+}
+
+/*
+ * Move up to n frames from the frame cache of c back onto the global free list.
+ * Requires the frame cache lock of c and stealmem_lock.
+ */
+static void framecache_drain(struct cpu *c, unsigned n) {
+	while (n-- > 0 && c->c_frames != NULL) {
+		ftable_entry entry = c->c_frames;
+		c->c_frames = entry->next;
+		c->c_nframes--;
+		entry->refcount = 0;
+		entry->run = 0;
+		freelist_push(entry);
+	}
+}
+
+/*
+ * Return the frames cached on every cpu to the global free list, so a multi-page
+ * run or the last few free frames can be found. Returns true if any frames moved.
+ */
+static bool framecache_drain_all(void) {
+	bool drained = false;
+	struct cpu *c;
+	for (unsigned i = 0; (c = cpu_getnum(i)) != NULL; ++i) {
+		spinlock_acquire(&c->c_frames_lock);
+		if (c->c_nframes > 0) {
+			drained = true;
+			spinlock_acquire(&stealmem_lock);
+			framecache_drain(c, c->c_nframes);
 			spinlock_release(&stealmem_lock);
-			return 0; /* out of frames */
 		}
+		spinlock_release(&c->c_frames_lock);
+	}
+	return drained;
+}
 
-		/* fhead->addr is stored as 20 bits so we need to shift it to form a paddr_t */
-		addr = (paddr_t)(fhead->addr << PAGE_BITS);
-		fhead = fhead->next;
+/*
+ * Take a frame from the frame cache of the current cpu, refilling the cache
+ * with a batch from the global free list if it is empty.
+ * If the thread migrates after reading curcpu the cache of the old cpu is
+ * used instead, which is still safe since every cache has its own lock.
+ */
+static ftable_entry framecache_get(void) {
+	struct cpu *c = curcpu->c_self;
+	spinlock_acquire(&c->c_frames_lock);
+	if (c->c_frames != NULL) {
+		c->c_frame_hits++;
+	} else {
+		c->c_frame_misses++;
+		spinlock_acquire(&stealmem_lock);
+		framecache_fill(c, FRAMECACHE_BATCH);
+		spinlock_release(&stealmem_lock);
+	}
+
+	ftable_entry entry = c->c_frames;
+	if (entry != NULL) {
+		c->c_frames = entry->next;
+		c->c_nframes--;
+		entry->referenced = 0;
 	}
+	spinlock_release(&c->c_frames_lock);
+	return entry;
+}
+
+/*
+ * Put a frame holding a single reference into the frame cache of c,
+ * draining a batch to the global free list first if the cache is full.
+ * Requires the frame cache lock of c, and stealmem_lock if the cache is full.
+ */
+static void framecache_put(struct cpu *c, ftable_entry entry) {
+	if (c->c_nframes == FRAMECACHE_SIZE) framecache_drain(c, FRAMECACHE_BATCH);
+	entry->next = c->c_frames;
+	c->c_frames = entry;
+	c->c_nframes++;
+}
+
+/*
+ * Allocate npages frames - from the frame cache of this cpu for a single frame,
+ * or with a search of the frame table for a contiguous run.
+ */
+static ftable_entry alloc_frames(unsigned npages) {
+	if (npages == 1) return framecache_get();
+	spinlock_acquire(&stealmem_lock);
+	ftable_entry entry = alloc_run(npages);
 	spinlock_release(&stealmem_lock);
-	if (addr == 0) return 0;
-	return PADDR_TO_KVADDR(addr);
+	return entry;
+}
+
+/*
+ * Return a kernel virtual address, not a physical
+ * address for some newly-allocated run of npages frames.
+ * Single frames come from a per-cpu cache in O(1), only taking the
+ * global lock to refill the cache in batches; longer runs are found
+ * by scanning the frame table.
+ * The frames start with a single reference.
+ */
+vaddr_t alloc_kpages(unsigned int npages) {
+	if (npages == 0 || npages > FRAME_MAX_RUN) return 0;
+	if (ftable == 0) {
+		/* use ram_stealmem if ftable isn't initialised */
+		spinlock_acquire(&stealmem_lock);
+		paddr_t addr = ram_stealmem(npages);
+		spinlock_release(&stealmem_lock);
+		if (addr == 0) return 0;
+		return PADDR_TO_KVADDR(addr);
+	}
+
+	/* the frames we need may be sitting in the caches of other cpus */
+	ftable_entry entry = alloc_frames(npages);
+	if (entry == NULL && framecache_drain_all()) entry = alloc_frames(npages);
+	if (entry == NULL) return 0; /* out of frames */
+
+	/* entry->addr is stored as 20 bits so we need to shift it to form a paddr_t */
+	return PADDR_TO_KVADDR((paddr_t) entry->addr << PAGE_BITS);
 }
 
 /*
- * Free the page at addr and set it to be the new head, pointing next to the old head.
+ * Drop a reference to the pages at addr. Once the last reference to a single
+ * frame is gone it goes into the frame cache of this cpu; the frames of a
+ * longer run go back on the global free list.
  * The addr must be a kernel virtual address, not a physical address.
  */
 void free_kpages(vaddr_t addr) {
+	ftable_entry entry = kvaddr_to_frame(addr);
+	struct cpu *c = curcpu->c_self;
+	spinlock_acquire(&c->c_frames_lock);
+
+	/*
+	 * A lone frame with one reference and no owner is a kernel page nobody else
+	 * can reach - frame_share() needs a second reference and the clock skips frames
+	 * without an owner - so it can be cached without the global lock. The refcount
+	 * is read first, since once it is 1 the owner can only be changed by us.
+	 */
+	if (entry->run == 1 && entry->refcount == 1) {
+		membar_load_load();
+		if (entry->owner == NULL && c->c_nframes < FRAMECACHE_SIZE) {
+			framecache_put(c, entry);
+			spinlock_release(&c->c_frames_lock);
+			zeropool_frames_freed(); /* a full cache spills to the free list */
+			return;
+		}
+	}
+
+	spinlock_acquire(&stealmem_lock);
+	KASSERT(entry->refcount > 0);
+	KASSERT(entry->run != 0); /* must be the first frame of a run */
+	entry->refcount--;
+	if (entry->refcount == 0 && entry->run == 1) {
+		/* the cache takes over the last reference */
+		entry->refcount = 1;
+		entry->owner = NULL;
+		entry->busy = 0;
+		framecache_put(c, entry);
+	} else if (entry->refcount == 0) {
+		uint32_t run = entry->run;
+		for (uint32_t i = 0; i < run; ++i) {
+			entry[i].refcount = 0;
+			entry[i].run = 0;
+			entry[i].owner = NULL;
+			freelist_push(&entry[i]);
+		}
+	}
+	spinlock_release(&stealmem_lock);
+	spinlock_release(&c->c_frames_lock);
+	zeropool_frames_freed();
+}
+
+/*
+ * Report how many frames sit in the per-cpu frame caches, and how many
+ * single-frame allocations were served from a cache or had to refill it.
+ */
+void framecache_stats(uint32_t *cached, uint32_t *hits, uint32_t *misses) {
+	struct cpu *c;
+	*cached = *hits = *misses = 0;
+	for (unsigned i = 0; (c = cpu_getnum(i)) != NULL; ++i) {
+		spinlock_acquire(&c->c_frames_lock);
+		*cached += c->c_nframes;
+		*hits += c->c_frame_hits;
+		*misses += c->c_frame_misses;
+		spinlock_release(&c->c_frames_lock);
+	}
+}
+void framecache_resetstats(void) {
+	struct cpu *c;
+	for (unsigned i = 0; (c = cpu_getnum(i)) != NULL; ++i) {
+		spinlock_acquire(&c->c_frames_lock);
+		c->c_frame_hits = 0;
+		c->c_frame_misses = 0;
+		spinlock_release(&c->c_frames_lock);
+	}
+}
+
+/*
+ * Add a reference to the frame at addr so another page can map it.
+ * Returns false if the frame already has FRAME_MAX_REFS references,
+ * in which case the caller should copy it instead.
+ */
+bool frame_share(vaddr_t addr) {
+	spinlock_acquire(&stealmem_lock);
+	ftable_entry entry = kvaddr_to_frame(addr);
+	KASSERT(entry->refcount > 0);
+	bool shared = entry->refcount < FRAME_MAX_REFS;
+	if (shared) entry->refcount++;
+	spinlock_release(&stealmem_lock);
+	return shared;
+}
+
+/*
+ * Return the number of pages mapping the frame at addr.
+ */
+unsigned frame_refcount(vaddr_t addr) {
+	spinlock_acquire(&stealmem_lock);
+	unsigned refcount = kvaddr_to_frame(addr)->refcount;
+	spinlock_release(&stealmem_lock);
+	return refcount;
+}
+
+/*
+ * Record the user page mapping the frame at addr, so the frame can be evicted.
+ * A NULL as marks the frame as having no known owner, which also makes it ineligible.
+ */
+void frame_set_owner(vaddr_t addr, struct addrspace *as, vaddr_t vaddr) {
+	spinlock_acquire(&stealmem_lock);
+	ftable_entry entry = kvaddr_to_frame(addr);
+	entry->owner = as;
+	entry->vpage = vaddr >> PAGE_BITS;
+	entry->referenced = 1;
+	spinlock_release(&stealmem_lock);
+}
+
+/*
+ * Forget the owner of the frame at addr if it is as.
+ */
+void frame_disown(vaddr_t addr, struct addrspace *as) {
 	spinlock_acquire(&stealmem_lock);
-	ftable_entry old_head = fhead;
-	fhead = (ftable_entry) (KVADDR_TO_PADDR(addr) / PAGE_SIZE + ftable);
-	fhead->next = old_head;
+	ftable_entry entry = kvaddr_to_frame(addr);
+	if (entry->owner == as) entry->owner = NULL;
+	spinlock_release(&stealmem_lock);
+}
+
+/*
+ * Make the page at vaddr in as the owner of the frame at addr if the frame has no
+ * known owner and that page is its only mapping, e.g. a program page whose other
+ * sharers have gone. Called on tlb refills, so the unlocked check skips the lock
+ * for the usual frame that already has an owner.
+ */
+void frame_adopt(vaddr_t addr, struct addrspace *as, vaddr_t vaddr) {
+	ftable_entry entry = kvaddr_to_frame(addr);
+	if (entry->owner != NULL || entry->refcount != 1) return;
+	spinlock_acquire(&stealmem_lock);
+	if (entry->owner == NULL && entry->refcount == 1) {
+		entry->owner = as;
+		entry->vpage = vaddr >> PAGE_BITS;
+	}
+	spinlock_release(&stealmem_lock);
+}
+
+/*
+ * Note that the frame at addr was just used. No lock is taken, since this
+ * is called on every tlb refill and a lost update only costs the page its second chance.
+ */
+void frame_set_referenced(vaddr_t addr) {
+	kvaddr_to_frame(addr)->referenced = 1;
+}
+
+/*
+ * Pick a frame to evict with the clock (second chance) algorithm.
+ * Only user frames with a single known owner are considered; a referenced frame
+ * has its bit cleared and is skipped once. The frame is marked busy and its
+ * owner and virtual address are handed back. Returns 0 if no frame is eligible.
+ */
+vaddr_t frame_choose_victim(struct addrspace **as, vaddr_t *vaddr) {
+	vaddr_t victim = 0;
+	spinlock_acquire(&stealmem_lock);
+
+	/* two sweeps - the first may only clear referenced bits */
+	for (uint32_t i = 0; i < total_frames * 2; ++i) {
+		ftable_entry entry = &ftable[clock_hand];
+		clock_hand = (clock_hand + 1) % total_frames;
+		if (entry->refcount != 1 || entry->owner == NULL || entry->busy) continue;
+		if (entry->referenced) {
+			entry->referenced = 0;
+			continue;
+		}
+
+		entry->busy = 1;
+		*as = entry->owner;
+		*vaddr = (vaddr_t) entry->vpage << PAGE_BITS;
+		victim = PADDR_TO_KVADDR((paddr_t) entry->addr << PAGE_BITS);
+		break;
+	}
+
+	spinlock_release(&stealmem_lock);
+	return victim;
+}
+
+/*
+ * Finish with a frame returned by frame_choose_victim(), forgetting its owner
+ * if it was evicted or the owner turned out to be stale. If the owner freed the
+ * frame in the meantime it may already have been reallocated, and is left alone.
+ */
+void frame_release_victim(vaddr_t addr, bool forget_owner) {
+	spinlock_acquire(&stealmem_lock);
+	ftable_entry entry = kvaddr_to_frame(addr);
+	if (entry->busy) {
+		entry->busy = 0;
+		if (forget_owner) entry->owner = NULL;
+	}
 	spinlock_release(&stealmem_lock);
 }
@@ -0,0 +1,110 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <bitmap.h>
+#include <spinlock.h>
+#include <uio.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <device.h>
+#include <blkio.h>
+#include <vm.h>
+#include <swap.h>
+
+static struct vnode *swap_vnode = NULL; /* raw swap device, NULL if there is no swap */
+static struct device *swap_dev = NULL; /* the device itself, for blkio() */
+static struct bitmap *swap_map = NULL; /* one bit per slot, set if in use */
+static uint32_t swap_nslots = 0; /* total slots on the device */
+static uint32_t swap_nused = 0; /* slots currently in use */
+static struct spinlock swap_map_lock = SPINLOCK_INITIALIZER;
+
+/*
+ * Attach the swap device and size the slot bitmap to fit it.
+ */
+void swap_bootstrap(void) {
+	struct vnode *vn;
+	int result = vfs_swapon(SWAP_DEVICE, &vn);
+	if (result) {
+		kprintf("swap: %s unavailable (%s), running without swap\n", SWAP_DEVICE, strerror(result));
+		return;
+	}
+
+	struct stat st;
+	result = VOP_STAT(vn, &st);
+	if (result || st.st_size < PAGE_SIZE) {
+		kprintf("swap: %s is unusable, running without swap\n", SWAP_DEVICE);
+		return;
+	}
+
+	struct device *dev = dev_getdevice(vn);
+	if (dev == NULL || PAGE_SIZE % dev->d_blocksize != 0) {
+		kprintf("swap: %s is not a usable block device, running without swap\n", SWAP_DEVICE);
+		return;
+	}
+
+	swap_nslots = st.st_size / PAGE_SIZE;
+	swap_map = bitmap_create(swap_nslots);
+	if (swap_map == NULL) {
+		kprintf("swap: out of memory for slot bitmap, running without swap\n");
+		return;
+	}
+	swap_vnode = vn;
+	swap_dev = dev;
+	kprintf("swap: %u pages on %s\n", swap_nslots, SWAP_DEVICE);
+}
+
+/*
+ * Reserve a free swap slot. Returns ENOSPC if swap is full or missing.
+ */
+int swap_alloc(uint32_t *slot) {
+	if (swap_vnode == NULL) return ENOSPC;
+
+	spinlock_acquire(&swap_map_lock);
+	unsigned index;
+	int result = bitmap_alloc(swap_map, &index);
+	if (result == 0) {
+		swap_nused++;
+		*slot = index;
+	}
+	spinlock_release(&swap_map_lock);
+	return result ? ENOSPC : 0;
+}
+
+/*
+ * Release a swap slot.
+ */
+void swap_free(uint32_t slot) {
+	KASSERT(swap_vnode != NULL && slot < swap_nslots);
+
+	spinlock_acquire(&swap_map_lock);
+	bitmap_unmark(swap_map, slot);
+	swap_nused--;
+	spinlock_release(&swap_map_lock);
+}
+
+/*
+ * Transfer one page between a slot and a frame, as a single block
+ * request. The kvaddr must be a kernel virtual address. May sleep.
+ */
+static int swap_io(uint32_t slot, vaddr_t kvaddr, enum uio_rw rw) {
+	KASSERT(swap_vnode != NULL && slot < swap_nslots);
+
+	uint32_t block = slot * (PAGE_SIZE / swap_dev->d_blocksize);
+	return blkio(swap_dev, block, (void *) kvaddr, PAGE_SIZE, rw);
+}
+
+int swap_read(uint32_t slot, vaddr_t kvaddr) {
+	return swap_io(slot, kvaddr, UIO_READ);
+}
+
+int swap_write(uint32_t slot, vaddr_t kvaddr) {
+	return swap_io(slot, kvaddr, UIO_WRITE);
+}
+
+void swap_usage(uint32_t *used, uint32_t *total) {
+	spinlock_acquire(&swap_map_lock);
+	*used = swap_nused;
+	*total = swap_nslots;
+	spinlock_release(&swap_map_lock);
+}
@@ -0,0 +1,205 @@
+#include <types.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <synch.h>
+#include <vnode.h>
+#include <vm.h>
+#include <textcache.h>
+
+/* cached pages of one program file */
+struct textfile {
+	struct vnode *tf_vnode; /* not referenced - the regions using the textfile hold references */
+	unsigned tf_users; /* regions using the textfile */
+	unsigned tf_npages; /* pages in the file when the textfile was made */
+	bool tf_stale; /* the file has changed since - nothing is cached any more */
+	vaddr_t *tf_frames; /* frame for each page of the file, 0 if not cached */
+	struct textfile *tf_next;
+};
+
+static struct lock *textcache_lock; /* protects the list, all textfiles and the counters */
+static struct textfile *textfiles = NULL;
+static uint32_t textcache_nframes = 0; /* frames held by the cache */
+static uint32_t textcache_hits = 0; /* faults mapped to a cached frame */
+static uint32_t textcache_misses = 0; /* cacheable faults that read the page */
+
+void textcache_bootstrap(void) {
+	textcache_lock = lock_create("textcache");
+	if (textcache_lock == NULL) panic("textcache: lock_create failed\n");
+}
+
+/*
+ * Find the textfile of file, or make one sized to the file as it is now.
+ */
+struct textfile *textcache_get(struct vnode *file) {
+	struct stat st;
+	if (VOP_STAT(file, &st)) return NULL;
+	unsigned npages = DIVROUNDUP(st.st_size, PAGE_SIZE);
+
+	lock_acquire(textcache_lock);
+	struct textfile *tf;
+	for (tf = textfiles; tf != NULL; tf = tf->tf_next) {
+		if (tf->tf_vnode == file && !tf->tf_stale) {
+			tf->tf_users++;
+			lock_release(textcache_lock);
+			return tf;
+		}
+	}
+
+	tf = kmalloc(sizeof(struct textfile));
+	if (tf == NULL) goto fail;
+	tf->tf_frames = kmalloc(npages * sizeof(vaddr_t));
+	if (tf->tf_frames == NULL) {
+		kfree(tf);
+		goto fail;
+	}
+	for (unsigned i = 0; i < npages; ++i) tf->tf_frames[i] = 0;
+	tf->tf_vnode = file;
+	tf->tf_users = 1;
+	tf->tf_npages = npages;
+	tf->tf_stale = false;
+	tf->tf_next = textfiles;
+	file->vn_textfiles++;
+	textfiles = tf;
+	lock_release(textcache_lock);
+	return tf;
+
+fail:
+	lock_release(textcache_lock);
+	return NULL;
+}
+
+void textcache_incref(struct textfile *tf) {
+	lock_acquire(textcache_lock);
+	KASSERT(tf->tf_users > 0);
+	tf->tf_users++;
+	lock_release(textcache_lock);
+}
+
+/*
+ * Drop a reference to tf. The last one frees the textfile and the cache's
+ * references to its frames, which by then no page maps.
+ */
+void textcache_put(struct textfile *tf) {
+	lock_acquire(textcache_lock);
+	KASSERT(tf->tf_users > 0);
+	if (--tf->tf_users > 0) {
+		lock_release(textcache_lock);
+		return;
+	}
+
+	struct textfile **prev = &textfiles;
+	while (*prev != tf) prev = &(*prev)->tf_next;
+	*prev = tf->tf_next;
+	if (!tf->tf_stale) tf->tf_vnode->vn_textfiles--;
+	for (unsigned i = 0; i < tf->tf_npages; ++i) {
+		if (tf->tf_frames[i] == 0) continue;
+		free_kpages(tf->tf_frames[i]);
+		textcache_nframes--;
+	}
+	lock_release(textcache_lock);
+
+	kfree(tf->tf_frames);
+	kfree(tf);
+}
+
+vaddr_t textcache_lookup(struct textfile *tf, off_t pos) {
+	KASSERT(pos % PAGE_SIZE == 0);
+	vaddr_t frame = 0;
+	lock_acquire(textcache_lock);
+	if (pos >= 0 && pos / PAGE_SIZE < tf->tf_npages) {
+		frame = tf->tf_frames[pos / PAGE_SIZE];
+		if (frame != 0 && !frame_share(frame)) frame = 0; /* too many sharers - read a private copy */
+	}
+	if (frame != 0) {
+		textcache_hits++;
+	} else {
+		textcache_misses++;
+	}
+	lock_release(textcache_lock);
+	return frame;
+}
+
+vaddr_t textcache_insert(struct textfile *tf, off_t pos, vaddr_t frame) {
+	KASSERT(pos % PAGE_SIZE == 0);
+	lock_acquire(textcache_lock);
+	if (tf->tf_stale || pos < 0 || pos / PAGE_SIZE >= tf->tf_npages) {
+		/* the file changed since the textfile was made, or the frame may have been read before it did */
+		lock_release(textcache_lock);
+		return frame;
+	}
+
+	vaddr_t *slot = &tf->tf_frames[pos / PAGE_SIZE];
+	if (*slot != 0 && frame_share(*slot)) {
+		/* someone else read the page first - use theirs */
+		vaddr_t cached = *slot;
+		lock_release(textcache_lock);
+		free_kpages(frame);
+		return cached;
+	}
+	if (*slot == 0 && frame_share(frame)) {
+		*slot = frame;
+		textcache_nframes++;
+	}
+	lock_release(textcache_lock);
+	return frame;
+}
+
+/*
+ * Called after file is written or truncated. A fault that read a page before
+ * the change may not have inserted it yet, so the textfile is marked stale
+ * rather than just emptied, and textcache_insert() won't cache anything in it.
+ * Frames nobody else maps are freed here; the rest keep the owner vm_file_fault()
+ * recorded, so the clock can evict them once only one page maps them.
+ */
+void textcache_invalidate(struct vnode *file) {
+	lock_acquire(textcache_lock);
+	for (struct textfile *tf = textfiles; tf != NULL; tf = tf->tf_next) {
+		if (tf->tf_vnode != file || tf->tf_stale) continue;
+		tf->tf_stale = true;
+		file->vn_textfiles--;
+		for (unsigned i = 0; i < tf->tf_npages; ++i) {
+			if (tf->tf_frames[i] == 0) continue;
+			free_kpages(tf->tf_frames[i]);
+			tf->tf_frames[i] = 0;
+			textcache_nframes--;
+		}
+	}
+	lock_release(textcache_lock);
+}
+
+/*
+ * A cached frame with one reference is only held by the cache. Nobody can
+ * gain a reference to it without going through textcache_lookup(), so it
+ * can be freed safely with the lock held.
+ */
+unsigned textcache_reclaim(void) {
+	unsigned freed = 0;
+	lock_acquire(textcache_lock);
+	for (struct textfile *tf = textfiles; tf != NULL; tf = tf->tf_next) {
+		for (unsigned i = 0; i < tf->tf_npages; ++i) {
+			vaddr_t frame = tf->tf_frames[i];
+			if (frame == 0 || frame_refcount(frame) != 1) continue;
+			tf->tf_frames[i] = 0;
+			free_kpages(frame);
+			freed++;
+		}
+	}
+	textcache_nframes -= freed;
+	lock_release(textcache_lock);
+	return freed;
+}
+
+void textcache_stats(uint32_t *cached, uint32_t *hits, uint32_t *misses) {
+	lock_acquire(textcache_lock);
+	*cached = textcache_nframes;
+	*hits = textcache_hits;
+	*misses = textcache_misses;
+	lock_release(textcache_lock);
+}
+
+void textcache_resetstats(void) {
+	lock_acquire(textcache_lock);
+	textcache_hits = 0;
+	textcache_misses = 0;
+	lock_release(textcache_lock);
+}
@@ -0,0 +1,106 @@
+#include <types.h>
+#include <lib.h>
+#include <cpu.h>
+#include <current.h>
+#include <mips/tlb.h>
+#include <tlbpolicy.h>
+#include "opt-tlbrr.h"
+#include "opt-tlblru.h"
+
+#if OPT_TLBRR && OPT_TLBLRU
+#error "options tlbrr and tlblru can't be enabled together"
+#endif
+
+#if NUM_TLB > 64
+#error "per-cpu tlb slot bitmaps only hold 64 slots"
+#endif
+
+/*
+ * The tlb is software managed, so the kernel only sees a slot being used when
+ * it loads an entry into it or rewrites one in place (e.g. on a copy-on-write
+ * fault). Hits in between are invisible, so "least recently used" here means
+ * least recently loaded or rewritten.
+ */
+
+#define SLOT_BIT(i) ((uint64_t) 1 << (i))
+
+#if OPT_TLBLRU
+/*
+ * Tree pseudo-LRU: node n (1 to NUM_TLB-1) has children 2n and 2n+1, and the
+ * leaves NUM_TLB to 2*NUM_TLB-1 are the slots. A set bit means the least
+ * recently used slot is down the right subtree.
+ */
+static void plru_touch(struct cpu *c, unsigned slot) {
+	for (unsigned node = slot + NUM_TLB; node > 1; node /= 2) {
+		if (node % 2 == 0) {
+			c->c_tlb_plru |= SLOT_BIT(node / 2); /* left child used - point right */
+		} else {
+			c->c_tlb_plru &= ~SLOT_BIT(node / 2);
+		}
+	}
+}
+static unsigned plru_victim(struct cpu *c) {
+	unsigned node = 1;
+	while (node < NUM_TLB) node = 2 * node + ((c->c_tlb_plru & SLOT_BIT(node)) ? 1 : 0);
+	return node - NUM_TLB;
+}
+#endif
+
+#if OPT_TLBRR || OPT_TLBLRU
+/*
+ * Pick the slot for a new entry - an empty one if there is any, otherwise the policy's victim.
+ */
+static unsigned tlbpolicy_victim(struct cpu *c) {
+	for (unsigned i = 0; i < NUM_TLB && c->c_tlb_used != ~(uint64_t) 0; ++i) {
+		if (!(c->c_tlb_used & SLOT_BIT(i))) return i;
+	}
+#if OPT_TLBLRU
+	return plru_victim(c);
+#else
+	unsigned slot = c->c_tlb_hand;
+	c->c_tlb_hand = (slot + 1) % NUM_TLB;
+	return slot;
+#endif
+}
+#endif
+
+void tlbpolicy_load(uint32_t entryhi, uint32_t entrylo) {
+#if OPT_TLBRR || OPT_TLBLRU
+	unsigned slot = tlbpolicy_victim(curcpu->c_self);
+	tlb_write(entryhi, entrylo, slot);
+	tlbpolicy_touch(slot);
+#else
+	tlb_random(entryhi, entrylo);
+#endif
+}
+
+void tlbpolicy_touch(unsigned slot) {
+	KASSERT(slot < NUM_TLB);
+	struct cpu *c = curcpu->c_self;
+	c->c_tlb_used |= SLOT_BIT(slot);
+#if OPT_TLBLRU
+	plru_touch(c, slot);
+#endif
+}
+
+void tlbpolicy_forget(unsigned slot) {
+	KASSERT(slot < NUM_TLB);
+	curcpu->c_tlb_used &= ~SLOT_BIT(slot);
+}
+
+void tlbpolicy_reset(void) {
+	struct cpu *c = curcpu->c_self;
+	c->c_tlb_used = 0;
+	c->c_tlb_plru = 0;
+	c->c_tlb_hand = 0;
+}
+
+const char *tlbpolicy_name(void) {
+#if OPT_TLBLRU
+	return "pseudo-lru";
+#elif OPT_TLBRR
+	return "round-robin";
+#else
+	return "random";
+#endif
+}
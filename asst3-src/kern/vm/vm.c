@@ -1,6 +1,9 @@
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/stat.h>
 #include <lib.h>
+#include <uio.h>
+#include <vnode.h>
 #include <thread.h>
 #include <addrspace.h>
 #include <proc.h>
@@ -8,21 +11,73 @@
 #include <spl.h>
 #include <vm.h>
 #include <machine/tlb.h>
+#include <spinlock.h>
 #include <synch.h>
+#include <cpu.h>
+#include <swap.h>
+#include <tlbpolicy.h>
+#include <textcache.h>
 
 ftable_entry fhead = 0; /* pntr to first free entry in frame table */
 uint32_t total_hpt_pages = 0; /* total pages in the hpt */
+uint32_t hpt_stripe_pages = 0; /* pages in each independently locked stripe of the hpt */
 struct frame_table_entry *ftable = 0;
 struct page_table_entry *ptable = 0;
-struct lock *hpt_lock;
+bool vm_fastrefill = true; /* refill the tlb before looking up the fault's region */
+bool vm_cow = true; /* share frames copy-on-write on fork */
+bool vm_zeropool = true; /* take first-touch frames from the pre-zeroed pool */
+bool vm_asids = true; /* keep tlb entries of other addrspaces across context switches */
+bool vm_tlbreport = false; /* print each process's tlb miss count when it exits */
+bool vm_lazyload = true; /* read program pages in on first touch instead of at exec */
+bool vm_textcache = true; /* share read-only program pages between processes running the same file */
+static struct lock *evict_lock; /* serialises page-outs against page-ins */
+static struct semaphore *shootdown_sem; /* counts completed tlb shootdowns, see vm_tlb_invalidate() */
+
+/* independently locked stripe of the hpt */
+struct hpt_stripe {
+	struct spinlock lock; /* protects the stripe's ptable entries and counters */
+	uint32_t refills; /* tlb misses served from an existing ptable entry */
+	uint32_t inserts; /* new ptable entries (lazy allocations and fork copies) */
+	uint32_t cow_shares; /* frames shared with a child on fork */
+	uint32_t cow_copies; /* writes to shared frames that needed a copy */
+	uint32_t cow_reuses; /* writes to formerly shared frames with no other reference left */
+	uint32_t evictions; /* pages written out to swap */
+	uint32_t swapins; /* pages read back in from swap */
+	uint32_t file_reads; /* program and mmap()ed pages read in from their file */
+	uint32_t file_writes; /* mmap()ed pages written back to their file */
+};
+
+static struct hpt_stripe hpt_stripes[HPT_NSTRIPES];
+
+/* asid allocation, see vm_activate() */
+static struct spinlock asid_lock = SPINLOCK_INITIALIZER; /* protects the allocator, counters and every as->asid */
+static uint32_t asid_generation = 1; /* generation 0 marks an addrspace with no asid */
+static uint32_t asid_next = 1; /* asid 0 is never handed out */
+static uint32_t asid_rollovers = 0; /* times the asids ran out and a new generation started */
+static uint32_t tlb_flushes = 0; /* whole-tlb flushes on any cpu */
+
+/* frames zeroed ahead of time by the zeroing thread */
+static struct {
+	struct spinlock lock; /* protects the pool and its counters */
+	vaddr_t frames[ZEROPOOL_SIZE]; /* kernel addresses of zeroed frames, each holding one reference */
+	uint32_t nframes;
+	uint32_t hits; /* first-touch faults given a pre-zeroed frame */
+	uint32_t misses; /* first-touch faults that had to zero their own frame */
+	struct semaphore *wakeup; /* signalled when the pool runs low, or memory comes back */
+	bool sleeping; /* the thread is asleep with no wakeup pending */
+	bool starved; /* it went to sleep because free frames ran short, not because the pool was full */
+} zeropool;
 
 /*
  * Initialise the frame table and hashed page table.
  */
 static void init_tables(paddr_t phys_size, paddr_t first_free) {
 	vaddr_t kernel_top = PADDR_TO_KVADDR(first_free); /* top of kernel */
-	uint32_t total_frames = phys_size / PAGE_SIZE; /* total number of frames in physical memory */
-	total_hpt_pages = total_frames * 2; /* size hpt to twice as many physical frames */
+	total_frames = phys_size / PAGE_SIZE; /* total number of frames in physical memory */
+
+	/* size hpt to twice as many physical frames, split evenly into stripes */
+	hpt_stripe_pages = DIVROUNDUP(total_frames * 2, HPT_NSTRIPES);
+	total_hpt_pages = hpt_stripe_pages * HPT_NSTRIPES;
 
 	/* total number of bytes required to store the frame table and HPT */
 	uint32_t ft_size  = total_frames * sizeof(struct frame_table_entry);
@@ -30,18 +85,27 @@ static void init_tables(paddr_t phys_size, paddr_t first_free) {
 
 	/* total number of frames used by the kernel, frame table and HPT */
 	uint32_t kern_frames = first_free / PAGE_SIZE;
-	uint32_t ft_frames   = ft_size    / PAGE_SIZE;
-	uint32_t hpt_frames  = hpt_size   / PAGE_SIZE;
+	uint32_t tables_frames = DIVROUNDUP(ft_size + hpt_size, PAGE_SIZE);
 
 	/* place frame table right after kernel */
 	ftable = (ftable_entry) kernel_top;
 
-	/* initialise frame table - set physical frame number (addr) and next pointer */
+	/* frames below this are used by the kernel, frame table and HPT */
+	uint32_t first_free_frame = kern_frames + tables_frames;
+
+	/* initialise frame table - set physical frame number (addr), refcount and next/prev pointers */
 	for (uint32_t i = 0; i < total_frames; ++i) {
 		ftable[i].addr = i;
+		ftable[i].refcount = (i < first_free_frame) ? 1 : 0;
+		ftable[i].run = (i < first_free_frame) ? 1 : 0;
+		ftable[i].vpage = 0;
+		ftable[i].busy = 0;
+		ftable[i].referenced = 0;
+		ftable[i].owner = NULL;
 
-		/* point to next frame; last frame has no next */
+		/* point to next frame; last frame has no next, first free frame has no prev */
 		ftable[i].next = (i != total_frames - 1) ? &ftable[i + 1] : NULL;
+		ftable[i].prev = (i > first_free_frame) ? &ftable[i - 1] : NULL;
 	}
 
 	/* place page table right after kernel and frame table */
@@ -56,22 +120,41 @@ static void init_tables(paddr_t phys_size, paddr_t first_free) {
 	}
 
 	/* set the first free frame to be directly after the frames used by the kernel, frame table and HPT */
-	fhead = &ftable[kern_frames + ft_frames + hpt_frames];
+	fhead = &ftable[first_free_frame];
+	nfree_frames = total_frames - first_free_frame;
 }
 
+static void zeropool_thread(void *unused1, unsigned long unused2);
+
 /*
  * Initialise the VM system.
  */
 void vm_bootstrap(void) {
-	/* create hpt lock */
-	hpt_lock = lock_create("hpt_lock");
-	KASSERT(hpt_lock != NULL);
+	/* initialise hpt stripe locks */
+	for (uint32_t i = 0; i < HPT_NSTRIPES; ++i) {
+		spinlock_init(&hpt_stripes[i].lock);
+	}
 
 	paddr_t phys_size = ram_getsize(); /* must be called first, since ram_getfirstfree() invalidates it */
 	paddr_t first_free = ram_getfirstfree();
 
 	/* initialise frame table and hashed page table */
 	init_tables(phys_size, first_free);
+
+	/* set up paging to swap */
+	evict_lock = lock_create("evict_lock");
+	KASSERT(evict_lock != NULL);
+	shootdown_sem = sem_create("shootdown_sem", 0);
+	KASSERT(shootdown_sem != NULL);
+	swap_bootstrap();
+	textcache_bootstrap();
+
+	/* start zeroing frames in the background */
+	spinlock_init(&zeropool.lock);
+	zeropool.wakeup = sem_create("zeropool", 0);
+	KASSERT(zeropool.wakeup != NULL);
+	int ret = thread_fork("zeropool", NULL, zeropool_thread, NULL, 0);
+	if (ret) panic("vm: can't start zeroing thread: %s\n", strerror(ret));
 }
 
 /*
@@ -83,45 +166,171 @@ static void zero_region(vaddr_t paddr, unsigned npages) {
 }
 
 /*
- * Insert an entry into the ptable for the given vaddr.
- * Call alloc_kpages() to acquire a frame for the page.
- * Set the dirty bit as needed for write permissions.
+ * Take a frame from the pre-zeroed pool, waking the zeroing thread if the pool runs low.
+ * A thread that stopped for lack of memory is left for zeropool_frames_freed() to wake.
+ * Returns 0 if the pool is empty. Stats are only counted when called for a first-touch fault.
  */
-int insert_ptable_entry(struct addrspace *as, vaddr_t vaddr, int writeable, bool write_tlb) {
-	KASSERT(as != NULL && vaddr != 0);
-	vaddr &= PAGE_FRAME;
-	vaddr_t paddr = alloc_kpages(1);
-	KASSERT(paddr % PAGE_SIZE == 0);
-	if (paddr == 0) return ENOMEM; /* out of frames */
+static vaddr_t zeropool_get(bool count) {
+	vaddr_t frame = 0;
+	spinlock_acquire(&zeropool.lock);
+	if (zeropool.nframes > 0) frame = zeropool.frames[--zeropool.nframes];
+	bool wake = zeropool.sleeping && !zeropool.starved && zeropool.nframes <= ZEROPOOL_LOW;
+	if (wake) zeropool.sleeping = false;
+	if (count && frame != 0) zeropool.hits++;
+	if (count && frame == 0) zeropool.misses++;
+	spinlock_release(&zeropool.lock);
+	if (wake) V(zeropool.wakeup);
+	return frame;
+}
 
-	/* check we currently hold the hpt lock - if not acquire it */
-	bool release_lock = !lock_do_i_hold(hpt_lock);
-	if (release_lock) lock_acquire(hpt_lock);
+/*
+ * Wake the zeroing thread if it stopped because memory was short and the free list
+ * is back above ZEROPOOL_RESERVE. Called on every free_kpages(), so the flag is
+ * looked at without the lock first.
+ */
+void zeropool_frames_freed(void) {
+	if (!zeropool.starved) return;
+	spinlock_acquire(&zeropool.lock);
+	bool wake = zeropool.sleeping && zeropool.starved && nfree_frames > ZEROPOOL_RESERVE;
+	if (wake) {
+		zeropool.sleeping = false;
+		zeropool.starved = false;
+	}
+	spinlock_release(&zeropool.lock);
+	if (wake) V(zeropool.wakeup);
+}
 
-	/* find a free slot to insert the ptable entry */
+/*
+ * Keep the pool of pre-zeroed frames topped up. Each frame is zeroed with no lock held,
+ * and the thread yields after every frame so it mostly runs when its cpu has nothing
+ * else to do. Free frames below ZEROPOOL_RESERVE are left alone so the pool never
+ * pushes user pages out to swap. Once the pool is full the thread sleeps until the
+ * fault path drains it to ZEROPOOL_LOW; if memory is short, it sleeps until frames
+ * are freed.
+ */
+static void zeropool_thread(void *unused1, unsigned long unused2) {
+	(void) unused1;
+	(void) unused2;
+	for (;;) {
+		bool starved = false;
+		while (zeropool.nframes < ZEROPOOL_SIZE) {
+			vaddr_t frame = 0;
+			if (nfree_frames > ZEROPOOL_RESERVE) frame = alloc_kpages(1);
+			if (frame == 0) {
+				starved = true;
+				break;
+			}
+			zero_region(frame, 1);
+
+			spinlock_acquire(&zeropool.lock);
+			bool full = (zeropool.nframes == ZEROPOOL_SIZE);
+			if (!full) zeropool.frames[zeropool.nframes++] = frame;
+			spinlock_release(&zeropool.lock);
+			if (full) {
+				free_kpages(frame);
+				break;
+			}
+			thread_yield();
+		}
+
+		spinlock_acquire(&zeropool.lock);
+		zeropool.sleeping = true;
+		zeropool.starved = starved;
+		spinlock_release(&zeropool.lock);
+		P(zeropool.wakeup);
+	}
+}
+
+/*
+ * Return the hpt stripe containing the given ptable index.
+ */
+static struct hpt_stripe *hpt_stripe(uint32_t index) {
+	KASSERT(index < total_hpt_pages);
+	return &hpt_stripes[index / hpt_stripe_pages];
+}
+
+/*
+ * Return the ptable index after the given one, wrapping around within its stripe.
+ * Collision chains never leave the stripe they hash to, so one stripe lock covers a whole chain.
+ */
+static uint32_t hpt_next_slot(uint32_t index) {
+	uint32_t stripe_base = index - index % hpt_stripe_pages;
+	return stripe_base + (index + 1 - stripe_base) % hpt_stripe_pages;
+}
+
+/*
+ * Tag the entryhi of a ptable entry with the asid loaded on this cpu.
+ * Interrupts must be off so we stay on the same cpu.
+ */
+static uint32_t vm_tlbhi(uint32_t entryhi) {
+	return (entryhi & TLBHI_VPAGE) | (curcpu->c_asid << TLBHI_PID_SHIFT);
+}
+
+/*
+ * Invalidate the entry for vaddr tagged with asid in this cpu's tlb, if there is one.
+ * Interrupts must be off.
+ */
+static void vm_tlb_invalidate_local(vaddr_t vaddr, uint32_t asid) {
+	int index = tlb_probe(vaddr | (asid << TLBHI_PID_SHIFT), 0);
+	if (index >= 0) {
+		tlb_write(TLBHI_INVALID(index), TLBLO_INVALID(), index);
+		tlbpolicy_forget(index);
+	}
+	tlb_setasid(curcpu->c_asid); /* probing loaded the other asid */
+}
+
+/*
+ * Invalidate every entry in this cpu's tlb. Interrupts must be off.
+ */
+static void vm_tlb_flush_local(void) {
+	for (int i = 0; i < NUM_TLB; i++) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+	tlbpolicy_reset();
+	tlb_setasid(curcpu->c_asid);
+}
+
+/*
+ * Return the hardware asid of as, which is 0 if it never had one.
+ * It may be from an old generation, but no cpu can have reused it
+ * without flushing first, so it still finds any entries of as.
+ */
+static uint32_t vm_asid(struct addrspace *as) {
+	spinlock_acquire(&asid_lock);
+	uint32_t asid = as->asid % NUM_ASIDS;
+	spinlock_release(&asid_lock);
+	return asid;
+}
+
+/*
+ * Insert an entry mapping vaddr to the frame at paddr into the ptable.
+ * The paddr must be a kernel virtual address whose contents are already initialised.
+ * Set the dirty bit as needed for write permissions.
+ */
+static int hpt_insert(struct addrspace *as, vaddr_t vaddr, vaddr_t paddr, int writeable, bool write_tlb) {
 	uint32_t index = hpt_hash(as, vaddr);
+	struct hpt_stripe *stripe = hpt_stripe(index);
+	spinlock_acquire(&stripe->lock);
+
+	/* find a free slot to insert the ptable entry */
 	uint32_t candidate = index;
 
 	/* check if the hash slot already has a valid HPT entry */
 	ptable_entry entry = &ptable[candidate];
-	bool initial_collision = (entry->entrylo & TLBLO_VALID);
+	bool initial_collision = HPT_IN_USE(entry);
 
-	/* do a linear scan until the 1st free slot is found */
-	while (entry->entrylo & TLBLO_VALID) {
-		candidate = (candidate + 1) % total_hpt_pages;
+	/* do a linear scan of the stripe until the 1st free slot is found */
+	while (HPT_IN_USE(entry)) {
+		candidate = hpt_next_slot(candidate);
 
-		/* check if we looped back around - very unlikely, should run out of frames first */
+		/* check if we looped back around - unlikely, stripes are sized for twice the frames */
 		if (candidate == index) {
-			free_kpages(paddr);
-			if (release_lock) lock_release(hpt_lock);
+			spinlock_release(&stripe->lock);
 			return ENOMEM; /* out of pages */
 		}
 		entry = &ptable[candidate];
 	}
 
-	/* zero-fill the frame */
-	zero_region(paddr, 1);
-
 	/*
 	 * if there was an collision, find the end of the collision chain
 	 * and set the last entry in the chain to point to the new entry
@@ -144,11 +353,402 @@ int insert_ptable_entry(struct addrspace *as, vaddr_t vaddr, int writeable, bool
 	/* write new ptable entry to tlb */
 	if (write_tlb) {
 		int spl = splhigh();
-		tlb_random(entry->entryhi, entry->entrylo);
+		tlbpolicy_load(vm_tlbhi(entry->entryhi), entry->entrylo);
 		splx(spl);
 	}
 
-	if (release_lock) lock_release(hpt_lock);
+	stripe->inserts++;
+	spinlock_release(&stripe->lock);
+	return 0;
+}
+
+/*
+ * Load an updated ptable entry into the tlb, replacing any stale entry for the same page.
+ */
+static void vm_tlb_update(uint32_t entryhi, uint32_t entrylo) {
+	int spl = splhigh();
+	entryhi = vm_tlbhi(entryhi);
+	int index = tlb_probe(entryhi, 0);
+	if (index >= 0) {
+		tlb_write(entryhi, entrylo, index);
+		tlbpolicy_touch(index);
+	} else {
+		tlbpolicy_load(entryhi, entrylo);
+	}
+	splx(spl);
+}
+
+/*
+ * Remove any tlb entry for vaddr in as on every cpu, and wait until they are all gone.
+ * Only called with evict_lock held, so shootdown_sem is never shared.
+ */
+static void vm_tlb_invalidate(struct addrspace *as, vaddr_t vaddr) {
+	KASSERT(lock_do_i_hold(evict_lock));
+	uint32_t asid = vm_asid(as);
+	int spl = splhigh();
+	vm_tlb_invalidate_local(vaddr, asid);
+	splx(spl);
+
+	struct tlbshootdown ts;
+	ts.ts_vaddr = vaddr;
+	ts.ts_asid = asid;
+	ts.ts_done = shootdown_sem;
+	unsigned ncpus = ipi_tlbshootdown_broadcast(&ts);
+	for (unsigned i = 0; i < ncpus; ++i) P(shootdown_sem);
+}
+
+/*
+ * Load the tlb context of as on this cpu. Every addrspace gets an asid the first time
+ * it is activated, and its tlb entries are tagged with it, so switching between a few
+ * processes leaves their entries loaded. Asids are handed out in order and never freed;
+ * once they run out a new generation starts, which makes every addrspace's asid stale,
+ * and each cpu flushes its whole tlb the next time it activates an addrspace so it never
+ * holds entries of two generations. With vm_asids off the tlb is flushed on every switch.
+ * A cpu that may still hold an entry for a frame the page no longer maps (see
+ * vm_tlb_others_stale()) gets as a fresh asid instead of reusing its entries.
+ */
+void vm_activate(struct addrspace *as) {
+	spinlock_acquire(&asid_lock); /* also keeps us on this cpu with interrupts off */
+	struct cpu *c = curcpu->c_self;
+	KASSERT(c->c_number < 32);
+	uint32_t cpubit = (uint32_t) 1 << c->c_number;
+	if (as->asid / NUM_ASIDS != asid_generation || (as->tlb_stale & cpubit)) {
+		if (asid_next == NUM_ASIDS) {
+			asid_generation++;
+			asid_next = 1;
+			asid_rollovers++;
+		}
+		as->asid = asid_generation * NUM_ASIDS + asid_next++;
+		as->tlb_cpus = 0;
+		as->tlb_stale = 0;
+	}
+	as->tlb_cpus |= cpubit;
+
+	c->c_asid = as->asid % NUM_ASIDS;
+	if (c->c_asid_generation != asid_generation || !vm_asids) {
+		c->c_asid_generation = asid_generation;
+		tlb_flushes++;
+		vm_tlb_flush_local();
+	} else {
+		tlb_setasid(c->c_asid);
+	}
+	spinlock_release(&asid_lock);
+}
+
+/*
+ * Called after changing the frame of a page of the current addrspace and loading the
+ * new entry into this cpu's tlb. The other cpus as has run on may still hold the old
+ * entry, so as moves to a fresh asid if it is activated on one of them again.
+ * Cheaper than a shootdown, since a process mostly stays on one cpu.
+ * Interrupts must be off, so the cpu can't change since the tlb was updated.
+ */
+static void vm_tlb_others_stale(struct addrspace *as) {
+	spinlock_acquire(&asid_lock);
+	uint32_t cpubit = (uint32_t) 1 << curcpu->c_number;
+	as->tlb_stale |= as->tlb_cpus & ~cpubit;
+	as->tlb_cpus = cpubit;
+	spinlock_release(&asid_lock);
+}
+
+/*
+ * Make every tlb entry of as unusable on every cpu by moving it to a fresh asid.
+ * Cheaper than shooting down entries one by one when many of them change at once.
+ */
+void vm_forget_tlb(struct addrspace *as) {
+	spinlock_acquire(&asid_lock);
+	as->asid = 0;
+	spinlock_release(&asid_lock);
+	if (as == proc_getas()) vm_activate(as);
+}
+
+/*
+ * Page out a user page chosen by the clock algorithm and return its frame,
+ * still holding one reference, for the caller to reuse.
+ * The victim's ptable entry is switched to its swap slot before the page is
+ * written, and evict_lock is held until the write completes, so a fault on the
+ * page waits in vm_swapin() until the slot holds its contents.
+ * Returns 0 if swap is full or no frame can be evicted.
+ */
+static vaddr_t vm_evict(void) {
+	lock_acquire(evict_lock);
+	for (;;) {
+		struct addrspace *owner;
+		vaddr_t vaddr;
+		vaddr_t frame = frame_choose_victim(&owner, &vaddr);
+		if (frame == 0) break; /* nothing evictable */
+
+		uint32_t slot;
+		if (swap_alloc(&slot)) {
+			frame_release_victim(frame, false);
+			break; /* swap full or missing */
+		}
+
+		/* check the owner still maps the frame, and nobody else does */
+		struct hpt_stripe *stripe = hpt_stripe(hpt_hash(owner, vaddr));
+		spinlock_acquire(&stripe->lock);
+		ptable_entry pt = search_ptable(owner, vaddr, NULL);
+		if (pt == NULL || !(pt->entrylo & TLBLO_VALID) || (pt->entrylo & TLBLO_PPAGE) != KVADDR_TO_PADDR(frame) || frame_refcount(frame) != 1) {
+			/* stale owner or the page is being freed - try another frame */
+			spinlock_release(&stripe->lock);
+			swap_free(slot);
+			frame_release_victim(frame, true);
+			continue;
+		}
+		pt->entrylo = (slot << PAGE_BITS) | HPT_SWAPPED;
+		stripe->evictions++;
+		spinlock_release(&stripe->lock);
+
+		/* no cpu may write to the frame once it is being written out */
+		vm_tlb_invalidate(owner, vaddr);
+		int ret = swap_write(slot, frame);
+		if (ret) panic("vm: swap write to slot %u failed: %s\n", slot, strerror(ret));
+
+		frame_release_victim(frame, true);
+		lock_release(evict_lock);
+		return frame;
+	}
+	lock_release(evict_lock);
+	return 0;
+}
+
+/*
+ * Allocate a frame for a user page, evicting another user page if memory is full.
+ * May sleep, so no spinlocks may be held.
+ */
+static vaddr_t vm_alloc_frame(void) {
+	vaddr_t frame = alloc_kpages(1);
+	if (frame == 0) frame = zeropool_get(false); /* use up the pool before evicting */
+	if (frame == 0 && textcache_reclaim() > 0) frame = alloc_kpages(1); /* cached program pages nobody maps */
+	if (frame == 0) frame = vm_evict();
+	return frame;
+}
+
+/*
+ * Read a swapped out page back into a new frame and make its entry resident again.
+ * Returns 0 without doing anything if the page is no longer swapped out.
+ */
+static int vm_swapin(struct addrspace *as, vaddr_t vaddr, int writeable, bool write_tlb) {
+	vaddr_t frame = vm_alloc_frame();
+	if (frame == 0) return ENOMEM; /* out of frames */
+
+	/* wait for any page-out of this page to finish writing */
+	lock_acquire(evict_lock);
+	struct hpt_stripe *stripe = hpt_stripe(hpt_hash(as, vaddr));
+	spinlock_acquire(&stripe->lock);
+	ptable_entry pt = search_ptable(as, vaddr, NULL);
+	if (pt == NULL || !(pt->entrylo & HPT_SWAPPED)) {
+		spinlock_release(&stripe->lock);
+		lock_release(evict_lock);
+		free_kpages(frame);
+		return 0;
+	}
+	uint32_t slot = pt->entrylo >> PAGE_BITS;
+	spinlock_release(&stripe->lock);
+
+	int ret = swap_read(slot, frame);
+	if (ret) {
+		lock_release(evict_lock);
+		free_kpages(frame);
+		return ret;
+	}
+
+	/* the entry may have moved within its chain, so look it up again */
+	spinlock_acquire(&stripe->lock);
+	pt = search_ptable(as, vaddr, NULL);
+	KASSERT(pt != NULL && (pt->entrylo & HPT_SWAPPED));
+	pt->entrylo = KVADDR_TO_PADDR(frame) | TLBLO_VALID;
+	if (writeable) pt->entrylo |= TLBLO_DIRTY;
+	if (write_tlb) vm_tlb_update(pt->entryhi, pt->entrylo);
+	stripe->swapins++;
+	spinlock_release(&stripe->lock);
+	lock_release(evict_lock);
+
+	frame_set_owner(frame, as, vaddr);
+	swap_free(slot);
+	return 0;
+}
+
+/*
+ * Insert an entry into the ptable for the given vaddr.
+ * Take an already zeroed frame from the pool if there is one, otherwise
+ * call vm_alloc_frame() to acquire a frame for the page and zero-fill it.
+ * Either way the frame is zeroed before it is published in the ptable,
+ * and no lock is held while zeroing.
+ */
+int insert_ptable_entry(struct addrspace *as, vaddr_t vaddr, int writeable, bool write_tlb) {
+	KASSERT(as != NULL && vaddr != 0);
+	vaddr &= PAGE_FRAME;
+	vaddr_t paddr = vm_zeropool ? zeropool_get(true) : 0;
+	if (paddr == 0) {
+		paddr = vm_alloc_frame();
+		KASSERT(paddr % PAGE_SIZE == 0);
+		if (paddr == 0) return ENOMEM; /* out of frames */
+
+		/* zero-fill the frame */
+		zero_region(paddr, 1);
+	}
+
+	int ret = hpt_insert(as, vaddr, paddr, writeable, write_tlb);
+	if (ret) {
+		free_kpages(paddr);
+		return ret;
+	}
+	frame_set_owner(paddr, as, vaddr);
+	return 0;
+}
+
+/*
+ * Read a page of a region backed by a file (a program segment or an mmap())
+ * into a new frame and insert it into the ptable. Only the part of the page
+ * between file_start and file_end is read; the rest, and anything past the end
+ * of the file, is zeroed. Pages with nothing to read, like the bss at the end
+ * of a data segment, are plain zero-fill pages.
+ * Pages of shared mappings are mapped read-only even if the region is writeable,
+ * so the first write to one goes through vm_cow_fault(), which sets the dirty
+ * bit - that is how writeback_region() knows which pages were written.
+ */
+static int vm_file_fault(struct addrspace *as, vaddr_t vaddr, struct region *reg) {
+	vaddr_t start = (vaddr > reg->file_start) ? vaddr : reg->file_start;
+	vaddr_t end = (vaddr + PAGE_SIZE < reg->file_end) ? vaddr + PAGE_SIZE : reg->file_end;
+	if (start >= end) return insert_ptable_entry(as, vaddr, reg->writeable, true);
+
+	off_t pos = reg->file_offset + (start - reg->file_start);
+	bool cacheable = reg->text != NULL && !reg->writeable && start == vaddr && end == vaddr + PAGE_SIZE && pos % PAGE_SIZE == 0;
+	if (cacheable) {
+		/* another process running the program may have read the page in already */
+		vaddr_t frame = textcache_lookup(reg->text, pos);
+		if (frame != 0) {
+			int ret = hpt_insert(as, vaddr, frame, false, true);
+			if (ret) {
+				free_kpages(frame);
+				return ret;
+			}
+			frame_set_owner(frame, as, vaddr);
+			return 0;
+		}
+	}
+
+	vaddr_t frame = vm_alloc_frame();
+	if (frame == 0) return ENOMEM; /* out of frames */
+
+	struct iovec iov;
+	struct uio u;
+	bzero((void *) frame, start - vaddr);
+	uio_kinit(&iov, &u, (char *) frame + (start - vaddr), end - start, pos, UIO_READ);
+	int ret = VOP_READ(reg->file, &u);
+	if (ret) {
+		free_kpages(frame);
+		return ret;
+	}
+	size_t filled = end - vaddr - u.uio_resid;
+	bzero((char *) frame + filled, PAGE_SIZE - filled);
+	if (cacheable && u.uio_resid == 0) frame = textcache_insert(reg->text, pos, frame);
+
+	ret = hpt_insert(as, vaddr, frame, reg->writeable && !reg->file_shared, true);
+	if (ret) {
+		free_kpages(frame);
+		return ret;
+	}
+	/*
+	 * A cached frame has the cache's reference as well as ours, so the clock skips it.
+	 * It still records the last page to map it: once textcache_invalidate() drops the
+	 * cache's reference, that page can usually be evicted like any other.
+	 */
+	frame_set_owner(frame, as, vaddr);
+
+	struct hpt_stripe *stripe = hpt_stripe(hpt_hash(as, vaddr));
+	spinlock_acquire(&stripe->lock);
+	stripe->file_reads++;
+	spinlock_release(&stripe->lock);
+	return 0;
+}
+
+/*
+ * Read in the pages of a file-backed region between start and end that have
+ * never been touched. Pages that are resident or on swap are left alone, since
+ * faulting them in again never reads the file.
+ */
+int prefault_region(struct addrspace *as, struct region *reg, vaddr_t start, vaddr_t end) {
+	KASSERT(reg->file != NULL);
+	for (vaddr_t addr = start & PAGE_FRAME; addr < end; addr += PAGE_SIZE) {
+		struct hpt_stripe *stripe = hpt_stripe(hpt_hash(as, addr));
+		spinlock_acquire(&stripe->lock);
+		bool touched = (search_ptable(as, addr, NULL) != NULL);
+		spinlock_release(&stripe->lock);
+		if (touched) continue;
+
+		int ret = vm_file_fault(as, addr, reg);
+		if (ret) return ret;
+	}
+	return 0;
+}
+
+/*
+ * Write the pages of a mapped file region that were written since they were
+ * read in (or last written back) to the file, and make them read-only again
+ * so the next write is noticed. Pages on swap are swapped in first. Nothing
+ * is written past the end of the file, so a mapping can't make it longer.
+ * Each page holds an extra reference on its frame while it is written, which
+ * keeps the frame from being evicted under the write.
+ */
+int writeback_region(struct addrspace *as, struct region *reg) {
+	KASSERT(reg->file != NULL);
+	if (!reg->file_shared || !reg->can_write) return 0; /* program segments and read-only mappings are never written back */
+	KASSERT(reg->file_start == reg->vbase);
+	struct stat st;
+	int ret = VOP_STAT(reg->file, &st);
+	if (ret) return ret;
+
+	bool wrote = false;
+	vaddr_t addr = reg->vbase;
+	while (addr != reg->vbase + reg->npages * PAGE_SIZE) {
+		off_t pos = reg->file_offset + (addr - reg->file_start);
+		if (pos >= st.st_size) break; /* the rest is past the end of the file */
+
+		struct hpt_stripe *stripe = hpt_stripe(hpt_hash(as, addr));
+		spinlock_acquire(&stripe->lock);
+		ptable_entry pt = search_ptable(as, addr, NULL);
+		if (pt == NULL || (pt->entrylo & (TLBLO_VALID | TLBLO_DIRTY)) == TLBLO_VALID) {
+			/* never touched, or not written */
+			spinlock_release(&stripe->lock);
+			addr += PAGE_SIZE;
+			continue;
+		}
+		if (!(pt->entrylo & TLBLO_VALID)) {
+			/* on swap - bring it back in, which marks it written, and try again */
+			spinlock_release(&stripe->lock);
+			ret = vm_swapin(as, addr, reg->writeable, false);
+			if (ret) return ret;
+			continue;
+		}
+		vaddr_t frame = PADDR_TO_KVADDR(pt->entrylo & TLBLO_PPAGE);
+		bool shared = frame_share(frame);
+		KASSERT(shared); /* a written page is never shared, so its refcount is 1 */
+		pt->entrylo &= ~TLBLO_DIRTY;
+		stripe->file_writes++;
+		spinlock_release(&stripe->lock);
+		wrote = true;
+
+		struct iovec iov;
+		struct uio u;
+		size_t len = (st.st_size - pos < PAGE_SIZE) ? st.st_size - pos : PAGE_SIZE;
+		uio_kinit(&iov, &u, (void *) frame, len, pos, UIO_WRITE);
+		ret = VOP_WRITE(reg->file, &u);
+		if (ret) {
+			/* still needs writing - the entry may have moved within its chain, so look it up again */
+			spinlock_acquire(&stripe->lock);
+			pt = search_ptable(as, addr, NULL);
+			KASSERT(pt != NULL && (pt->entrylo & TLBLO_PPAGE) == KVADDR_TO_PADDR(frame));
+			pt->entrylo |= TLBLO_DIRTY;
+			spinlock_release(&stripe->lock);
+		}
+		free_kpages(frame); /* drop the extra reference */
+		if (ret) return ret;
+		addr += PAGE_SIZE;
+	}
+
+	/* the tlb may still hold some of the pages writeable */
+	if (wrote) vm_forget_tlb(as);
 	return 0;
 }
 
@@ -159,31 +759,40 @@ void make_page_read_only(vaddr_t vaddr) {
 	KASSERT(vaddr != 0);
 	vaddr &= PAGE_FRAME;
 	struct addrspace *as = proc_getas();
-	lock_acquire(hpt_lock);
+	struct hpt_stripe *stripe = hpt_stripe(hpt_hash(as, vaddr));
+	spinlock_acquire(&stripe->lock);
 
 	/* find ptable entry by traversing ptable using next pntrs to handle collisions */
 	ptable_entry curr = search_ptable(as, vaddr, NULL);
 
-	/* unset dirty bit in entrylo */
-	if (curr != NULL) {
+	/* unset dirty bit in entrylo - swapped pages get their permissions from the region when swapped in */
+	if (curr != NULL && (curr->entrylo & TLBLO_VALID)) {
 		paddr_t paddr = curr->entrylo & TLBLO_PPAGE;
 		curr->entrylo = paddr | TLBLO_VALID;
 	}
 
-	lock_release(hpt_lock);
+	spinlock_release(&stripe->lock);
 }
 
 /*
  * Remove page table entries and free frames associated with a region.
+ * Each page only holds the lock of the stripe it hashes to.
  */
 void free_region(struct addrspace *as, vaddr_t vaddr, uint32_t npages) {
-	lock_acquire(hpt_lock);
 	for (vaddr_t page = vaddr; page != vaddr + npages * PAGE_SIZE; page += PAGE_SIZE) {
+		struct hpt_stripe *stripe = hpt_stripe(hpt_hash(as, page));
+		spinlock_acquire(&stripe->lock);
+
 		ptable_entry prev = NULL;
 		ptable_entry pt = search_ptable(as, page, &prev); /* find ptable entry associated with page */
-		if (pt == NULL) continue; /* no HPT entry found */
+		if (pt == NULL) {
+			/* no HPT entry found */
+			spinlock_release(&stripe->lock);
+			continue;
+		}
 		KASSERT((pt->entryhi & TLBHI_VPAGE) == page);
-		free_kpages(PADDR_TO_KVADDR(pt->entrylo & TLBLO_PPAGE));
+		paddr_t frame = pt->entrylo & TLBLO_PPAGE;
+		bool swapped = (pt->entrylo & HPT_SWAPPED);
 		ptable_entry to_remove = pt;
 
 		if (prev != NULL) {
@@ -214,63 +823,111 @@ void free_region(struct addrspace *as, vaddr_t vaddr, uint32_t npages) {
 		to_remove->pid = 0;
 		to_remove->entryhi = 0;
 		to_remove->entrylo = 0;
+		spinlock_release(&stripe->lock);
+
+		/* the entry is unreachable now, so the frame or swap slot can be freed outside the stripe lock */
+		if (swapped) {
+			swap_free(frame >> PAGE_BITS);
+		} else {
+			free_kpages(PADDR_TO_KVADDR(frame));
+		}
 	}
-	lock_release(hpt_lock);
 }
 
 /*
- * Copy ptable entries from old to new addrspace and allocate new frames.
+ * Copy ptable entries from old to new addrspace.
+ * Resident frames are shared copy-on-write: both entries lose the dirty bit,
+ * and the frame is copied by vm_cow_fault() when either side writes to it.
+ * Swapped out pages of the old addrspace are swapped back in first.
+ * The old and new entries live in different stripes, so only one stripe lock is held at a time.
  */
 int copy_region(struct region *reg, struct addrspace *old, struct addrspace *newas) {
 	vaddr_t addr = reg->vbase;
-	lock_acquire(hpt_lock);
 	while (addr != reg->vbase + reg->npages * PAGE_SIZE) {
 		/* check an old page table entry exists for the page */
+		struct hpt_stripe *stripe = hpt_stripe(hpt_hash(old, addr));
+		spinlock_acquire(&stripe->lock);
 		ptable_entry old_pt = search_ptable(old, addr, NULL);
+		if (old_pt == NULL) {
+			spinlock_release(&stripe->lock);
+			addr += PAGE_SIZE;
+			continue;
+		}
+		if (!(old_pt->entrylo & TLBLO_VALID)) {
+			/* on swap - bring it back in and try again */
+			spinlock_release(&stripe->lock);
+			int ret = vm_swapin(old, addr, reg->writeable, false);
+			if (ret) return ret;
+			continue;
+		}
+		vaddr_t old_frame = PADDR_TO_KVADDR(old_pt->entrylo & TLBLO_PPAGE);
 
-		if (old_pt != NULL) {
-			/* insert page table entry for each page in the copied region */
-			int ret = insert_ptable_entry(newas, addr, reg->writeable, false);
-			if (ret) {
-				lock_release(hpt_lock);
-				return ret;
-			}
-
-			/* get ptable entry for new page */
-			ptable_entry new_pt = search_ptable(newas, addr, NULL);
-			if (new_pt == NULL) return ENOMEM; /* this should never happen, very unlikely */
-
-			/* get frame number for old and new frames */
-			vaddr_t old_frame = PADDR_TO_KVADDR(old_pt->entrylo & TLBLO_PPAGE);
-			vaddr_t new_frame = PADDR_TO_KVADDR(new_pt->entrylo & TLBLO_PPAGE);
+		/* share the frame - the caller flushes the tlb so the old dirty bit is not used again */
+		bool shared = vm_cow && frame_share(old_frame);
+		if (shared) {
+			old_pt->entrylo &= ~TLBLO_DIRTY;
+			stripe->cow_shares++;
+		}
+		/* otherwise pin the frame, so it can't be evicted while it is copied outside the stripe lock */
+		bool pinned = !shared && frame_share(old_frame);
+		spinlock_release(&stripe->lock);
 
-			/* copy the memory from the old frame to the new frame */
-			memmove((void *) new_frame, (const void *) old_frame, PAGE_SIZE);
+		/* frame can't be shared - allocate a new frame and copy the memory from the old frame to it */
+		vaddr_t new_frame = old_frame;
+		if (!shared) {
+			new_frame = vm_alloc_frame();
+			if (new_frame == 0) {
+				if (pinned) free_kpages(old_frame);
+				return ENOMEM; /* out of frames */
+			}
+			if (pinned) {
+				memmove((void *) new_frame, (const void *) old_frame, PAGE_SIZE);
+				free_kpages(old_frame); /* drop the pin */
+			} else {
+				/* too many references to pin - copy under the lock, unless the page was evicted meanwhile */
+				spinlock_acquire(&stripe->lock);
+				old_pt = search_ptable(old, addr, NULL);
+				bool mapped = old_pt != NULL && (old_pt->entrylo & TLBLO_VALID) &&
+					(old_pt->entrylo & TLBLO_PPAGE) == KVADDR_TO_PADDR(old_frame);
+				if (mapped) memmove((void *) new_frame, (const void *) old_frame, PAGE_SIZE);
+				spinlock_release(&stripe->lock);
+				if (!mapped) {
+					free_kpages(new_frame);
+					continue; /* swap it back in and try again */
+				}
+			}
 		}
 
+		/* insert page table entry for each page in the copied region */
+		int ret = hpt_insert(newas, addr, new_frame, reg->writeable && !shared, false);
+		if (ret) {
+			free_kpages(new_frame); /* drops the shared reference or frees the copy */
+			return ret;
+		}
+		if (!shared) frame_set_owner(new_frame, newas, addr);
 		addr += PAGE_SIZE;
 	}
-	lock_release(hpt_lock);
 	return 0;
 }
 
 /*
  * Find the ptable entry with the given vaddr and pid.
  * Begin the search from curr and follow the collision pointers until found.
- * Requires the page table lock to have been acquired already.
+ * Requires the lock of the stripe the vaddr hashes to have been acquired already.
  * Also sets prev to point to the previous ptable entry in the collision chain.
+ * The entry returned may be swapped out (TLBLO_VALID clear, HPT_SWAPPED set).
  */
 ptable_entry search_ptable(struct addrspace *as, vaddr_t vaddr, ptable_entry *prev) {
 	KASSERT(vaddr != 0);
 	KASSERT((vaddr & PAGE_FRAME) == vaddr);
-	KASSERT(lock_do_i_hold(hpt_lock));
 
 	uint32_t index = hpt_hash(as, vaddr);
+	KASSERT(spinlock_do_i_hold(&hpt_stripe(index)->lock));
 	pid_t pid = (uint32_t) as;
 	ptable_entry curr = &ptable[index];
 	do {
-		/* if vaddr and pid in curr match and it is valid - found */
-		if ((curr->entryhi & TLBHI_VPAGE) == vaddr && pid == curr->pid && (curr->entrylo & TLBLO_VALID)) break;
+		/* if vaddr and pid in curr match and it is in use (resident or swapped) - found */
+		if ((curr->entryhi & TLBHI_VPAGE) == vaddr && pid == curr->pid && HPT_IN_USE(curr)) break;
 		if (prev != NULL) *prev = curr;
 		curr = curr->next;
 	} while (curr != NULL);
@@ -279,22 +936,129 @@ ptable_entry search_ptable(struct addrspace *as, vaddr_t vaddr, ptable_entry *pr
 
 /*
  * Return an index into the ptable for the given addrspace and addr.
+ * The addrspace pointer is scrambled first so that address spaces allocated
+ * next to each other do not all hash into the same stripe.
  */
 uint32_t hpt_hash(struct addrspace *as, vaddr_t addr) {
 	KASSERT(as != NULL && addr != 0);
 	KASSERT((addr & PAGE_FRAME) == addr);
 	uint32_t index;
-	index = (((uint32_t) as) ^ (addr >> PAGE_BITS)) % total_hpt_pages;
-	return index;
+	index = ((((uint32_t) as) * HPT_HASH_MULT) ^ (addr >> PAGE_BITS)) * HPT_HASH_MULT;
+	return index % total_hpt_pages;
+}
+
+/*
+ * TLB refill fast path: load the existing ptable entry for vaddr into the tlb.
+ * Only the stripe spinlock is taken and the region list is never walked,
+ * since a ptable entry can only exist for a page inside a valid region.
+ * Returns false if the page has not been touched yet or is swapped out.
+ */
+static bool vm_refill(struct addrspace *as, vaddr_t vaddr) {
+	struct hpt_stripe *stripe = hpt_stripe(hpt_hash(as, vaddr));
+	spinlock_acquire(&stripe->lock);
+
+	/* find ptable entry by traversing ptable using next pntrs to handle collisions */
+	ptable_entry curr = search_ptable(as, vaddr, NULL);
+	bool resident = (curr != NULL && (curr->entrylo & TLBLO_VALID));
+
+	if (resident) {
+		int spl = splhigh();
+		tlbpolicy_load(vm_tlbhi(curr->entryhi), curr->entrylo);
+		splx(spl);
+		vaddr_t frame = PADDR_TO_KVADDR(curr->entrylo & TLBLO_PPAGE);
+		frame_set_referenced(frame);
+		frame_adopt(frame, as, vaddr);
+		stripe->refills++;
+	}
+
+	spinlock_release(&stripe->lock);
+	return resident;
+}
+
+/*
+ * Handle a write to a page of a writeable region that is mapped read-only,
+ * i.e. a frame shared copy-on-write by copy_region().
+ * If no other page maps the frame any more it is simply made writeable again,
+ * otherwise its contents are copied into a new frame first.
+ */
+static int vm_cow_fault(struct addrspace *as, vaddr_t vaddr) {
+	struct hpt_stripe *stripe = hpt_stripe(hpt_hash(as, vaddr));
+	spinlock_acquire(&stripe->lock);
+	ptable_entry pt = search_ptable(as, vaddr, NULL);
+	if (pt == NULL) {
+		spinlock_release(&stripe->lock);
+		return EFAULT; /* a readonly fault needs an existing mapping */
+	}
+	if (!(pt->entrylo & TLBLO_VALID)) {
+		/* evicted since the fault - the retried write will swap it in */
+		spinlock_release(&stripe->lock);
+		return 0;
+	}
+	vaddr_t old_frame = PADDR_TO_KVADDR(pt->entrylo & TLBLO_PPAGE);
+
+	/* last reference - only other address spaces can drop references, so nobody can gain one */
+	if (frame_refcount(old_frame) == 1) {
+		frame_set_owner(old_frame, as, vaddr);
+		pt->entrylo |= TLBLO_DIRTY;
+		vm_tlb_update(pt->entryhi, pt->entrylo);
+		stripe->cow_reuses++;
+		spinlock_release(&stripe->lock);
+		return 0;
+	}
+	/*
+	 * Pin the old frame while it is copied outside the stripe lock. Our own reference
+	 * isn't enough: once the other sharers drop theirs, the frame is ours alone and
+	 * the clock may evict it.
+	 */
+	bool pinned = frame_share(old_frame);
+	spinlock_release(&stripe->lock);
+
+	vaddr_t new_frame = vm_alloc_frame();
+	if (new_frame == 0) {
+		if (pinned) free_kpages(old_frame);
+		return ENOMEM; /* out of frames */
+	}
+	if (pinned) memmove((void *) new_frame, (const void *) old_frame, PAGE_SIZE);
+
+	/* the entry may have moved within its chain, so look it up again */
+	spinlock_acquire(&stripe->lock);
+	pt = search_ptable(as, vaddr, NULL);
+	KASSERT(pt != NULL);
+	if (!pinned) {
+		/* too many references to pin - copy under the lock, unless the page was evicted meanwhile */
+		if (!(pt->entrylo & TLBLO_VALID) || (pt->entrylo & TLBLO_PPAGE) != KVADDR_TO_PADDR(old_frame)) {
+			spinlock_release(&stripe->lock);
+			free_kpages(new_frame);
+			return 0; /* the retried write will swap it in */
+		}
+		memmove((void *) new_frame, (const void *) old_frame, PAGE_SIZE);
+	}
+	KASSERT((pt->entrylo & TLBLO_PPAGE) == KVADDR_TO_PADDR(old_frame));
+	pt->entrylo = KVADDR_TO_PADDR(new_frame) | TLBLO_VALID | TLBLO_DIRTY;
+	vm_tlb_update(pt->entryhi, pt->entrylo);
+	vm_tlb_others_stale(as); /* other cpus may still map old_frame read-only */
+	stripe->cow_copies++;
+	spinlock_release(&stripe->lock);
+
+	/* the frame's recorded owner may be us - forget it, the remaining sharer is unknown */
+	frame_set_owner(new_frame, as, vaddr);
+	frame_disown(old_frame, as);
+
+	/* drop this address space's reference to the shared frame, and the pin */
+	free_kpages(old_frame);
+	if (pinned) free_kpages(old_frame);
+	return 0;
 }
 
 /*
  * Find the ptable entry corresponding to the faultaddress and load into the tlb.
+ * Refills of pages that are already mapped take the fast path; only first-touch
+ * faults look up the region and allocate a frame. Writes to read-only pages
+ * of writeable regions break copy-on-write sharing.
  */
 int vm_fault(int faulttype, vaddr_t faultaddress) {
 	switch (faulttype) {
 	case VM_FAULT_READONLY:
-		return EFAULT; /* attempt to write to read-only page */
 	case VM_FAULT_READ:
 	case VM_FAULT_WRITE:
 		break;
@@ -302,55 +1066,128 @@ int vm_fault(int faulttype, vaddr_t faultaddress) {
 		return EINVAL; /* unknown faulttype */
 	}
 	if (curproc == NULL) return EFAULT;
+	if (faulttype != VM_FAULT_READONLY) curproc->p_tlbmisses++; /* only touched by its own thread */
 	struct addrspace *as = proc_getas();
 	if (as == NULL) return EFAULT;
-
-	/* assert that the address space has been set up properly */
-	KASSERT(as->region_list != NULL);
-	struct region *curr_region = as->region_list;
-	uint32_t nregions = 0;
-	struct region *region_found = NULL;
 	faultaddress &= PAGE_FRAME;
+	if (faultaddress == 0) return EFAULT; /* the zero page is never mapped */
 
-	while (curr_region != NULL) {
-		/* assert that region is set up correctly */
-		KASSERT(curr_region->vbase != 0);
-		KASSERT(curr_region->npages != 0);
-		KASSERT((curr_region->vbase & PAGE_FRAME) == curr_region->vbase);
-
-		/* check if vaddr is in a valid region */
-		if (!region_found && faultaddress >= curr_region->vbase && faultaddress < curr_region->vbase + curr_region->npages * PAGE_SIZE) {
-			region_found = curr_region;
-		}
-		curr_region = curr_region->next;
-		nregions++;
+	/* write to a read-only page - only allowed if the page is shared copy-on-write */
+	if (faulttype == VM_FAULT_READONLY) {
+		struct region *reg = as_find_region(as, faultaddress);
+		if (reg == NULL || !reg->writeable) return EFAULT; /* attempt to write to read-only page */
+		return vm_cow_fault(as, faultaddress);
 	}
+
+	/* fast path - page already has a ptable entry */
+	if (vm_fastrefill && vm_refill(as, faultaddress)) return 0;
+
+	struct region *region_found = as_find_region(as, faultaddress);
 	if (region_found == NULL) return EFAULT;
-	KASSERT(as->nregions == nregions);
-	lock_acquire(hpt_lock);
 
-	/* find ptable entry by traversing ptable using next pntrs to handle collisions */
+	/* slow path only - with fast refill off, every refill validates the region first */
+	if (!vm_fastrefill && vm_refill(as, faultaddress)) return 0;
+
+	/* page is on swap - read it back in */
+	bool swapped = false;
+	struct hpt_stripe *stripe = hpt_stripe(hpt_hash(as, faultaddress));
+	spinlock_acquire(&stripe->lock);
 	ptable_entry curr = search_ptable(as, faultaddress, NULL);
+	if (curr != NULL) swapped = (curr->entrylo & HPT_SWAPPED);
+	spinlock_release(&stripe->lock);
+	if (swapped) return vm_swapin(as, faultaddress, region_found->writeable, true);
 
-	if (curr == NULL) {
-		lock_release(hpt_lock);
+	/* program segment or mapped file - read the page in */
+	if (region_found->file != NULL) return vm_file_fault(as, faultaddress, region_found);
 
-		/* lazy page/frame allocation */
-		int ret = insert_ptable_entry(as, faultaddress, region_found->writeable, true);
-		if (ret) return ret;
-	} else {
-		int spl = splhigh();
-		tlb_random(curr->entryhi, curr->entrylo);
-		splx(spl);
-		lock_release(hpt_lock);
+	/* lazy page/frame allocation */
+	return insert_ptable_entry(as, faultaddress, region_found->writeable, true);
+}
+
+/*
+ * Print the fault counters summed over all hpt stripes.
+ */
+void vm_printstats(void) {
+	uint32_t refills = 0, inserts = 0, cow_shares = 0, cow_copies = 0, cow_reuses = 0;
+	uint32_t evictions = 0, swapins = 0, swap_used, swap_total;
+	uint32_t file_reads = 0, file_writes = 0;
+	uint32_t cached, cache_hits, cache_misses;
+	uint32_t text_cached, text_hits, text_misses;
+	for (uint32_t i = 0; i < HPT_NSTRIPES; ++i) {
+		spinlock_acquire(&hpt_stripes[i].lock);
+		refills += hpt_stripes[i].refills;
+		inserts += hpt_stripes[i].inserts;
+		cow_shares += hpt_stripes[i].cow_shares;
+		cow_copies += hpt_stripes[i].cow_copies;
+		cow_reuses += hpt_stripes[i].cow_reuses;
+		evictions += hpt_stripes[i].evictions;
+		swapins += hpt_stripes[i].swapins;
+		file_reads += hpt_stripes[i].file_reads;
+		file_writes += hpt_stripes[i].file_writes;
+		spinlock_release(&hpt_stripes[i].lock);
 	}
-	return 0;
+	swap_usage(&swap_used, &swap_total);
+	framecache_stats(&cached, &cache_hits, &cache_misses);
+	textcache_stats(&text_cached, &text_hits, &text_misses);
+	spinlock_acquire(&zeropool.lock);
+	uint32_t zeroed = zeropool.nframes, zero_hits = zeropool.hits, zero_misses = zeropool.misses;
+	spinlock_release(&zeropool.lock);
+	spinlock_acquire(&asid_lock);
+	uint32_t rollovers = asid_rollovers, flushes = tlb_flushes;
+	spinlock_release(&asid_lock);
+	kprintf("vm: fast tlb refill %s, copy-on-write fork %s, zeroed frame pool %s, asids %s, lazy exec %s, text cache %s\n",
+		vm_fastrefill ? "on" : "off", vm_cow ? "on" : "off", vm_zeropool ? "on" : "off", vm_asids ? "on" : "off",
+		vm_lazyload ? "on" : "off", vm_textcache ? "on" : "off");
+	kprintf("vm: %u tlb refills, %u ptable inserts\n", refills, inserts);
+	kprintf("vm: %s tlb replacement, %u whole-tlb flushes, %u asid rollovers\n", tlbpolicy_name(), flushes, rollovers);
+	kprintf("vm: %u frames shared on fork, %u copied on write, %u reused on write\n", cow_shares, cow_copies, cow_reuses);
+	kprintf("vm: %u pages evicted to swap, %u swapped in\n", evictions, swapins);
+	kprintf("vm: %u program and mapped file pages read in, %u written back\n", file_reads, file_writes);
+	kprintf("vm: %u of %u frames free, %u more in per-cpu caches, %u of %u swap slots used\n",
+		nfree_frames, total_frames, cached, swap_used, swap_total);
+	kprintf("vm: %u frame allocations hit the per-cpu cache, %u missed\n", cache_hits, cache_misses);
+	kprintf("vm: %u first-touch faults took a pre-zeroed frame, %u zeroed their own, %u frames zeroed ahead\n",
+		zero_hits, zero_misses, zeroed);
+	kprintf("vm: %u program page faults hit the text cache, %u read the page, %u frames cached\n",
+		text_hits, text_misses, text_cached);
+}
+
+/*
+ * Reset the fault counters in all hpt stripes.
+ */
+void vm_resetstats(void) {
+	for (uint32_t i = 0; i < HPT_NSTRIPES; ++i) {
+		spinlock_acquire(&hpt_stripes[i].lock);
+		hpt_stripes[i].refills = 0;
+		hpt_stripes[i].inserts = 0;
+		hpt_stripes[i].cow_shares = 0;
+		hpt_stripes[i].cow_copies = 0;
+		hpt_stripes[i].cow_reuses = 0;
+		hpt_stripes[i].evictions = 0;
+		hpt_stripes[i].swapins = 0;
+		hpt_stripes[i].file_reads = 0;
+		hpt_stripes[i].file_writes = 0;
+		spinlock_release(&hpt_stripes[i].lock);
+	}
+	framecache_resetstats();
+	textcache_resetstats();
+	spinlock_acquire(&zeropool.lock);
+	zeropool.hits = 0;
+	zeropool.misses = 0;
+	spinlock_release(&zeropool.lock);
+	spinlock_acquire(&asid_lock);
+	asid_rollovers = 0;
+	tlb_flushes = 0;
+	spinlock_release(&asid_lock);
 }
 
 /*
- * SMP-specific functions. Unused in our configuration.
+ * Invalidate a page evicted by another cpu. The entry is found by the asid it is
+ * tagged with, so it goes whether or not its addrspace is the one running here.
  */
 void vm_tlbshootdown(const struct tlbshootdown *ts) {
-	(void) ts;
-	panic("vm tried to do tlb shootdown?!\n");
+	int spl = splhigh();
+	vm_tlb_invalidate_local(ts->ts_vaddr, ts->ts_asid);
+	splx(spl);
+	V(ts->ts_done);
 }
@@ -40,6 +40,7 @@
  */
 #include <kern/fcntl.h>
 #include <kern/ioctl.h>
+#include <kern/mman.h>
 #include <kern/reboot.h>
 #include <kern/seek.h>
 #include <kern/time.h>
@@ -164,9 +165,7 @@ time_t time(time_t *seconds);			/* calls __time */
  * You should implement this version as this is what we expect to test.
  */
 
-#define PROT_READ 1
-#define PROT_WRITE 2
-
+/* PROT_READ and PROT_WRITE are in <kern/mman.h> */
 void *mmap(size_t length, int prot, int fd, off_t offset);
 int munmap(void *addr);
 
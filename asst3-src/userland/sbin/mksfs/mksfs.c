@@ -60,9 +60,15 @@
 /* Maximum size of freemap we support */
 #define MAXFREEMAPBLOCKS 32
 
+/* Don't give volumes smaller than this many journals a journal */
+#define MINJOURNALFRACTION 8
+
 /* Free block bitmap */
 static char freemapbuf[MAXFREEMAPBLOCKS * SFS_BLOCKSIZE];
 
+/* Location and length of the journal; length 0 if there is none */
+static uint32_t journalstart, journalblocks;
+
 /*
  * Assert that the on-disk data structures are correctly sized.
  */
@@ -73,6 +79,8 @@ check(void)
 	assert(sizeof(struct sfs_superblock)==SFS_BLOCKSIZE);
 	assert(sizeof(struct sfs_dinode)==SFS_BLOCKSIZE);
 	assert(SFS_BLOCKSIZE % sizeof(struct sfs_direntry) == 0);
+	assert(sizeof(struct sfs_jheader)==SFS_BLOCKSIZE);
+	assert(sizeof(struct sfs_jdesc)==SFS_BLOCKSIZE);
 }
 
 /*
@@ -114,6 +122,15 @@ initfreemap(uint32_t fsblocks)
 		allocblock(SFS_FREEMAP_START + i);
 	}
 
+	/* the journal goes right after the freemap, if there's room */
+	if (fsblocks >= MINJOURNALFRACTION * SFS_JOURNALBLOCKS) {
+		journalstart = SFS_FREEMAP_START + freemapblocks;
+		journalblocks = SFS_JOURNALBLOCKS;
+		for (i=0; i<journalblocks; i++) {
+			allocblock(journalstart + i);
+		}
+	}
+
 	/* all blocks in the freemap but past the volume end are "in use" */
 	for (i=fsblocks; i<freemapbits; i++) {
 		allocblock(i);
@@ -140,6 +157,8 @@ writesuper(const char *volname, uint32_t nblocks)
 	sb.sb_magic = SWAP32(SFS_MAGIC);
 	sb.sb_nblocks = SWAP32(nblocks);
 	strcpy(sb.sb_volname, volname);
+	sb.sb_journalstart = SWAP32(journalstart);
+	sb.sb_journalblocks = SWAP32(journalblocks);
 
 	/* and write it out. */
 	diskwrite(&sb, SFS_SUPER_BLOCK);
@@ -164,6 +183,30 @@ writefreemap(uint32_t fsblocks)
 	}
 }
 
+/*
+ * Write out an empty journal: a header and a descriptor that doesn't
+ * match it. The log blocks themselves don't need initializing.
+ */
+static
+void
+writejournal(void)
+{
+	struct sfs_jheader jh;
+	struct sfs_jdesc jd;
+
+	if (journalblocks == 0) {
+		return;
+	}
+
+	bzero((void *)&jh, sizeof(jh));
+	jh.jh_magic = SWAP32(SFS_JHEADER_MAGIC);
+	jh.jh_seq = SWAP32(1);
+	diskwrite(&jh, journalstart + SFS_JHEADER_BLOCK);
+
+	bzero((void *)&jd, sizeof(jd));
+	diskwrite(&jd, journalstart + SFS_JDESC_BLOCK);
+}
+
 /*
  * Write out the root directory inode.
  */
@@ -232,6 +275,7 @@ main(int argc, char **argv)
 	initfreemap(size);
 	writesuper(volname, size);
 	writefreemap(size);
+	writejournal();
 	writerootdir();
 
 	closedisk();
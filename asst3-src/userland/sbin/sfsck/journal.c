@@ -0,0 +1,112 @@
+/*
+ * Metadata journal replay.
+ *
+ * This mirrors the recovery the kernel does at mount time (see
+ * sfs_journal.c): if the descriptor's sequence number matches the
+ * header's and the checksum agrees, the transaction committed but
+ * may not have reached its home blocks, so copy it there and move
+ * the header on. Anything else is an uncommitted or already applied
+ * transaction and is left alone.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <err.h>
+
+#include "compat.h"
+#include <kern/sfs.h>
+
+#include "disk.h"
+#include "utils.h"
+#include "sb.h"
+#include "journal.h"
+#include "main.h"
+
+/*
+ * FNV-1a, continuing from HASH.
+ */
+static
+uint32_t
+jchecksum(uint32_t hash, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	size_t i;
+
+	for (i=0; i<len; i++) {
+		hash ^= p[i];
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+int
+journal_replay(void)
+{
+	struct sfs_jheader jh;
+	struct sfs_jdesc jd;
+	uint32_t start, nblocks, seq, n, block, hash, i;
+	uint8_t *data;
+
+	start = sb_journalstart();
+	if (sb_journalblocks() != SFS_JOURNALBLOCKS) {
+		/* no journal, or sb_check will complain about it */
+		return 0;
+	}
+	nblocks = sb_totalblocks();
+	if (start <= SFS_FREEMAP_START || start + SFS_JOURNALBLOCKS > nblocks) {
+		return 0;
+	}
+
+	diskread(&jh, start + SFS_JHEADER_BLOCK);
+	if (SWAP32(jh.jh_magic) != SFS_JHEADER_MAGIC) {
+		warnx("Journal header has bad magic number (ignored)");
+		setbadness(EXIT_RECOV);
+		return 0;
+	}
+	seq = SWAP32(jh.jh_seq);
+
+	diskread(&jd, start + SFS_JDESC_BLOCK);
+	n = SWAP32(jd.jd_nblocks);
+	if (SWAP32(jd.jd_magic) != SFS_JDESC_MAGIC ||
+	    SWAP32(jd.jd_seq) != seq || n > SFS_JMAXBLOCKS) {
+		/* nothing committed since the last checkpoint */
+		return 0;
+	}
+
+	data = domalloc(n * SFS_BLOCKSIZE);
+	hash = jchecksum(SFS_JCHECKSUM_INIT, jd.jd_blocks,
+			 n * sizeof(jd.jd_blocks[0]));
+	for (i=0; i<n; i++) {
+		diskread(data + i*SFS_BLOCKSIZE, start + SFS_JLOG_START + i);
+		hash = jchecksum(hash, data + i*SFS_BLOCKSIZE, SFS_BLOCKSIZE);
+	}
+	if (hash != SWAP32(jd.jd_checksum)) {
+		/* torn descriptor write; the transaction never committed */
+		free(data);
+		return 0;
+	}
+	for (i=0; i<n; i++) {
+		block = SWAP32(jd.jd_blocks[i]);
+		if (block >= nblocks ||
+		    (block >= start && block < start + SFS_JOURNALBLOCKS)) {
+			warnx("Journal transaction %lu logs bad block %lu "
+			      "(not replayed)", (unsigned long) seq,
+			      (unsigned long) block);
+			setbadness(EXIT_UNRECOV);
+			free(data);
+			return 0;
+		}
+	}
+
+	printf("Replaying journal transaction %lu (%lu blocks)\n",
+	       (unsigned long) seq, (unsigned long) n);
+	for (i=0; i<n; i++) {
+		diskwrite(data + i*SFS_BLOCKSIZE, SWAP32(jd.jd_blocks[i]));
+	}
+	free(data);
+
+	jh.jh_seq = SWAP32(seq + 1);
+	diskwrite(&jh, start + SFS_JHEADER_BLOCK);
+	return 1;
+}
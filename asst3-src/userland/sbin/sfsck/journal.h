@@ -0,0 +1,16 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+/*
+ * The journal module replays a committed transaction left in the
+ * metadata journal by a crash, so the checks that follow see the
+ * volume the way the kernel would after mounting it.
+ */
+
+/*
+ * Call this after loading the superblock. Returns 1 if it wrote
+ * anything, in which case the superblock must be loaded again.
+ */
+int journal_replay(void);
+
+#endif /* JOURNAL_H */
@@ -38,6 +38,7 @@
 #include "sfs.h"
 #include "sb.h"
 #include "freemap.h"
+#include "journal.h"
 #include "inode.h"
 #include "passes.h"
 #include "main.h"
@@ -77,6 +78,9 @@ main(int argc, char **argv)
 
 	sfs_setup();
 	sb_load();
+	if (journal_replay()) {
+		sb_load();
+	}
 	sb_check();
 	freemap_setup();
 
@@ -0,0 +1,123 @@
+/*
+ * bigdir.c
+ *
+ *	Creates a lot of files in one directory, looks each of them up
+ *	again, then removes them, and reports how long each phase took.
+ *	Meant for measuring directory lookup costs.
+ *
+ *	Usage: bigdir [nfiles]     (default 10000)
+ *
+ *	Works in the current directory, in a subdirectory "bigdir.d".
+ *	There's no stat() call, so the lookup phase opens and fstats
+ *	each file instead.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+
+#define DIRNAME "bigdir.d"
+#define DEFAULT_NFILES 10000
+
+static time_t startsecs;
+static unsigned long startnsecs;
+
+static
+void
+starttimer(void)
+{
+	__time(&startsecs, &startnsecs);
+}
+
+static
+void
+stoptimer(const char *what, int n)
+{
+	time_t secs;
+	unsigned long nsecs;
+
+	__time(&secs, &nsecs);
+	if (nsecs < startnsecs) {
+		nsecs += 1000000000;
+		secs--;
+	}
+	nsecs -= startnsecs;
+	secs -= startsecs;
+	printf("%s %d files: %lu.%09lu seconds\n", what, n,
+	       (unsigned long) secs, nsecs);
+}
+
+static
+void
+mkname(char *buf, size_t len, int i)
+{
+	snprintf(buf, len, DIRNAME "/f%d", i);
+}
+
+int
+main(int argc, char *argv[])
+{
+	char name[64];
+	struct stat st;
+	int nfiles, i, fd;
+
+	nfiles = DEFAULT_NFILES;
+	if (argc == 2) {
+		nfiles = atoi(argv[1]);
+	}
+	else if (argc > 2) {
+		errx(1, "Usage: bigdir [nfiles]");
+	}
+	if (nfiles <= 0) {
+		errx(1, "Invalid file count %d", nfiles);
+	}
+
+	if (mkdir(DIRNAME, 0775)) {
+		err(1, "%s: mkdir", DIRNAME);
+	}
+
+	starttimer();
+	for (i=0; i<nfiles; i++) {
+		mkname(name, sizeof(name), i);
+		fd = open(name, O_WRONLY|O_CREAT|O_EXCL, 0664);
+		if (fd < 0) {
+			err(1, "%s: create", name);
+		}
+		close(fd);
+	}
+	stoptimer("Created", nfiles);
+
+	starttimer();
+	for (i=0; i<nfiles; i++) {
+		mkname(name, sizeof(name), i);
+		fd = open(name, O_RDONLY);
+		if (fd < 0) {
+			err(1, "%s: open", name);
+		}
+		if (fstat(fd, &st)) {
+			err(1, "%s: fstat", name);
+		}
+		close(fd);
+	}
+	stoptimer("Looked up", nfiles);
+
+	starttimer();
+	for (i=0; i<nfiles; i++) {
+		mkname(name, sizeof(name), i);
+		if (remove(name)) {
+			err(1, "%s: remove", name);
+		}
+	}
+	stoptimer("Removed", nfiles);
+
+	if (rmdir(DIRNAME)) {
+		err(1, "%s: rmdir", DIRNAME);
+	}
+
+	printf("bigdir done.\n");
+	return 0;
+}
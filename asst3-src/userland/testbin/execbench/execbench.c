@@ -0,0 +1,176 @@
+/*
+ * execbench.c
+ *
+ *	Execs itself over and over with an argv as close to ARG_MAX as
+ *	it can make it, and reports how long each exec took on average.
+ *	Each exec checks that the argv it got is the one it was sent.
+ *	Meant for measuring the cost of moving a big argv through the
+ *	kernel.
+ *
+ *	Usage: execbench [execs] [wordlen]     (default 20, 8)
+ *
+ *	The argv is made of as many words of wordlen letters as fit,
+ *	so a short wordlen makes thousands of arguments and a long one
+ *	a few big ones.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <err.h>
+
+#define _PATH_MYSELF "/testbin/execbench"
+
+#define DEFAULT_EXECS 20
+#define DEFAULT_WORDLEN 8
+
+/* room for argv[0] to argv[6], their pointers and the ending NULL */
+#define HEADROOM 256
+
+/* argv[0] to argv[6]; the words follow */
+#define NFIXED 7
+
+static char word[ARG_MAX];
+static char *args[NFIXED + ARG_MAX / (2 + sizeof(char *)) + 1];
+static char numbufs[NFIXED][16]; /* argv[2] to argv[6] */
+
+static
+int
+countwords(int wordlen)
+{
+	return (ARG_MAX - HEADROOM) / (wordlen + 1 + sizeof(char *));
+}
+
+static
+void
+fillword(int wordlen)
+{
+	int i;
+
+	for (i=0; i<wordlen; i++) {
+		word[i] = 'a' + i % 26;
+	}
+	word[wordlen] = 0;
+}
+
+/*
+ * Exec the next round. argv[1] is the "-r" marker, then the execs
+ * left, the total, the word length and the start time.
+ */
+static
+void
+next(int left, int total, int wordlen, time_t secs, unsigned long nsecs)
+{
+	int nwords, i;
+
+	snprintf(numbufs[2], sizeof(numbufs[2]), "%d", left);
+	snprintf(numbufs[3], sizeof(numbufs[3]), "%d", total);
+	snprintf(numbufs[4], sizeof(numbufs[4]), "%d", wordlen);
+	snprintf(numbufs[5], sizeof(numbufs[5]), "%lu", (unsigned long) secs);
+	snprintf(numbufs[6], sizeof(numbufs[6]), "%lu", nsecs);
+
+	args[0] = (char *)_PATH_MYSELF;
+	args[1] = (char *)"-r";
+	for (i=2; i<NFIXED; i++) {
+		args[i] = numbufs[i];
+	}
+	nwords = countwords(wordlen);
+	for (i=0; i<nwords; i++) {
+		args[NFIXED + i] = word;
+	}
+	args[NFIXED + nwords] = NULL;
+
+	execv(_PATH_MYSELF, args);
+	err(1, "execv");
+}
+
+static
+void
+check(int argc, char *argv[], int wordlen)
+{
+	int nwords, i;
+
+	nwords = countwords(wordlen);
+	if (argc != NFIXED + nwords) {
+		errx(1, "FAILED: argc is %d, expected %d",
+		     argc, NFIXED + nwords);
+	}
+	for (i=NFIXED; i<argc; i++) {
+		if (strcmp(argv[i], word) != 0) {
+			errx(1, "FAILED: argv[%d] is wrong", i);
+		}
+	}
+	if (argv[argc] != NULL) {
+		errx(1, "FAILED: argv[argc] is not NULL");
+	}
+}
+
+static
+void
+report(int total, int wordlen, time_t startsecs, unsigned long startnsecs)
+{
+	time_t secs;
+	unsigned long nsecs, usecs;
+
+	__time(&secs, &nsecs);
+	if (nsecs < startnsecs) {
+		nsecs += 1000000000;
+		secs--;
+	}
+	nsecs -= startnsecs;
+	secs -= startsecs;
+	usecs = (unsigned long) secs * 1000000 + nsecs / 1000;
+
+	printf("%d execs with %d args of %d letters: %lu.%09lu seconds "
+	       "(%lu usecs per exec)\n", total, NFIXED + countwords(wordlen),
+	       wordlen, (unsigned long) secs, nsecs, usecs / total);
+}
+
+int
+main(int argc, char *argv[])
+{
+	time_t secs;
+	unsigned long nsecs;
+	int left, total, wordlen;
+
+	if (argc >= NFIXED && !strcmp(argv[1], "-r")) {
+		/* one of our own execs */
+		left = atoi(argv[2]);
+		total = atoi(argv[3]);
+		wordlen = atoi(argv[4]);
+		secs = atoi(argv[5]);
+		nsecs = atoi(argv[6]);
+		fillword(wordlen);
+		check(argc, argv, wordlen);
+		if (left > 0) {
+			next(left - 1, total, wordlen, secs, nsecs);
+		}
+		report(total, wordlen, secs, nsecs);
+		return 0;
+	}
+
+	if (argc > 3) {
+		errx(1, "Usage: execbench [execs] [wordlen]");
+	}
+	total = DEFAULT_EXECS;
+	wordlen = DEFAULT_WORDLEN;
+	if (argc > 1) {
+		total = atoi(argv[1]);
+	}
+	if (argc > 2) {
+		wordlen = atoi(argv[2]);
+	}
+	if (total <= 0) {
+		errx(1, "Invalid exec count %d", total);
+	}
+	if (wordlen <= 0 || countwords(wordlen) <= 0) {
+		errx(1, "Invalid word length %d", wordlen);
+	}
+
+	fillword(wordlen);
+	__time(&secs, &nsecs);
+	next(total - 1, total, wordlen, secs, nsecs);
+	return 1;
+}
@@ -0,0 +1,149 @@
+/*
+ * mmapbench.c
+ *
+ *	Reads a file with read() and then through mmap(), and reports
+ *	how long each took. Both sum the bytes of the file, and the
+ *	sums have to agree. Meant for comparing the cost of copying a
+ *	file through read() with faulting its pages in directly.
+ *
+ *	Usage: mmapbench <file> [passes]     (default 2)
+ *
+ *	Each pass does both, so with more than one pass the later ones
+ *	show the cost with the file's blocks already in the buffer
+ *	cache. Make the file with e.g. "bigfile big 1000000" first.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+
+#define DEFAULT_PASSES 2
+
+static char buffer[4096];
+
+static time_t startsecs;
+static unsigned long startnsecs;
+
+static
+void
+starttimer(void)
+{
+	__time(&startsecs, &startnsecs);
+}
+
+static
+void
+stoptimer(const char *what, off_t size)
+{
+	time_t secs;
+	unsigned long nsecs;
+
+	__time(&secs, &nsecs);
+	if (nsecs < startnsecs) {
+		nsecs += 1000000000;
+		secs--;
+	}
+	nsecs -= startnsecs;
+	secs -= startsecs;
+	printf("%s %lu bytes: %lu.%09lu seconds\n", what,
+	       (unsigned long) size, (unsigned long) secs, nsecs);
+}
+
+static
+unsigned long
+sum_read(int fd, const char *filename)
+{
+	unsigned long sum;
+	ssize_t len, i;
+
+	if (lseek(fd, 0, SEEK_SET) < 0) {
+		err(1, "%s: lseek", filename);
+	}
+	sum = 0;
+	while ((len = read(fd, buffer, sizeof(buffer))) > 0) {
+		for (i=0; i<len; i++) {
+			sum += (unsigned char) buffer[i];
+		}
+	}
+	if (len < 0) {
+		err(1, "%s: read", filename);
+	}
+	return sum;
+}
+
+static
+unsigned long
+sum_mmap(int fd, const char *filename, off_t size)
+{
+	unsigned long sum;
+	unsigned char *p;
+	off_t i;
+
+	p = mmap(size, PROT_READ, fd, 0);
+	if (p == (void *)-1) {
+		err(1, "%s: mmap", filename);
+	}
+	sum = 0;
+	for (i=0; i<size; i++) {
+		sum += p[i];
+	}
+	if (munmap(p)) {
+		err(1, "%s: munmap", filename);
+	}
+	return sum;
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *filename;
+	struct stat st;
+	unsigned long readsum, mmapsum;
+	int passes, i, fd;
+
+	if (argc < 2 || argc > 3) {
+		errx(1, "Usage: mmapbench <file> [passes]");
+	}
+	filename = argv[1];
+	passes = DEFAULT_PASSES;
+	if (argc == 3) {
+		passes = atoi(argv[2]);
+	}
+	if (passes <= 0) {
+		errx(1, "Invalid pass count %d", passes);
+	}
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		err(1, "%s: open", filename);
+	}
+	if (fstat(fd, &st)) {
+		err(1, "%s: fstat", filename);
+	}
+	if (st.st_size == 0) {
+		errx(1, "%s: file is empty", filename);
+	}
+
+	for (i=0; i<passes; i++) {
+		starttimer();
+		readsum = sum_read(fd, filename);
+		stoptimer("read()", st.st_size);
+
+		starttimer();
+		mmapsum = sum_mmap(fd, filename, st.st_size);
+		stoptimer("mmap()", st.st_size);
+
+		if (readsum != mmapsum) {
+			errx(1, "FAILED: read() sum %lu, mmap() sum %lu",
+			     readsum, mmapsum);
+		}
+	}
+
+	close(fd);
+	printf("mmapbench done.\n");
+	return 0;
+}
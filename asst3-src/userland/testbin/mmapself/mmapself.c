@@ -0,0 +1,158 @@
+/*
+ * mmapself.c
+ *
+ *	Reads a file into a fresh mapping of itself, then writes it
+ *	from another fresh mapping back over itself, and checks the
+ *	file's contents are unchanged. None of the mapped pages have
+ *	been touched before the read() or write(), so the kernel has to
+ *	read them in from the file it is in the middle of reading or
+ *	writing. Also reads this program into its own data segment,
+ *	whose pages are loaded from the executable on first touch.
+ *
+ *	Usage: mmapself <file>
+ *
+ *	The file is rewritten with its own contents, so it should be a
+ *	scratch file, e.g. one made with "bigfile big 100000". Run it
+ *	on SFS to check that the file system doesn't deadlock.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+
+#define _PATH_MYSELF "/testbin/mmapself"
+
+static char buffer[4096];
+
+/* initialized, so it's in the data segment rather than the bss */
+static char databuf[16384] = { 1 };
+
+static
+unsigned long
+sum(int fd, const char *filename)
+{
+	unsigned long total;
+	ssize_t len, i;
+
+	if (lseek(fd, 0, SEEK_SET) < 0) {
+		err(1, "%s: lseek", filename);
+	}
+	total = 0;
+	while ((len = read(fd, buffer, sizeof(buffer))) > 0) {
+		for (i=0; i<len; i++) {
+			total += (unsigned char) buffer[i];
+		}
+	}
+	if (len < 0) {
+		err(1, "%s: read", filename);
+	}
+	return total;
+}
+
+static
+void
+selfio(int fd, const char *filename, off_t size, int rw)
+{
+	char *p;
+	ssize_t len;
+
+	p = mmap(size, PROT_READ | PROT_WRITE, fd, 0);
+	if (p == (void *)-1) {
+		err(1, "%s: mmap", filename);
+	}
+	if (lseek(fd, 0, SEEK_SET) < 0) {
+		err(1, "%s: lseek", filename);
+	}
+	if (rw) {
+		len = write(fd, p, size);
+	}
+	else {
+		len = read(fd, p, size);
+	}
+	if (len < 0) {
+		err(1, "%s: %s into its own mapping", filename,
+		    rw ? "write" : "read");
+	}
+	if (len != size) {
+		errx(1, "FAILED: %s: %s of %lu bytes did %ld", filename,
+		     rw ? "write" : "read", (unsigned long) size, (long) len);
+	}
+	if (munmap(p)) {
+		err(1, "%s: munmap", filename);
+	}
+}
+
+static
+void
+readmyself(void)
+{
+	int fd;
+	ssize_t len;
+
+	fd = open(_PATH_MYSELF, O_RDONLY);
+	if (fd < 0) {
+		err(1, "%s: open", _PATH_MYSELF);
+	}
+	len = read(fd, databuf, sizeof(databuf));
+	if (len < 0) {
+		err(1, "%s: read into the data segment", _PATH_MYSELF);
+	}
+	if (len < 4 || databuf[0] != 0x7f || databuf[1] != 'E' ||
+	    databuf[2] != 'L' || databuf[3] != 'F') {
+		errx(1, "FAILED: %s: read into the data segment got the "
+		     "wrong bytes", _PATH_MYSELF);
+	}
+	close(fd);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *filename;
+	struct stat st;
+	unsigned long before, after;
+	int fd;
+
+	if (argc != 2) {
+		errx(1, "Usage: mmapself <file>");
+	}
+	filename = argv[1];
+
+	fd = open(filename, O_RDWR);
+	if (fd < 0) {
+		err(1, "%s: open", filename);
+	}
+	if (fstat(fd, &st)) {
+		err(1, "%s: fstat", filename);
+	}
+	if (st.st_size == 0) {
+		errx(1, "%s: file is empty", filename);
+	}
+
+	before = sum(fd, filename);
+
+	selfio(fd, filename, st.st_size, 0);
+	after = sum(fd, filename);
+	if (after != before) {
+		errx(1, "FAILED: sum was %lu, %lu after the read", before,
+		     after);
+	}
+
+	selfio(fd, filename, st.st_size, 1);
+	after = sum(fd, filename);
+	if (after != before) {
+		errx(1, "FAILED: sum was %lu, %lu after the write", before,
+		     after);
+	}
+
+	close(fd);
+
+	readmyself();
+
+	printf("mmapself: passed.\n");
+	return 0;
+}